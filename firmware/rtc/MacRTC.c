@@ -22,8 +22,11 @@
    * 2020-09-04: <https://www.gryphel.com/d/minivmac/minivmac-36.04/minivmac-36.04.src.tgz>
 */
 
-// 8 MHz clock is recommended for a physical device.  For real-time
-// simulation, a slower 400 kHz clock is needed.
+// 8 MHz clock is recommended for a physical device.  The `simavr`
+// test bench runs the 8 MHz build in virtual time.  For real-time
+// simulation, a slower 400 kHz clock is needed.  Other frequencies
+// work too, the timer constants are derived from F_CPU, i.e. 16 MHz
+// from the PLL for 5V operation or 1 MHz for lower battery drain.
 #ifndef F_CPU
 #define F_CPU 8000000UL
 //#define F_CPU 400000UL // DEBUG
@@ -33,33 +36,50 @@
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
+#include <avr/power.h>
+
+#include "rtc-core.h"
+#include "rtc-hal.h"
 
 /* Fuse bit programming.  */
 #if defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || \
   defined(__AVR_ATtiny85__)
 FUSES = {
+#if F_CPU == 16000000UL
+  // Use 16 MHz PLL clock.
+  .low = ((LFUSE_DEFAULT | ~FUSE_CKDIV8 | ~FUSE_CKSEL0) & FUSE_CKSEL1),
+#elif F_CPU == 1000000UL
+  // Use default 1 MHz internal clock, 8 MHz divided by 8.
+  .low = LFUSE_DEFAULT,
+#else
   // Use 8 MHz internal clock, not default 1 MHz internal clock.
   .low = (LFUSE_DEFAULT | ~FUSE_CKDIV8),
+#endif
   // Disable the external RESET pin since it is used for the 1-second
-  // interrupt output.
-  .high = (HFUSE_DEFAULT & FUSE_RSTDISBL),
+  // interrupt output.  Keep the EEPROM, and the PRAM saved in it,
+  // through the chip erase when reprogramming.
+  .high = (HFUSE_DEFAULT & FUSE_RSTDISBL & FUSE_EESAVE),
+  .extended = EFUSE_DEFAULT,
+};
+#elif defined(__AVR_ATtiny87__) || defined(__AVR_ATtiny167__)
+FUSES = {
+#if F_CPU == 1000000UL
+  // Use default 1 MHz internal clock, 8 MHz divided by 8.
+  .low = LFUSE_DEFAULT,
+#elif F_CPU == 8000000UL
+  // Use 8 MHz internal clock, not default 1 MHz internal clock.
+  .low = (LFUSE_DEFAULT | ~FUSE_CKDIV8),
+#else
+  // The crystal pins are taken by the watch crystal, so there is no
+  // other clock source.
+#error "Invalid clock frequency selection, use 8 MHz or 1 MHz on the ATtiny87"
+#endif
+  // RESET has a pin of its own on this part, so keep it for
+  // reprogramming.  Keep the EEPROM through the chip erase.
+  .high = (HFUSE_DEFAULT & FUSE_EESAVE),
   .extended = EFUSE_DEFAULT,
 };
 #endif
-
-/********************************************************************/
-// Simplified Arduino.h definitions.
-typedef enum { false, true } bool; // Compatibility with C++.
-typedef bool boolean;
-typedef uint8_t bool8_t;
-typedef uint8_t byte;
-
-#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
-#define bitSet(value, bit) ((value) |= (1UL << (bit)))
-#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
-#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
-// END simplified Arduino.h definitions.
-/********************************************************************/
 
 /****************************************
  *                                      *
@@ -88,12 +108,24 @@ typedef uint8_t byte;
  *                  +----+                   *
  *********************************************/
 
+/* With an ATtiny87 or ATtiny167, see `AsyncClock`, the serial pins
+   stay on port B where possible.  The crystal goes on XTAL1 (PB4) and
+   XTAL2 (PB5), the serial clock moves to the INT0 pin, and the 1Hz
+   square wave comes from the OC0A pin on port A.  RESET (PB7) is left
+   alone.  */
+#if defined(__AVR_ATtiny87__) || defined(__AVR_ATtiny167__)
+const int      ONE_SEC_PIN = 2;   // A 1Hz square wave from OC0A on PA2
+const int  RTC_ENABLE_PIN  = 0;   // Active low chip enable on PB0
+const int  SERIAL_DATA_PIN = HAL_DATA_PIN; // Bi-directional serial data line on PB1
+const int SERIAL_CLOCK_PIN = 6;   // Serial clock input on PB6
+#else
 const int       SOFT_XTAL1 = 4;   // (software) inverting amplifier input on PB4
 const int       SOFT_XTAL2 = 3;   // (software) inverting amplifier output on PB3
 const int      ONE_SEC_PIN = 5;   // A 1Hz square wave on PB5
 const int  RTC_ENABLE_PIN  = 0;   // Active low chip enable on PB0
-const int  SERIAL_DATA_PIN = 1;   // Bi-directional serial data line on PB1
+const int  SERIAL_DATA_PIN = HAL_DATA_PIN; // Bi-directional serial data line on PB1
 const int SERIAL_CLOCK_PIN = 2;   // Serial clock input on PB2
+#endif
 
 /* ELECTRICAL SPECIFICATIONS:
 
@@ -136,7 +168,8 @@ const int SERIAL_CLOCK_PIN = 2;   // Serial clock input on PB2
      asynchronous timer.  Though it has extra pins, it comes in a
      smaller form factor, so you can just mount it on a custom adapter
      circuit board that breaks out the desired pins to through-hole
-     and ignores/grounds the unnecessary pins.
+     and ignores/grounds the unnecessary pins.  Building for the
+     ATtiny87 selects `AsyncClock`.
 
    * Because the ATTiny85 cannot use the 32.768 kHz crystal
      oscillator, we configure the respective pins to some sane default
@@ -148,47 +181,306 @@ const int SERIAL_CLOCK_PIN = 2;   // Serial clock input on PB2
      inverting amplifier, possibly with the assistance of a few other
      external passives.
 
-   * TODO: Determine the target standby power consumption.
+   * Standby power consumption: while deselected, the AVR sleeps in
+     idle mode, only waking up for the timer interrupt, see
+     `enterStandby()`.  The `test-rtc` test bench estimates the
+     average supply current from simulated residency in each sleep
+     mode and clock frequency, using the datasheet's typical figures
+     at 3 V.  For the default build at 8 MHz, with the clock divided
+     down to 500 kHz in standby, the estimate is roughly 30 uA, almost
+     all of it idle mode current.  With `AsyncClock`, standby is spent
+     in power-save mode instead, which only keeps the crystal
+     oscillator and Timer0 running.
 */
 
-#if NoXPRAM
-// Models earlier than the Plus had 20 bytes of PRAM
-#define PRAM_SIZE 20
-const int group1Base = 0x00;
-const int group2Base = 0x10;
+/* With `PersistPram`, PRAM is saved to EEPROM so that the settings
+   survive a dead battery.  An EEPROM write takes milliseconds, far
+   too long to do while the host is talking to us, so host writes
+   only mark the PRAM byte dirty.  `loop()` writes the dirty bytes
+   back one EEPROM operation at a time, only while the RTC is
+   deselected and once PRAM has been left alone for `PERSIST_DELAY`
+   half-seconds, so that repeated writes to a byte coalesce.  It
+   never waits for an operation to finish, the EEPROM ready interrupt
+   wakes the AVR up for the next one instead.
+
+   The EEPROM holds a PRAM image, a format byte, then a journal of
+   two-byte records, PRAM address then data, filling the rest of the
+   EEPROM.  Dirty bytes are appended to the journal, so repeated
+   writes to one PRAM byte are spread over the journal rather than
+   wearing out one EEPROM cell.  When the journal is full, it is
+   folded into the image, newest record first so that an image byte
+   is written at most once per journal's worth of writes, 127 records
+   for XPRAM, and then erased.  The fold only takes values from the
+   journal, never from SRAM, so that the image never gets ahead of
+   the journal: if the power goes mid-fold, replaying the journal
+   still gives the last saved value of every byte.  Bytes written
+   since stay dirty and are journaled once the erase is done.  An
+   unformatted EEPROM has no journal to fold, so the image is written
+   from SRAM instead, which is safe because the format byte only goes
+   in after that.  An erased address byte ends the journal,
+   so a record is written data byte first and only counts once its
+   address byte is in.  That also means PRAM address 0xff can't be
+   journaled, so it is written straight to the image instead.
+
+   `setup()` restores PRAM by reading the image and replaying the
+   journal on top of it.  That's only EEPROM reads, which take a few
+   cycles each.  */
+#ifndef PersistPram
+#define PersistPram 1
+#endif
+
+/* With `Timer1Clock`, timekeeping runs from Timer1 rather than Timer0.
+   Timer1 has prescalers up to 1/16384, so a whole half-second fits in
+   one 8-bit compare period, and the core only wakes up twice a second
+   to keep time rather than once per Timer0 overflow, 32 times a
+   second at 8 MHz.  The compare period is stretched by one tick
+   whenever the fractional tick adds up, the same as the remainder in
+   the Timer0 scheme, so long-term accuracy is the same.
+
+   The trade-off is that Timer1 draws considerably more supply current
+   than Timer0 while it is running.  Whether the fewer wakeups make up
+   for it depends on the part and supply voltage, so this is not the
+   default.  The `wakeups` test case in `test-rtc` measures wakeups
+   and active cycles per hour for either build.  */
+#ifndef Timer1Clock
+#define Timer1Clock 0
+#endif
+
+/* `AsyncClock` follows the part: the ATtiny87 and ATtiny167 keep time
+   with Timer0 in asynchronous mode, clocked from the 32.768 kHz watch
+   crystal on XTAL1 and XTAL2 rather than from the system clock.  With
+   a 1/128 prescaler, the 8-bit counter wraps around exactly once a
+   second, so there are no remainders to book-keep and the overflow
+   interrupt is the only timer interrupt.  Timer0 runs in inverting
+   fast PWM mode with OCR0A half way, so OC0A generates the one-second
+   square wave in hardware, going low as the counter wraps around.
+
+   The asynchronous timer keeps running in power-save mode, which
+   stops every other clock, so that's where standby is spent, see
+   `selectSleepMode()`.  Since the core is only told about whole
+   seconds, the read latch expires one to two seconds after it was
+   taken rather than a half to one.
+
+   With `Telemetry`, Timer1 measures latencies.  The hardware wraps
+   the counter around by itself, so the timer handler can't slip and
+   that counter stays zero.  `UsiSerial` can't be supported: the USI
+   clock pin is PB2, while the serial clock has to be on the INT0 pin,
+   PB6.
+
+   This port is experimental.  It has never been built with avr-gcc,
+   and `simavr` has no ATtiny87 core, so it has never been run on the
+   `test-rtc` test bench, which refuses it, or on hardware.  `make
+   check` leaves it out until it can be tested.  */
+#if defined(__AVR_ATtiny87__) || defined(__AVR_ATtiny167__)
+#define AsyncClock 1
 #else
-// Mac Plus used the xPRAM chip with 256 bytes
-#define PRAM_SIZE 256
-const int group1Base = 0x10;
-const int group2Base = 0x08;
+#define AsyncClock 0
+#endif
+#if AsyncClock && Timer1Clock
+#error "Timer1Clock is not supported with AsyncClock"
+#endif
+#if AsyncClock && UsiSerial
+#error "UsiSerial is not supported with AsyncClock, USCK is not the INT0 pin"
 #endif
 
-// Timer constants
-#if F_CPU == 8000000UL
-#define PRESCALER_MASK 0b101 /* 1/1024 */
-#define LIM_OFLOWS 15
-#define LIM_REMAIN 66
-#define NUMER_FRAC_REMAIN 1
-// `fracRemain` denominator is assumed to be a power-of-two, this
-// makes calculations more efficient.
-#define DENOM_FRAC_REMAIN 4
-#define MASK_FRAC_REMAIN (DENOM_FRAC_REMAIN-1)
+/* Interrupt control registers, which have other names on the
+   ATtiny87.  Its port B pins are PCINT8 to PCINT15, on the second pin
+   change interrupt.  */
+#if AsyncClock
+#define INT0_MASK_REG EIMSK
+#define INT0_FLAG_REG EIFR
+#define INT0_SENSE_REG EICRA
+#define PCINT_CTRL_REG PCICR
+#define PCINT_CTRL_BIT PCIE1
+#define PCINT_MASK_REG PCMSK1
+#define RTC_ENABLE_PCINT PCINT8
+#define SERIAL_CLOCK_PCINT PCINT14
+#define RTC_ENABLE_vect PCINT1_vect
+// ASSR flags of asynchronous register writes still in progress.
+#define ASYNC_BUSY \
+  (_BV(TCN0UB) | _BV(OCR0AUB) | _BV(TCR0AUB) | _BV(TCR0BUB))
+#else
+#define INT0_MASK_REG GIMSK
+#define INT0_FLAG_REG GIFR
+#define INT0_SENSE_REG MCUCR
+#define PCINT_CTRL_REG GIMSK
+#define PCINT_CTRL_BIT PCIE
+#define PCINT_MASK_REG PCMSK
+#define RTC_ENABLE_PCINT PCINT0
+#define SERIAL_CLOCK_PCINT PCINT2
+#define RTC_ENABLE_vect PCINT0_vect
+#endif
 
-#elif F_CPU == 400000UL
+/* Timer constants, derived from F_CPU, see the explanation below.
+   Choose the largest prescaler that still leaves more than one timer
+   overflow per half-second, fewer overflow interrupts means less time
+   spent awake.  For Timer1, choose the smallest prescaler that fits a
+   half-second plus the fractional tick into a single compare period,
+   this keeps the phase shifts from clock switches small.  */
+#define HALF_SEC_CYCLES (F_CPU / 2)
+#if AsyncClock
+// The crystal clocks the timer, see above.
+#define PRESCALER 128
+#define PRESCALER_MASK 0b101 /* 1/128 */
+#elif Timer1Clock
+#if HALF_SEC_CYCLES / 256 < 256
+#define PRESCALER 256
+#define PRESCALER_MASK 0b1001 /* 1/256 */
+#elif HALF_SEC_CYCLES / 512 < 256
+#define PRESCALER 512
+#define PRESCALER_MASK 0b1010 /* 1/512 */
+#elif HALF_SEC_CYCLES / 1024 < 256
+#define PRESCALER 1024
+#define PRESCALER_MASK 0b1011 /* 1/1024 */
+#elif HALF_SEC_CYCLES / 2048 < 256
+#define PRESCALER 2048
+#define PRESCALER_MASK 0b1100 /* 1/2048 */
+#elif HALF_SEC_CYCLES / 4096 < 256
+#define PRESCALER 4096
+#define PRESCALER_MASK 0b1101 /* 1/4096 */
+#elif HALF_SEC_CYCLES / 8192 < 256
+#define PRESCALER 8192
+#define PRESCALER_MASK 0b1110 /* 1/8192 */
+#elif HALF_SEC_CYCLES / 16384 < 256
+#define PRESCALER 16384
+#define PRESCALER_MASK 0b1111 /* 1/16384 */
+#else
+#error "Invalid clock frequency selection, F_CPU too high for Timer1Clock"
+#endif
+#elif HALF_SEC_CYCLES / 1024 > 256
+#define PRESCALER 1024
+#define PRESCALER_MASK 0b101 /* 1/1024 */
+#elif HALF_SEC_CYCLES / 256 > 256
+#define PRESCALER 256
 #define PRESCALER_MASK 0b100 /* 1/256 */
-#define LIM_OFLOWS 3
-#define LIM_REMAIN 13
-#define NUMER_FRAC_REMAIN 1
-// `fracRemain` denominator is assumed to be a power-of-two, this
-// makes calculations more efficient.
-#define DENOM_FRAC_REMAIN 4
+#elif HALF_SEC_CYCLES / 64 > 256
+#define PRESCALER 64
+#define PRESCALER_MASK 0b011 /* 1/64 */
+#elif HALF_SEC_CYCLES / 8 > 256
+#define PRESCALER 8
+#define PRESCALER_MASK 0b010 /* 1/8 */
+#elif HALF_SEC_CYCLES > 256
+#define PRESCALER 1
+#define PRESCALER_MASK 0b001 /* 1/1 */
+#else
+#error "Invalid clock frequency selection, F_CPU too low"
+#endif
+
+// Whole timer ticks per half-second, and the fractional tick left
+// over in core clock cycles.
+#if AsyncClock
+#define HALF_SEC_TICKS (32768UL / 2 / PRESCALER)
+#define FRAC_TICK_CYCLES 0
+#else
+#define HALF_SEC_TICKS (HALF_SEC_CYCLES / PRESCALER)
+#define FRAC_TICK_CYCLES (HALF_SEC_CYCLES % PRESCALER)
+#endif
+
+/* The final remainder must be at least one tick, so if the ticks
+   divide evenly into overflows, wait for one full overflow as the
+   remainder.  Timer1 never overflows, the whole half-second is the
+   remainder.  With `AsyncClock`, the remainder is only reported to
+   the test bench, it is where OCR0A splits each second in two.  */
+#if Timer1Clock || AsyncClock
+#define LIM_OFLOWS 0
+#define LIM_REMAIN HALF_SEC_TICKS
+#elif HALF_SEC_TICKS % 256 == 0
+#define LIM_OFLOWS (HALF_SEC_TICKS / 256 - 1)
+#define LIM_REMAIN 256
+#else
+#define LIM_OFLOWS (HALF_SEC_TICKS / 256)
+#define LIM_REMAIN (HALF_SEC_TICKS % 256)
+#endif
+
+/* Reduce the fractional tick to lowest terms.  The prescaler is a
+   power of two, so the denominator is too.  */
+#if FRAC_TICK_CYCLES == 0
+#define NUMER_FRAC_REMAIN 0
+#define DENOM_FRAC_REMAIN 1
+#else
+#define FRAC_LOWBIT (FRAC_TICK_CYCLES & -FRAC_TICK_CYCLES)
+#define NUMER_FRAC_REMAIN (FRAC_TICK_CYCLES / FRAC_LOWBIT)
+#define DENOM_FRAC_REMAIN (PRESCALER / FRAC_LOWBIT)
+#endif
+// `fracRemain` denominator is a power-of-two, this makes calculations
+// more efficient.
 #define MASK_FRAC_REMAIN (DENOM_FRAC_REMAIN-1)
 
+#if LIM_OFLOWS + 1 > 255
+#error "Invalid clock frequency selection, F_CPU too high"
+#endif
+#if LIM_REMAIN == 256 && NUMER_FRAC_REMAIN != 0
+#error "Invalid clock frequency selection, unsupported timer remainder"
+#endif
+
+/* Dynamic clock scaling.  While the Macintosh isn't talking to us, we
+   divide the system clock down with CLKPR to draw less current, and
+   switch back to the full F_CPU as soon as CE goes low.  The timer
+   runs from the system clock, so its prescaler is divided down by the
+   same factor at the same time.  That keeps the timer tick, and with it
+   all of the `oflowInterrupt()` book-keeping, the same across
+   switches.  The prescaler's counter keeps running through a switch,
+   so each switch shifts the phase of the current tick by up to one
+   tick either way.  CE is asynchronous to the timer, so these shifts
+   average out to zero over each pair of switches.
+
+   The idle clock is kept at 250 kHz or above so that waking up on CE
+   and switching back to the full clock only takes microseconds.  */
+#ifndef ClockScaling
+#define ClockScaling 1
+#endif
+
+// CLKPR clock division setting for the full F_CPU.  At 1 MHz, that's
+// the CKDIV8 fuse dividing the 8 MHz internal clock by 8.
+#if F_CPU == 1000000UL
+#define FAST_CLKPS 3
+#else
+#define FAST_CLKPS 0
+#endif
+
+#define IDLE_F_CPU_MIN 250000UL
+#if !ClockScaling
+#elif AsyncClock
+// The timer doesn't run from the system clock, and standby stops the
+// system clock altogether.
+#undef ClockScaling
+#define ClockScaling 0
+#elif Timer1Clock && F_CPU / 16 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 4
+#elif Timer1Clock && F_CPU / 8 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 3
+#elif Timer1Clock && F_CPU / 4 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 2
+#elif Timer1Clock && F_CPU / 2 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 1
+#elif PRESCALER == 1024 && F_CPU / 16 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 4
+#define IDLE_PRESCALER_MASK 0b011 /* 1/64 */
+#elif PRESCALER == 1024 && F_CPU / 4 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 2
+#define IDLE_PRESCALER_MASK 0b100 /* 1/256 */
+#elif PRESCALER == 256 && F_CPU / 4 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 2
+#define IDLE_PRESCALER_MASK 0b011 /* 1/64 */
+#elif PRESCALER == 64 && F_CPU / 8 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 3
+#define IDLE_PRESCALER_MASK 0b010 /* 1/8 */
+#elif PRESCALER == 8 && F_CPU / 8 >= IDLE_F_CPU_MIN
+#define IDLE_CLKPS_SHIFT 3
+#define IDLE_PRESCALER_MASK 0b001 /* 1/1 */
 #else
-#error "Invalid clock frequency selection"
+// The clock is already too slow to divide down any further.
+#undef ClockScaling
+#define ClockScaling 0
+#endif
+#define IDLE_CLKPS (FAST_CLKPS + IDLE_CLKPS_SHIFT)
+#if ClockScaling && Timer1Clock
+// Timer1 prescalers are all powers of two, one apart per step.
+#define IDLE_PRESCALER_MASK (PRESCALER_MASK - IDLE_CLKPS_SHIFT)
 #endif
 
-/* Explanation of the 1-second timer calculations.
+/* Explanation of the 1-second timer calculations, worked through for
+   an 8 MHz clock.  The preprocessor does the same for any F_CPU.
 
    First divide the AVR core clock frequency by two since we count
    half-second cycles.
@@ -219,45 +511,136 @@ const int group2Base = 0x08;
    half-second cycles, the error is one full counter tick to add to
    the fractional overflow.  So, every 4 half-second cycles, we use 67
    as the remainder rather than 66.
-*/
 
-enum SerialStateType { SERIAL_DISABLED, RECEIVING_COMMAND,
-                       SENDING_DATA, RECEIVING_DATA,
-                       RECEIVING_XCMD_ADDR, RECEIVING_XCMD_DATA };
+   In general, the prescaler is a power of two, so the fractional
+   tick always reduces to a power-of-two denominator.  At 1 MHz, for
+   example, it is 288/1024 = 9/32 of a tick per half-second.
+
+   With `Timer1Clock`, the same works out for a 1/16384 prescaler:
+
+   4000000 / 16384 = 244 + 2304/16384 = 244 + 9/64
+
+   Timer1 runs in CTC mode and clears after 244 ticks, or after 245
+   ticks whenever `fracRemain` adds up to a whole tick, which is 9
+   times every 64 half-seconds.
+*/
 
 volatile bool8_t lastRTCEnable = 0;
+#if !Int0Serial
 volatile bool8_t lastSerClock = 0;
 volatile bool8_t serClockRising = false;
 volatile bool8_t serClockFalling = false;
+#endif
+
+#if PersistPram
+// EEPROM layout, see the explanation of PRAM persistence.
+#define EE_IMAGE 0
+#define EE_FORMAT PRAM_SIZE
+#define EE_JOURNAL (PRAM_SIZE + 1)
+#define JOURNAL_SLOTS ((E2END + 1 - EE_JOURNAL) / 2)
+#define EE_JOURNAL_END (EE_JOURNAL + 2 * JOURNAL_SLOTS)
+// The format byte depends on the PRAM size, so that switching between
+// 20-byte PRAM and XPRAM builds starts over with a fresh image.
+#define EE_FORMAT_MAGIC (0x5a ^ (PRAM_SIZE & 0xff))
+// Half-seconds without PRAM writes before writing back to EEPROM.
+#define PERSIST_DELAY 4
+
+// EECR programming modes.
+#define EEPM_ATOMIC 0
+#define EEPM_ERASE _BV(EEPM0)
+#define EEPM_WRITE _BV(EEPM1)
+
+/* PRAM bytes written by the host since they were last saved have
+   their bit set in `dirtyPram`.  The write-back state is only used by
+   `loop()`, except for `eepromBusy`, which the EEPROM ready interrupt
+   clears.  `test-rtc` takes `PERSIST_JOURNAL` with nothing dirty or
+   pending to mean that the write-back is done, so keep it zero.  */
+enum PersistStateType { PERSIST_JOURNAL, PERSIST_IMAGE, PERSIST_ERASE,
+                        PERSIST_FORMAT };
+volatile byte dirtyPram[(PRAM_SIZE+7)/8] = {};
+// PRAM bytes whose newest journal record is already folded into the
+// image.
+byte foldedPram[(PRAM_SIZE+7)/8];
+volatile byte persistDelay = 0;
+volatile bool8_t eepromBusy = false;
+byte persistState = PERSIST_JOURNAL;
+// Next journal record to fold, image byte to format or journal byte
+// to erase.
+uint16_t persistPos = 0;
+// EEPROM address of the next free journal record.
+uint16_t journalHead = EE_JOURNAL;
+// The data byte of the record at `journalHead` is in, its address
+// byte `recordAddr` is not yet.
+bool8_t recordPending = false;
+byte recordAddr = 0;
+#endif
 
-volatile byte serialState = SERIAL_DISABLED;
-volatile byte serialBitNum = 0;
-volatile byte address = 0;
-volatile byte serialData = 0;
+#if Telemetry
+#if !Int0Serial
+// Latency timer count at the last serial clock falling edge.
+volatile byte edgeStamp = 0;
+#endif
 
-/* Number of seconds since midnight, January 1, 1904.  The serial
-   register interface exposes this data as little endian.
+/* The latency timer, see the explanation of telemetry in
+   `rtc-core.h`.  On the ATtiny87, Timer1 is a 16-bit timer, run it in
+   8-bit fast PWM mode with the outputs disconnected, so that it
+   overflows every 256 ticks like the 8-bit timers.  */
+#if Timer1Clock
+#define LAT_TCNT TCNT0
+#define LAT_TCCR TCCR0B
+#define LAT_PRESCALER_MASK 0b010 /* 1/8 */
+#define LAT_TIFR TIFR
+#define LAT_TOV TOV0
+#elif AsyncClock
+#define LAT_TCNT TCNT1L
+#define LAT_TCCR TCCR1B
+#define LAT_PRESCALER_MASK (_BV(WGM12) | 0b010) /* 1/8 */
+#define LAT_TIFR TIFR1
+#define LAT_TOV TOV1
+#else
+#define LAT_TCNT TCNT1
+#define LAT_TCCR TCCR1
+#define LAT_PRESCALER_MASK 0b0100 /* 1/8 */
+#define LAT_TIFR TIFR
+#define LAT_TOV TOV1
+#endif
+#endif
 
-   TODO VERIFY: Clock is initialized to January 1st, 1984?  Or is this
-   done by the ROM when the validity status is invalid?
+#if Telemetry && Int0Serial
+/* Time each interrupt handler, and record the time if a serial clock
+   edge came in meanwhile, since INT0 couldn't be serviced until the
+   handler returned.  */
+#define TELEMETRY_ISR_BEGIN() \
+  byte isrStart = LAT_TCNT; \
+  LAT_TIFR = _BV(LAT_TOV)
+#define TELEMETRY_ISR_END() \
+  if ((INT0_MASK_REG&_BV(INT0)) && (INT0_FLAG_REG&_BV(INTF0))) \
+    telemetryLatency(isrStart)
+#else
+#define TELEMETRY_ISR_BEGIN()
+#define TELEMETRY_ISR_END()
+#endif
 
-   TODO INVESTIGATE: Does `simavr` not initialize non-zero variables?
-   Or is this a quirk with `avr-gcc`?  */
-volatile unsigned long seconds = 60UL * 60 * 24 * (365 * 4 + 1) * 20;
-volatile byte writeProtect = 0;
-volatile byte pram[PRAM_SIZE] = {}; // PRAM initialized as zeroed data
+#if ClockScaling
+volatile bool8_t clockFast = false;
+#endif
+// True while the RTC is deselected and not taking serial clock edges.
+volatile bool8_t standby = false;
 
 // Extra timer precision book-keeping.
+#if !Timer1Clock && !AsyncClock
 volatile byte numOflows = 0;
+#endif
+#if Timer1Clock
+// The counter was restarted from zero, see `compareInterrupt()`.
+volatile bool8_t t1Restart = false;
+#endif
+#if AsyncClock
+#elif DENOM_FRAC_REMAIN > 128
+volatile uint16_t fracRemain = 0;
+#else
 volatile byte fracRemain = 0;
-
-#define shiftReadPB(output, bitNum, portBit) \
-  bitWrite(output, bitNum, ((PINB&_BV(portBit))) ? 1 : 0)
-
-// Configure a pin to be an open-drain output, currently does nothing
-// as using digitalWriteOD() does all required setup and leaving the
-// pin as an input in the meantime is fine.
-#define configOutputOD(pin)
+#endif
 
 // Digital write in an open-drain fashion: set as output-low for zero,
 // set as input-no-pullup for one.
@@ -275,14 +658,162 @@ void digitalWriteOD(uint8_t pin, uint8_t val)
   // sei();
 }
 
+#if Telemetry
+/* Record the latency since the latency timer read `since`.  The
+   overflow flag must have been cleared when `since` was taken, if it
+   is set again, the count has wrapped and we can't tell by how much,
+   so saturate.  */
+void telemetryLatency(byte since)
+{
+  byte ticks = LAT_TCNT - since;
+  if ((LAT_TIFR&_BV(LAT_TOV)) && LAT_TCNT >= since)
+    ticks = 255;
+  if (ticks > telemetry.maxLatency)
+    telemetry.maxLatency = ticks;
+}
+#endif
+
+/* Mark a PRAM byte that the host changed for writing back to EEPROM.
+   Called with interrupts disabled.  */
+void halPramWritten(byte addr)
+{
+#if PersistPram
+  dirtyPram[addr>>3] |= 1<<(addr&0x07);
+  persistDelay = PERSIST_DELAY;
+#endif
+}
+
+#if PersistPram
+// Read an EEPROM byte.  Only call this while the EEPROM is idle.
+byte eepromRead(uint16_t eeAddr)
+{
+  EEAR = eeAddr;
+  bitSet(EECR, EERE);
+  return EEDR;
+}
+
+/* Start an EEPROM operation in the given programming mode, and have
+   the EEPROM ready interrupt wake us up when it's done.  `simavr`
+   ignores the programming mode and always writes EEDR, so pass 0xff
+   as the data when erasing.  */
+void eepromStart(uint16_t eeAddr, byte data, byte mode)
+{
+  byte oldSREG = SREG;
+  EECR = mode;
+  EEAR = eeAddr;
+  EEDR = data;
+  eepromBusy = true;
+  cli(); // EEPE must be set within four cycles of EEMPE
+  EECR |= _BV(EEMPE);
+  EECR |= _BV(EEPE);
+  EECR |= _BV(EERIE);
+  SREG = oldSREG;
+}
+
+// Start writing an EEPROM byte, skipping the erase if it's already
+// erased.
+void eepromWrite(uint16_t eeAddr, byte data)
+{
+  eepromStart(eeAddr, data,
+              (eepromRead(eeAddr) == 0xff) ? EEPM_WRITE : EEPM_ATOMIC);
+}
+
+/* Restore PRAM from EEPROM: read the image, then replay the journal.
+   If the EEPROM isn't formatted, leave PRAM zeroed and mark the
+   journal full, so that the first write-back formats it.  If an
+   erase of the journal was cut short, finish it before journaling
+   any more.  */
+void restorePram(void)
+{
+  uint16_t eeAddr;
+  persistDelay = 0;
+  eepromBusy = false;
+  persistState = PERSIST_JOURNAL;
+  recordPending = false;
+  journalHead = EE_JOURNAL_END;
+  if (eepromRead(EE_FORMAT) != EE_FORMAT_MAGIC)
+    return;
+  for (eeAddr = 0; eeAddr < PRAM_SIZE; eeAddr++)
+    pram[eeAddr] = eepromRead(EE_IMAGE + eeAddr);
+  for (eeAddr = EE_JOURNAL; eeAddr < EE_JOURNAL_END; eeAddr += 2) {
+    byte addr = eepromRead(eeAddr);
+    if (addr == 0xff)
+      break;
+    if (addr < PRAM_SIZE)
+      pram[addr] = eepromRead(eeAddr + 1);
+  }
+  journalHead = eeAddr;
+  for (; eeAddr < EE_JOURNAL_END; eeAddr++) {
+    if (eepromRead(eeAddr) != 0xff) {
+      persistState = PERSIST_ERASE;
+      persistPos = eeAddr;
+      break;
+    }
+  }
+}
+#endif
+
 void setup(void)
 {
   cli(); // Disable interrupts while we set things up
 
+  // Export F_CPU as an absolute ELF symbol so that the `simavr` test
+  // bench can simulate at the frequency we were built for.  This
+  // emits no code and takes up no space in flash.
+  // Likewise for the derived timer constants, so that the test bench
+  // can verify them, and for the features that the test bench can
+  // take advantage of.
+  __asm__ __volatile__ (".global rtc_f_cpu\n\t.set rtc_f_cpu, %0\n\t"
+                        ".global rtc_prescaler\n\t.set rtc_prescaler, %1\n\t"
+                        ".global rtc_lim_oflows\n\t.set rtc_lim_oflows, %2\n\t"
+                        ".global rtc_lim_remain\n\t.set rtc_lim_remain, %3\n\t"
+                        ".global rtc_numer_frac\n\t.set rtc_numer_frac, %4\n\t"
+                        ".global rtc_denom_frac\n\t.set rtc_denom_frac, %5\n\t"
+                        ".global rtc_clkps\n\t.set rtc_clkps, %6\n\t"
+                        ".global rtc_idle_clkps\n\t.set rtc_idle_clkps, %7\n\t"
+                        ".global rtc_timer1\n\t.set rtc_timer1, %8\n\t"
+                        ".global rtc_time_latch\n\t.set rtc_time_latch, 1\n\t"
+                        ".global rtc_burst_xpram\n\t.set rtc_burst_xpram, %9\n\t"
+                        ".global rtc_persist_delay\n\t.set rtc_persist_delay, %10\n\t"
+                        ".global rtc_ee_journal\n\t.set rtc_ee_journal, %11\n\t"
+                        ".global rtc_telemetry\n\t.set rtc_telemetry, %12\n\t"
+                        ".global rtc_async_clock\n\t.set rtc_async_clock, %13"
+                        :: "i" (F_CPU), "i" (PRESCALER), "i" (LIM_OFLOWS),
+                           "i" (LIM_REMAIN), "i" (NUMER_FRAC_REMAIN),
+                           "i" (DENOM_FRAC_REMAIN), "i" (FAST_CLKPS),
+#if ClockScaling
+                           "i" (IDLE_CLKPS),
+#else
+                           "i" (FAST_CLKPS),
+#endif
+                           "i" (Timer1Clock), "i" (BurstXPram),
+#if PersistPram
+                           "i" (PERSIST_DELAY), "i" (EE_JOURNAL),
+#else
+                           "i" (0), "i" (0),
+#endif
+                           "i" (Telemetry), "i" (AsyncClock));
+
   // TODO FIXME: Because `simavr` does not initialize non-zero global
   // variables, we must repeat the initialization here.
   seconds = 60UL * 60 * 24 * (365 * 4 + 1) * 20;
+#if PersistPram
+  restorePram();
+#endif
+#if Telemetry
+  telemetryReset();
+#endif
 
+#if AsyncClock
+  // The crystal oscillator pins are taken over by the timer, see
+  // below.
+  // OUTPUT: OC0A drives the 1Hz square wave (used for interrupts
+  // elsewhere in the system)
+  DDRA |= 1<<ONE_SEC_PIN;
+  // INPUT_PULLUP: The rest of port A is unused, don't leave it
+  // floating.
+  PORTA |= (byte)~(1<<ONE_SEC_PIN);
+#else
   // INPUT_PULLUP: Set the crystal oscillator pins as such to sanely
   // disable it.
   DDRB &= ~(1<<SOFT_XTAL1);
@@ -294,6 +825,7 @@ void setup(void)
   DDRB &= ~(1<<ONE_SEC_PIN);
   PORTB &= ~(1<<ONE_SEC_PIN);
   digitalWriteOD(ONE_SEC_PIN, 0);
+#endif
   // INPUT: The processor pulls this pin low when it wants access
   DDRB &= ~(1<<RTC_ENABLE_PIN);
   PORTB &= ~(1<<RTC_ENABLE_PIN);
@@ -301,45 +833,257 @@ void setup(void)
   // INPUT: The serial clock is driven by the processor
   DDRB &= ~(1<<SERIAL_CLOCK_PIN);
   PORTB &= ~(1<<SERIAL_CLOCK_PIN);
+#if !Int0Serial
   lastSerClock = PINB&(1<<SERIAL_CLOCK_PIN); // Initialize last value
+#endif
   // INPUT: We'll need to switch this to output when sending data
   DDRB &= ~(1<<SERIAL_DATA_PIN);
   PORTB &= ~(1<<SERIAL_DATA_PIN);
 
   wdt_disable();       // Disable watchdog
   bitSet(ACSR, ACD);   // Disable Analog Comparator, don't need it, saves power
+#if Telemetry
+  // Keep both timers, the other one measures latencies.
+#elif Timer1Clock
+  bitSet(PRR, PRTIM0); // Disable Timer 0, only using Timer 1
+#else
   bitSet(PRR, PRTIM1); // Disable Timer 1, only using Timer 0, Timer 1 uses around ten times as much current
+#endif
+#if !UsiSerial
   bitSet(PRR, PRUSI);  // Disable Universal Serial Interface, using Apple's RTC serial interface on pins 6 and 7
+#endif
   bitSet(PRR, PRADC);  // Disable Analog/Digital Converter
+#if AsyncClock
+  bitSet(PRR, PRLIN);  // Disable LIN/UART controller
+  bitSet(PRR, PRSPI);  // Disable Serial Peripheral Interface
+#endif
 
-  bitSet(GIMSK, PCIE);   // Pin Change Interrupt Enable
-  bitSet(PCMSK, PCINT0); // turn on RTC enable interrupt
-  bitSet(PCMSK, PCINT2); // turn on serial clock interrupt
+  bitSet(PCINT_CTRL_REG, PCINT_CTRL_BIT); // Pin Change Interrupt Enable
+  bitSet(PCINT_MASK_REG, RTC_ENABLE_PCINT); // turn on RTC enable interrupt
+#if Int0Serial
+  bitSet(INT0_SENSE_REG, ISC01); // INT0 on the falling edge of the serial clock
+  bitClear(INT0_SENSE_REG, ISC00);
+  INT0_FLAG_REG = _BV(INTF0); // Clear any stale INT0 flag
+  bitSet(INT0_MASK_REG, INT0); // turn on serial clock interrupt
+#else
+  bitSet(PCINT_MASK_REG, SERIAL_CLOCK_PCINT); // turn on serial clock interrupt
+#endif
 
   //set up timer
   bitSet(GTCCR, TSM);    // Turns off timers while we set it up
+#if Timer1Clock
+  /* The compare interrupt fires one tick after the counter clears,
+     see `compareInterrupt()`.  */
+  OCR1C = LIM_REMAIN - 1; // Clear the counter after a half-second
+  OCR1A = 1;
+  t1Restart = true;
+  bitSet(TIMSK, OCIE1A); // Set Timer/Counter1 Compare Match A Interrupt Enable
+  TCCR1 = _BV(CTC1) | PRESCALER_MASK; // Set CTC mode and prescaler
+  TCNT1 = 0;             // Clear the counter
+#elif AsyncClock
+  /* Switch Timer0 over to the crystal with its interrupt off, and
+     wait for the settings to cross over to the crystal clock before
+     turning it on, as the datasheet prescribes.  That also waits out
+     the crystal start-up.  */
+  ASSR = _BV(AS0);
+  TCNT0 = 0;
+  OCR0A = HALF_SEC_TICKS - 1;
+  // Inverting fast PWM: OC0A low from the wrap-around to OCR0A.
+  TCCR0A = _BV(COM0A1) | _BV(COM0A0) | _BV(WGM01) | _BV(WGM00);
+  TCCR0B = PRESCALER_MASK; // Set prescaler
+  while ((ASSR & ASYNC_BUSY));
+  TIFR0 = _BV(OCF0A) | _BV(TOV0);
+  bitSet(TIMSK0, TOIE0); // Set Timer/Counter0 Overflow Interrupt Enable
+#else
   bitSet(TIMSK, TOIE0);  // Set Timer/Counter0 Overflow Interrupt Enable
   TCCR0B = PRESCALER_MASK; // Set prescaler
   TCNT0 = 0;             // Clear the counter
+#endif
+#if Telemetry
+#if AsyncClock
+  TCCR1A = _BV(WGM10); // 8-bit fast PWM, see the latency timer
+#endif
+  LAT_TCCR = LAT_PRESCALER_MASK; // Start the latency timer
+#endif
+#if ClockScaling
+  clock_prescale_set((clock_div_t)FAST_CLKPS);
+  clockFast = true;
+#endif
   bitClear(GTCCR, TSM);  // Turns timers back on
 
   sei(); //We're done setting up, enable those interrupts again
 
 }
 
-void clearState(void)
+#if ClockScaling
+/* Switch the system clock and the timer prescaler together, see the
+   explanation of dynamic clock scaling.  */
+void setClockFast(bool8_t fast)
 {
-  // Return the pin to input mode
-  // cli();
-  DDRB &= ~(1<<SERIAL_DATA_PIN);
-  // PORTB &= ~(1<<SERIAL_DATA_PIN);
-  // sei();
-  serialState = SERIAL_DISABLED;
-  serialBitNum = 0;
-  address = 0;
-  serialData = 0;
+  byte oldSREG = SREG;
+  if (fast == clockFast)
+    return;
+  cli();
+  clock_prescale_set((clock_div_t)((fast) ? FAST_CLKPS : IDLE_CLKPS));
+#if Timer1Clock
+  TCCR1 = _BV(CTC1) | ((fast) ? PRESCALER_MASK : IDLE_PRESCALER_MASK);
+#else
+  TCCR0B = (fast) ? PRESCALER_MASK : IDLE_PRESCALER_MASK;
+#endif
+  clockFast = fast;
+  SREG = oldSREG;
+}
+
+#endif
+
+/* Standby.  While CE is high, the only thing we have to do is keep
+   time, so we stop taking serial clock edges and, with dynamic clock
+   scaling, slow the clock down.  Then only the timer interrupt and
+   the CE pin change wake us up.
+
+   We still sleep in idle mode.  Both Timer0 and Timer1 (in
+   synchronous mode) run from the I/O clock, which all of the deeper
+   sleep modes stop, and the watchdog oscillator is far too inaccurate
+   to keep time with.  Sleeping any deeper requires an asynchronous
+   timer with a 32.768 kHz crystal, see the electrical specifications
+   and `AsyncClock`.
+
+   Call `enterStandby()` with interrupts disabled, so that CE can't go
+   low in between checking it and entering standby.  The pin change
+   interrupt calls `leaveStandby()` on the CE falling edge.  */
+void enterStandby(void)
+{
+  if (standby || !(PINB&(1<<RTC_ENABLE_PIN)))
+    return;
+#if Int0Serial
+  bitClear(INT0_MASK_REG, INT0);
+#else
+  bitClear(PCINT_MASK_REG, SERIAL_CLOCK_PCINT);
+#endif
+#if ClockScaling
+  setClockFast(false);
+#endif
+#if Telemetry
+  LAT_TCCR = 0; // Stop the latency timer
+#endif
+  standby = true;
 }
 
+void leaveStandby(void)
+{
+  if (!standby)
+    return;
+#if ClockScaling
+  setClockFast(true); // The host will start clocking bits soon.
+#endif
+#if Telemetry
+  LAT_TCCR = LAT_PRESCALER_MASK;
+#endif
+#if Int0Serial
+  // Discard serial clock edges from while we weren't listening.
+  INT0_FLAG_REG = _BV(INTF0);
+  bitSet(INT0_MASK_REG, INT0);
+#else
+  lastSerClock = PINB&(1<<SERIAL_CLOCK_PIN);
+  bitSet(PCINT_MASK_REG, SERIAL_CLOCK_PCINT);
+#endif
+  standby = false;
+}
+
+#if AsyncClock
+/* Choose the sleep mode for `loop()`.  In standby, sleep in
+   power-save mode, where only the asynchronous timer and the CE pin
+   change wake us up.  Otherwise, or while an EEPROM operation is in
+   progress, since the EEPROM ready interrupt can't wake us up from
+   power-save, sleep in idle mode.
+
+   Before power-save, the asynchronous timer needs all register
+   writes to have crossed over, and at least one crystal clock to have
+   passed since its interrupt woke us up, or it may fail to wake us up
+   again.  The datasheet's recipe for the latter is to write a timer
+   register and wait for that to cross over too, which takes up to two
+   crystal clocks, 61 us.  Called with interrupts disabled.  */
+void selectSleepMode(void)
+{
+  if (standby
+#if PersistPram
+      && !eepromBusy
+#endif
+      ) {
+    TCCR0A = TCCR0A;
+    while ((ASSR & ASYNC_BUSY));
+    set_sleep_mode(SLEEP_MODE_PWR_SAVE);
+  } else
+    set_sleep_mode(SLEEP_MODE_IDLE);
+}
+#endif
+
+#if !AsyncClock
+// A half-second has passed: generate the square wave, and increment
+// the seconds counter every other time.
+void halfSecond(void)
+{
+  DDRB ^= 1<<ONE_SEC_PIN; // Flip the one-second pin
+  // The second is up when the one-second pin goes low.
+  advanceHalfSecond(DDRB&(1<<ONE_SEC_PIN));
+#if PersistPram
+  if (persistDelay)
+    persistDelay--;
+#endif
+}
+#endif
+
+#if Timer1Clock
+/*
+ * Timer1 compare interrupt once per half-second, one tick after the
+ * counter clears
+ */
+void compareInterrupt(void)
+{
+  /* OCR1C sets where the compare period that just started ends, and
+     with it when this interrupt comes again, so make it a half-second,
+     with the extra tick if the fractional ticks have added up to one.
+     This can't be done at the end of the period: the compare match
+     comes while the counter still holds the old top, and it only
+     clears on the next tick, so a new top would move the clear of
+     the period that is ending.  */
+  byte top;
+  if (t1Restart) {
+    /* The counter was restarted from zero, one tick ago.  Take that
+       tick off this period, so that the half-second ends a whole
+       half-second after the restart.  */
+    t1Restart = false;
+    OCR1C = LIM_REMAIN - 2;
+    return;
+  }
+  fracRemain += NUMER_FRAC_REMAIN;
+  top = (fracRemain >= DENOM_FRAC_REMAIN) ? LIM_REMAIN : LIM_REMAIN - 1;
+  fracRemain &= MASK_FRAC_REMAIN;
+#if Telemetry
+  // If we got here so late that the counter is already at the new
+  // top, it misses the match and runs on to 255 before wrapping
+  // around.
+  if (TCNT1 >= top)
+    TELEMETRY_COUNT(slips);
+#endif
+  OCR1C = top;
+  halfSecond();
+}
+#elif AsyncClock
+/*
+ * Timer0 overflow interrupt once a second, OC0A takes care of the
+ * square wave.  Pass the whole second to the core as one half-second,
+ * see above, and count down both halves of the EEPROM write-back
+ * delay.
+ */
+void secondInterrupt(void)
+{
+  advanceHalfSecond(true);
+#if PersistPram
+  persistDelay = (persistDelay > 2) ? persistDelay - 2 : 0;
+#endif
+}
+#else
 /*
  * An interrupt to both increment the seconds counter and generate the
  * square wave
@@ -354,6 +1098,13 @@ void oflowInterrupt(void)
        Also, since the timer may have ticked a few cycles since
        wrap-around, accumulate via `+=`.  */
     fracRemain += NUMER_FRAC_REMAIN;
+#if Telemetry
+    // If the timer has already ticked past the remainder, the
+    // counter wraps around and we're a whole overflow late.
+    if (TCNT0 >= ((fracRemain >= DENOM_FRAC_REMAIN) ?
+                  LIM_REMAIN + 1 : LIM_REMAIN))
+      TELEMETRY_COUNT(slips);
+#endif
     TCNT0 += (fracRemain >= DENOM_FRAC_REMAIN) ?
       -(LIM_REMAIN + 1) : -LIM_REMAIN;
     fracRemain &= MASK_FRAC_REMAIN;
@@ -361,12 +1112,10 @@ void oflowInterrupt(void)
     // Reset the timer-related flags now that we've reached a
     // half-second.
     numOflows = 0;
-    DDRB ^= 1<<ONE_SEC_PIN; // Flip the one-second pin
-    if ((DDRB&(1<<ONE_SEC_PIN))) { // If the one-second pin is low
-      seconds++;
-    }
+    halfSecond();
   }
 }
+#endif
 
 /*
  * The actual serial communication can be done in the main loop, this
@@ -376,14 +1125,29 @@ void handleRTCEnableInterrupt(void)
 {
   bool8_t curRTCEnable = PINB&(1<<RTC_ENABLE_PIN);
   if (lastRTCEnable && !curRTCEnable){ // Simulates a falling interrupt
-    serialState = RECEIVING_COMMAND;
+    leaveStandby();
+    serialSelect();
+  }
+#if Int0Serial
+  /* With the INT0 engine, nothing in the main loop looks at the RTC
+     enable line, so a rising edge that interrupts a serial
+     communication in progress clears the serial state right here.  */
+  else if (!lastRTCEnable && curRTCEnable) {
+    serialDeselect();
   }
+#else
   /* Else if a rising edge to disable the RTC interrupts a serial
      communication in progress, we still wake up to clear the serial
      state then go back to sleep.  */
+#if Telemetry
+  else if (!lastRTCEnable && curRTCEnable)
+    telemetrySessionEnd();
+#endif
+#endif
   lastRTCEnable = curRTCEnable;
 }
 
+#if !Int0Serial
 /*
  * Same deal over here, the actual serial communication can be done in
  * the main loop, this way the clock still gets incremented.
@@ -397,74 +1161,248 @@ void handleSerClockInterrupt(void)
   } else if (lastSerClock && !curSerClock) {
     serClockRising = false;
     serClockFalling = true;
+#if Telemetry
+    edgeStamp = LAT_TCNT;
+    LAT_TIFR = _BV(LAT_TOV);
+#endif
   }
   /* Else leave it up to the main loop code to clear the edge trigger
      flags.  */
   lastSerClock = curSerClock;
 }
+#endif
 
-/* For 20-byte PRAM equivalent commands, execute the PRAM command.
-   Return `false` on invalid commands.  */
-bool8_t execTradPramCmd(bool8_t writeRequest)
-{
-  // Discard the first bit and the last two address bits, it's not
-  // pertinent to address interpretation.  Also, use a local,
-  // non-volatile variable to save code size.
-  byte lAddress = (address&~(1<<7))>>2;
-  if (writeRequest && writeProtect &&
-      lAddress != 13) // 13 == update write-protect register
-    return true; // nothing to be done
-  if (lAddress < 8) {
-    // Little endian clock data byte
-    cli(); // Ensure that reads/writes are atomic.
-    if (writeRequest) {
-      lAddress = (lAddress&0x03)<<3;
-      seconds &= ~((unsigned long)0xff<<lAddress);
-      seconds |= (unsigned long)serialData<<lAddress;
-    } else {
-      lAddress = (lAddress&0x03)<<3;
-      serialData = (seconds>>lAddress)&0xff;
-      // Fall through to send data to host.
-    }
-    sei();
-  } else if (lAddress < 12) {
-    // Group 2 register
-    lAddress = (lAddress&0x03) + group2Base;
-    if (writeRequest)
-      pram[lAddress] = serialData;
-    else {
-      serialData = pram[lAddress];
-      // Fall through to send data to host.
-    }
-  } else if (lAddress < 16) {
-    if (writeRequest) {
-      if (lAddress == 12) // test write, do nothing
-        ;
-      else if (lAddress == 13) {
-        // Update the write-protect register.
-        writeProtect = ((serialData & 0x80)) ? 1 : 0;
+/* The host committed a clock write, restart the current half-second.
+   The one-second pin is released rather than pulled low, so that the
+   commit doesn't look like a tick to the host.  With `AsyncClock`,
+   restart the whole second instead, OC0A can't be set directly in
+   PWM mode.  It stays as it is until OCR0A sets it, so the next
+   falling edge is still the tick, a second after the commit.  Called
+   with interrupts disabled.  */
+void halTimeCommitted(void)
+{
+#if Timer1Clock
+  TCNT1 = 0;
+  bitSet(GTCCR, PSR1); // Reset the prescaler too
+  // The next compare interrupt only ends the restart tick.
+  TIFR = _BV(OCF1A);
+  t1Restart = true;
+#elif AsyncClock
+  TCNT0 = 0;
+  bitSet(GTCCR, PSR0); // Reset the prescaler too
+#else
+  numOflows = 0;
+  TCNT0 = 0;
+  bitSet(GTCCR, PSR0); // Reset the prescaler too
+#endif
+#if !AsyncClock
+  DDRB &= ~(1<<ONE_SEC_PIN);
+#endif
+}
+
+#if PersistPram
+// Return the address of a dirty PRAM byte, or `PRAM_SIZE` if there
+// are none.
+uint16_t findDirty(void)
+{
+  uint16_t addr;
+  byte mask;
+  for (addr = 0; addr < PRAM_SIZE; addr += 8) {
+    if (dirtyPram[addr>>3])
+      break;
+  }
+  if (addr >= PRAM_SIZE)
+    return PRAM_SIZE;
+  for (mask = 1; !(dirtyPram[addr>>3] & mask); mask <<= 1)
+    addr++;
+  return addr;
+}
+
+// Clear a PRAM byte's dirty bit and return its value, atomically so
+// that a host write in between is not lost.
+byte takePram(uint16_t addr)
+{
+  byte data;
+  cli();
+  dirtyPram[addr>>3] &= ~(1<<(addr&0x07));
+  data = pram[addr];
+  sei();
+  return data;
+}
+
+/* Write PRAM back to EEPROM, see the explanation of PRAM
+   persistence.  Start at most one EEPROM operation and return, so
+   that neither the serial engine nor the timer ever waits for the
+   EEPROM.  Stop as soon as the host selects the RTC.  */
+void persistStep(void)
+{
+  uint16_t addr;
+  byte data;
+  while (!eepromBusy && (PINB&(1<<RTC_ENABLE_PIN))) {
+    switch (persistState) {
+    case PERSIST_JOURNAL:
+      if (recordPending) {
+        // The data byte is in, the address byte makes the record
+        // count.
+        eepromWrite(journalHead, recordAddr);
+        journalHead += 2;
+        recordPending = false;
+        break;
       }
-      else {
-        // Addresses 14 and 15 are used for the encoding of the first
-        // byte of an extended command.  Therefore, interpretation as
-        // a traditional PRAM command is invalid.
+      if (persistDelay)
+        return;
+      addr = findDirty();
+      if (addr >= PRAM_SIZE)
+        return;
+      if (journalHead >= EE_JOURNAL_END) {
+        // The journal is full, bring the image up to date instead.
+        if (eepromRead(EE_FORMAT) != EE_FORMAT_MAGIC) {
+          persistState = PERSIST_FORMAT;
+          persistPos = 0;
+        } else {
+          persistState = PERSIST_IMAGE;
+          persistPos = journalHead - 2;
+          for (addr = 0; addr < sizeof(foldedPram); addr++)
+            foldedPram[addr] = 0;
+        }
+        break;
       }
-    } else
-      return false; // invalid command
-  } else {
-    // Group 1 register
-    lAddress = (lAddress&0x0f) + group1Base;
-    if (writeRequest)
-      pram[lAddress] = serialData;
-    else {
-      serialData = pram[lAddress];
-      // Fall through to send data to host.
+      data = takePram(addr);
+      if (addr == 0xff) {
+        // Can't be journaled, see above.
+        if (eepromRead(EE_IMAGE + addr) != data)
+          eepromWrite(EE_IMAGE + addr, data);
+        break;
+      }
+      recordAddr = addr;
+      recordPending = true;
+      eepromWrite(journalHead + 1, data);
+      break;
+
+    case PERSIST_IMAGE:
+      if (persistPos < EE_JOURNAL) {
+        // Erasing the first record's address byte empties the
+        // journal, the rest of the erase is only to reuse it.
+        persistState = PERSIST_ERASE;
+        persistPos = EE_JOURNAL;
+        journalHead = EE_JOURNAL;
+        break;
+      }
+      // One record per pass, walking back from the newest, so only
+      // the newest record of each byte is folded.
+      addr = eepromRead(persistPos);
+      persistPos -= 2;
+      if (addr >= PRAM_SIZE || (foldedPram[addr>>3] & (1<<(addr&0x07))))
+        break;
+      foldedPram[addr>>3] |= 1<<(addr&0x07);
+      data = eepromRead(persistPos + 3);
+      if (eepromRead(EE_IMAGE + addr) != data)
+        eepromWrite(EE_IMAGE + addr, data);
+      break;
+
+    case PERSIST_FORMAT:
+      // Nothing saved yet, the image only counts once the format
+      // byte is in, after the erase.
+      if (persistPos >= PRAM_SIZE) {
+        persistState = PERSIST_ERASE;
+        persistPos = EE_JOURNAL;
+        journalHead = EE_JOURNAL;
+        break;
+      }
+      data = takePram(persistPos);
+      if (eepromRead(EE_IMAGE + persistPos) != data)
+        eepromWrite(EE_IMAGE + persistPos, data);
+      persistPos++;
+      break;
+
+    case PERSIST_ERASE:
+      // One address per pass, so that CE is checked between reads
+      // even when most of the journal is already erased.
+      if (persistPos < EE_JOURNAL_END) {
+        if (eepromRead(persistPos) != 0xff)
+          eepromStart(persistPos, 0xff, EEPM_ERASE);
+        persistPos++;
+      } else if (eepromRead(EE_FORMAT) != EE_FORMAT_MAGIC)
+        eepromWrite(EE_FORMAT, EE_FORMAT_MAGIC);
+      else
+        persistState = PERSIST_JOURNAL;
+      break;
     }
   }
+}
+#endif
 
+#if UsiSerial
+/* Hand the output byte over to the USI, on the first falling edge of
+   the output phase.  The output latch is transparent while the clock
+   is low, so DO shows the MSB right away, then the USI shifts on each
+   rising edge and DO follows on each falling edge, just like
+   `digitalWriteOD()` on each falling edge.  The 4-bit counter counts
+   both clock edges, so it overflows on the 16th edge from now, the
+   falling edge after the last bit, where the bit-banged engine also
+   releases the data line.
+
+   DO is push-pull, so the USI only takes the line if it reads high
+   here: released to the pull-up, or still held high by the host's
+   last command bit.  A host holding the line high is fought by our
+   zeros whether or not DO is open-drain, and the host doesn't drive
+   the line again until the byte is out, so the only case that
+   push-pull adds, our high against a host driving low, is the one
+   this check catches.  When the last bit the host sent was a zero,
+   as it always is for an extended read, a host that hasn't let go of
+   the line gets the bit-banged, open-drain engine instead.  Return
+   true if the USI took the byte.  */
+bool8_t usiStartSend(void)
+{
+  if (!halDataIn())
+    return false;
+#if Telemetry
+  /* The USI doesn't tell us when the last bit is out, short of an
+     extra clock edge that the host doesn't send, so count the read
+     now.  */
+  if (!telemetryWindow)
+    TELEMETRY_COUNT(reads);
+#endif
+  bitClear(INT0_MASK_REG, INT0); // the USI takes over the serial clock
+  USIDR = serialData;
+  USISR = _BV(USIOIF); // clear the overflow flag and the counter
+  USICR = _BV(USIOIE) | _BV(USIWM0) | _BV(USICS1);
+  DDRB |= 1<<SERIAL_DATA_PIN; // let DO drive the data line
   return true;
 }
+#endif
 
+#if Int0Serial
+void loop(void)
+{
+  // All serial communication happens in the INT0 interrupt handler,
+  // we only have to execute the write commands it receives.
+  if (writePending)
+    execPendingWrite();
+#if PersistPram
+  persistStep();
+#endif
+
+  // Go to sleep until the next interrupt.  Check for a pending write
+  // with interrupts disabled so that we can't miss one that comes in
+  // right before we go to sleep.
+#if !AsyncClock
+  set_sleep_mode(0); // Sleep mode 0 == default, timers still running.
+#endif
+  cli();
+  if (!writePending) {
+    enterStandby();
+#if AsyncClock
+    selectSleepMode();
+#endif
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  }
+  sei();
+}
+#else
 void loop(void)
 {
   if ((PINB&(1<<RTC_ENABLE_PIN))) {
@@ -483,129 +1421,10 @@ void loop(void)
         serialBitNum >= 9) {
       clearState();
     } else */ if (serClockFalling) {
-      bool8_t writeRequest;
-      switch(serialState) {
-      case RECEIVING_COMMAND:
-        shiftReadPB(address, 7 - serialBitNum, SERIAL_DATA_PIN);
-        serialBitNum++;
-        if (serialBitNum <= 7)
-          break;
-
-        // The MSB determines if it's a write request or not.
-        writeRequest = !(address&(1<<7));
-        if ((address&0x78) == 0x38) {
-#if NoXPRAM
-          // Invalid command.
-          clearState();
-          break;
-#else
-          // This is an extended command, read the second address
-          // byte.
-          serialState = RECEIVING_XCMD_ADDR;
-          serialBitNum = 0;
-          break;
-#endif
-        } else if (writeRequest) {
-          // Read the data byte before continuing.
-          serialState = RECEIVING_DATA;
-          serialBitNum = 0;
-          break;
-        } else {
-          // Execute the command.
-          if (!execTradPramCmd(false)) {
-            clearState();
-            break;
-          }
-        }
-
-        // If we didn't break out early, send the output byte.
-        serialState = SENDING_DATA;
-        serialBitNum = 0;
-        // Set the pin to output mode
-        configOutputOD(SERIAL_DATA_PIN);
-        break;
-
-      case RECEIVING_DATA:
-        shiftReadPB(serialData, 7 - serialBitNum, SERIAL_DATA_PIN);
-        serialBitNum++;
-        if (serialBitNum <= 7)
-          break;
-
-        // Execute the command.
-        execTradPramCmd(true);
-        // Finished with the write command.
-        clearState();
-        break;
-
-      case SENDING_DATA:
-        if (serialBitNum <= 7)
-          digitalWriteOD(SERIAL_DATA_PIN,
-                         bitRead(serialData, 7 - serialBitNum));
-        serialBitNum++;
-        if (serialBitNum >= 9)
-          clearState();
-
-        /* NOTE: The last output cycle is treated specially if we act
-           on the rising edge of the clock, hold the data line as an
-           output for at least one full next cycle, then until the
-           falling edge of the serial clock, then switch back to an
-           input and reset the serial communication state.  It's for
-           bug compatibility with the ROM, but with a little bit of
-           sanity too.
-
-           However, for the time being, I've changed the code so all
-           actuions are preformed on the falling edge of the clock.
-           This seems to make things more consistent/robust given the
-           documented errors in the Macintosh ROM.  */
-        break;
-
-#if !defined(NoXPRAM) || !NoXPRAM
-      case RECEIVING_XCMD_ADDR:
-        shiftReadPB(serialData, 7 - serialBitNum, SERIAL_DATA_PIN);
-        serialBitNum++;
-        if (serialBitNum <= 7)
-          break;
-
-        // The MSB determines if it's a write request or not.
-        writeRequest = !(address&(1<<7));
-        // Assemble the extended address.
-        address = ((address&0x07)<<5) | ((serialData&0x7c)>>2);
-
-        if (writeRequest) {
-          // Read the data byte before continuing.
-          serialState = RECEIVING_XCMD_DATA;
-          serialBitNum = 0;
-          serialData = 0;
-          break;
-        }
-
-        // Read and send the PRAM register.
-        serialData = pram[address];
-        serialState = SENDING_DATA;
-        serialBitNum = 0;
-        // Set the pin to output mode
-        configOutputOD(SERIAL_DATA_PIN);
-        break;
-
-      case RECEIVING_XCMD_DATA:
-        shiftReadPB(serialData, 7 - serialBitNum, SERIAL_DATA_PIN);
-        serialBitNum++;
-        if (serialBitNum <= 7)
-          break;
-
-        // Write the PRAM register.
-        if (!writeProtect)
-          pram[address] = serialData;
-        // Finished with the write command.
-        clearState();
-        break;
+#if Telemetry
+      telemetryLatency(edgeStamp);
 #endif
-
-      default:
-        // Invalid state.
-        clearState();
-        break;
-      }
+      serClockFallingEdge();
     }
 
     // Clear the edge trigger flags now that the events have been
@@ -613,26 +1432,100 @@ void loop(void)
     serClockRising = false;
     serClockFalling = false;
   }
+  if (writePending)
+    execPendingWrite();
+#if PersistPram
+  persistStep();
+#endif
+
+  cli();
+  if (!writePending)
+    enterStandby();
+#if AsyncClock
+  selectSleepMode();
+#endif
+  sei();
 
   // Go to sleep until the next RTC enable or serial clock
   // rising/falling edge.
+#if !AsyncClock
   set_sleep_mode(0); // Sleep mode 0 == default, timers still running.
+#endif
   sleep_mode();
 }
+#endif
 
 /*
  * Actually attach the interrupt functions
  */
-ISR(PCINT0_vect)
+ISR(RTC_ENABLE_vect)
 {
+  TELEMETRY_ISR_BEGIN();
   handleRTCEnableInterrupt();
+#if !Int0Serial
   handleSerClockInterrupt();
+#endif
+  TELEMETRY_ISR_END();
+}
+
+#if Int0Serial
+ISR(INT0_vect)
+{
+  TELEMETRY_ISR_BEGIN();
+  serClockFallingEdge();
+  TELEMETRY_ISR_END();
+}
+#endif
+
+#if UsiSerial
+ISR(USI_OVF_vect)
+{
+  TELEMETRY_ISR_BEGIN();
+  // The output byte has been sent.
+#if BurstXPram
+  if (burst && burstLeft) {
+    // Keep going with the next byte of the burst.
+    burstLeft--;
+    address++;
+    USIDR = pram[address];
+    USISR = _BV(USIOIF);
+  } else
+#endif
+    clearState();
+  TELEMETRY_ISR_END();
+}
+#endif
+
+#if PersistPram
+ISR(EE_RDY_vect)
+{
+  TELEMETRY_ISR_BEGIN();
+  // The EEPROM is done, `loop()` starts the next operation, if any.
+  bitClear(EECR, EERIE);
+  eepromBusy = false;
+  TELEMETRY_ISR_END();
 }
+#endif
 
+#if Timer1Clock
+ISR(TIMER1_COMPA_vect)
+{
+  TELEMETRY_ISR_BEGIN();
+  compareInterrupt();
+  TELEMETRY_ISR_END();
+}
+#else
 ISR(TIMER0_OVF_vect)
 {
+  TELEMETRY_ISR_BEGIN();
+#if AsyncClock
+  secondInterrupt();
+#else
   oflowInterrupt();
+#endif
+  TELEMETRY_ISR_END();
 }
+#endif
 
 // Arduino main function.
 int main(void)
@@ -0,0 +1,527 @@
+/* Macintosh RTC protocol core, see `rtc-core.h`.
+
+   Everything in here only touches the serial data line and interrupt
+   masking through `rtc-hal.h`, so that the same logic runs in the
+   firmware and natively on the host.  */
+
+#include "rtc-core.h"
+#include "rtc-hal.h"
+
+volatile byte serialState = SERIAL_DISABLED;
+volatile byte serialBitNum = 0;
+volatile byte address = 0;
+volatile byte serialData = 0;
+
+#if BurstXPram
+// Burst transfer in progress, its direction, and the number of data
+// bytes left after the current one.
+volatile bool8_t burst = false;
+volatile bool8_t burstWrite = false;
+volatile byte burstLeft = 0;
+#endif
+
+/* A received write command waiting to be executed by `loop()`.  The
+   command is copied out of the serial state so that a new serial
+   transaction can start in the meantime.  */
+volatile bool8_t writePending = false;
+volatile bool8_t pendingXCmd = false;
+volatile byte pendingAddress = 0;
+volatile byte pendingData = 0;
+
+/* Number of seconds since midnight, January 1, 1904.  The serial
+   register interface exposes this data as little endian.
+
+   TODO VERIFY: Clock is initialized to January 1st, 1984?  Or is this
+   done by the ROM when the validity status is invalid?
+
+   TODO INVESTIGATE: Does `simavr` not initialize non-zero variables?
+   Or is this a quirk with `avr-gcc`?  */
+volatile uint32_t seconds = 60UL * 60 * 24 * (365 * 4 + 1) * 20;
+volatile byte writeProtect = 0;
+volatile byte pram[PRAM_SIZE] = {}; // PRAM initialized as zeroed data
+
+/* Seconds counter latched for a multi-byte read.  The host reads the
+   clock one byte per serial transaction, so a tick in between two of
+   them could tear the value.  Reading byte 0 latches the whole
+   counter, and bytes 1 to 3 are then each served once from the latch,
+   `latchBytes` has a bit set for each one that hasn't been yet.  The
+   latch expires on the second half-second after it was taken, so a
+   host that doesn't read all four bytes doesn't get stale data
+   later.  */
+volatile uint32_t secondsLatch = 0;
+volatile byte latchBytes = 0;
+volatile byte latchAge = 0;
+
+/* Clock writes go to a shadow register, `shadowBytes` has a bit set
+   for each byte written since the last commit.  Writing byte 3, the
+   most significant byte, commits the written bytes to `seconds` all
+   at once, so a tick in between the host's four write transactions
+   can't carry into a byte that was just written.  */
+volatile uint32_t secondsShadow = 0;
+volatile byte shadowBytes = 0;
+
+#if Telemetry
+volatile struct TelemetryRegs telemetry;
+// The current session is an access to the telemetry window.
+volatile bool8_t telemetryWindow = false;
+#endif
+
+#define shiftReadData(output, bitNum) \
+  bitWrite(output, bitNum, halDataIn())
+
+#if Telemetry
+// Reset the counters and fill in the constant registers.
+void telemetryReset(void)
+{
+  byte i;
+  for (i = 0; i < TELEMETRY_REGS; i++)
+    ((volatile byte *)&telemetry)[i] = 0;
+  telemetry.magic = TELEMETRY_MAGIC;
+  telemetry.size = TELEMETRY_REGS;
+  telemetry.latencyUnit = LATENCY_UNIT;
+}
+
+// Read a telemetry register, zero past the last one.
+byte telemetryRead(byte reg)
+{
+  if (reg >= TELEMETRY_REGS)
+    return 0;
+  return ((volatile byte *)&telemetry)[reg];
+}
+
+/* Count the session that the host just ended by deselecting us as
+   aborted, unless it was idle or had finished.  Writes are finished
+   once queued, which clears the serial state, but the host ends a
+   read right after the last bit of the data byte, without clocking
+   the edge that would clear it.  */
+void telemetrySessionEnd(void)
+{
+  switch (serialState) {
+  case SERIAL_DISABLED:
+    return;
+  case RECEIVING_COMMAND:
+    if (serialBitNum == 0)
+      return;
+    break;
+  case SENDING_DATA:
+#if UsiSerial
+    // Reads are counted when the USI takes the byte.
+    if (halUsiSending())
+      return;
+#endif
+    if (serialBitNum >= 8
+#if BurstXPram
+        && !(burst && burstLeft)
+#endif
+        )
+      return;
+    break;
+  }
+  TELEMETRY_COUNT(aborts);
+}
+#endif
+
+/* Store a PRAM byte written by the host, and let the platform know if
+   it changed.  */
+void writePram(byte addr, byte data)
+{
+  if (pram[addr] == data)
+    return;
+  HAL_ATOMIC_BEGIN();
+  pram[addr] = data;
+  halPramWritten(addr);
+  HAL_ATOMIC_END();
+}
+
+void clearState(void)
+{
+  // Return the pin to input mode
+  halDataRelease();
+  serialState = SERIAL_DISABLED;
+  serialBitNum = 0;
+  address = 0;
+  serialData = 0;
+#if BurstXPram
+  burst = false;
+#endif
+#if Telemetry
+  telemetryWindow = false;
+#endif
+  halSerialStop();
+}
+
+// The host pulled CE low, a command follows.
+void serialSelect(void)
+{
+  serialState = RECEIVING_COMMAND;
+}
+
+// The host pulled CE high, ending the session.
+void serialDeselect(void)
+{
+#if Telemetry
+  telemetrySessionEnd();
+#endif
+  clearState();
+}
+
+/* A half-second has passed, `newSecond` is true every other time:
+   increment the seconds counter and age the read latch.  */
+void advanceHalfSecond(bool8_t newSecond)
+{
+  if (newSecond)
+    seconds++;
+  if (latchBytes && ++latchAge >= 2)
+    latchBytes = 0;
+}
+
+/* Commit the shadowed clock bytes to the seconds counter, and have
+   the platform restart the current half-second, like the divider
+   reset on other RTC chips.  The first tick then comes half a second
+   after the commit, so the host can read back the time it just
+   wrote.  Call with interrupts disabled.  */
+void commitShadow(void)
+{
+  byte i;
+  for (i = 0; i < 4; i++) {
+    if ((shadowBytes & (1<<i))) {
+      seconds &= ~((uint32_t)0xff<<(i<<3));
+      seconds |= secondsShadow & ((uint32_t)0xff<<(i<<3));
+    }
+  }
+  shadowBytes = 0;
+  latchBytes = 0;
+  halTimeCommitted();
+}
+
+/* For 20-byte PRAM equivalent commands, execute the PRAM command
+   `cmd`.  The data byte is read from `data` for writes and stored in
+   `data` for reads.  Return `false` on invalid commands.  */
+bool8_t execTradPramCmd(byte cmd, volatile byte *data,
+                        bool8_t writeRequest)
+{
+  // Use a local, non-volatile variable to save code size.
+  byte index;
+  byte reg = tradCmdReg(cmd, &index);
+  if (writeRequest && writeProtect && reg != TRAD_WRITE_PROTECT)
+    return true; // nothing to be done
+  switch (reg) {
+  case TRAD_CLOCK: {
+    // Ensure that reads/writes are atomic.
+    HAL_ATOMIC_BEGIN();
+    if (writeRequest) {
+      shadowBytes |= 1<<index;
+      index <<= 3;
+      secondsShadow &= ~((uint32_t)0xff<<index);
+      secondsShadow |= (uint32_t)*data<<index;
+      if (index == 24)
+        commitShadow();
+    } else {
+      uint32_t value = seconds;
+      if (index == 0) {
+        secondsLatch = value;
+        latchBytes = 0x0e;
+        latchAge = 0;
+      } else if ((latchBytes & (1<<index))) {
+        value = secondsLatch;
+        latchBytes &= ~(1<<index);
+      }
+      *data = (value>>(index<<3))&0xff;
+      // Fall through to send data to host.
+    }
+    HAL_ATOMIC_END();
+    break;
+  }
+  case TRAD_GROUP1:
+  case TRAD_GROUP2:
+    index += (reg == TRAD_GROUP1) ? GROUP1_BASE : GROUP2_BASE;
+    if (writeRequest)
+      writePram(index, *data);
+    else {
+      *data = pram[index];
+      // Fall through to send data to host.
+    }
+    break;
+  default:
+    if (!writeRequest)
+      return false; // invalid command
+    if (reg == TRAD_WRITE_PROTECT) {
+      // Update the write-protect register.
+      writeProtect = ((*data & 0x80)) ? 1 : 0;
+    }
+    /* Else it's the test write, which does nothing, or the encoding
+       of the first byte of an extended command, which is invalid as
+       a traditional PRAM command.  */
+    break;
+  }
+
+  return true;
+}
+
+/* Queue the write command that was just received for `loop()` to
+   execute, then reset the serial state for the next command.  */
+void queueWrite(bool8_t xcmd)
+{
+  TELEMETRY_COUNT(writes);
+  pendingXCmd = xcmd;
+  pendingAddress = address;
+  pendingData = serialData;
+  writePending = true;
+  clearState();
+}
+
+/* Execute a pending write command.  There is no deadline for this
+   since the host has already finished sending the command.  The
+   serial interrupt may queue the next write while this one runs, so
+   take a copy of the slot and free it atomically, then execute the
+   copy.  */
+void execPendingWrite(void)
+{
+#if !defined(NoXPRAM) || !NoXPRAM
+  bool8_t xcmd;
+#endif
+  byte cmdAddress, data;
+  {
+    HAL_ATOMIC_BEGIN();
+#if !defined(NoXPRAM) || !NoXPRAM
+    xcmd = pendingXCmd;
+#endif
+    cmdAddress = pendingAddress;
+    data = pendingData;
+    writePending = false;
+    HAL_ATOMIC_END();
+  }
+#if !defined(NoXPRAM) || !NoXPRAM
+  if (xcmd) {
+    // Write the PRAM register.
+    if (!writeProtect)
+      writePram(cmdAddress, data);
+  } else
+#endif
+    execTradPramCmd(cmdAddress, &data, true);
+}
+
+/* Process a falling edge of the serial clock: shift a bit in or out
+   and advance the serial state machine.  Reads are executed right
+   away since the data must be ready to send on the next clock edge,
+   but writes are queued for `loop()`.  */
+void serClockFallingEdge(void)
+{
+  bool8_t writeRequest;
+  switch(serialState) {
+  case RECEIVING_COMMAND:
+    shiftReadData(address, 7 - serialBitNum);
+    serialBitNum++;
+    if (serialBitNum <= 7)
+      break;
+
+    // The MSB determines if it's a write request or not.
+    writeRequest = !(address&(1<<7));
+    if (isXCmd(address)) {
+#if NoXPRAM
+      // Invalid command.
+      clearState();
+      break;
+#else
+      // This is an extended command, read the second address
+      // byte.
+      serialState = RECEIVING_XCMD_ADDR;
+      serialBitNum = 0;
+      break;
+#endif
+    } else if (writeRequest) {
+      // Read the data byte before continuing.
+      serialState = RECEIVING_DATA;
+      serialBitNum = 0;
+      break;
+    } else {
+      // Execute the command.
+      if (!execTradPramCmd(address, &serialData, false)) {
+        TELEMETRY_COUNT(invalid);
+        clearState();
+        break;
+      }
+    }
+
+    // If we didn't break out early, send the output byte.
+    serialState = SENDING_DATA;
+    serialBitNum = 0;
+    break;
+
+  case RECEIVING_DATA:
+    shiftReadData(serialData, 7 - serialBitNum);
+    serialBitNum++;
+    if (serialBitNum <= 7)
+      break;
+
+    // Finished with the write command, execute it.
+    queueWrite(false);
+    break;
+
+  case SENDING_DATA:
+#if UsiSerial
+    if (serialBitNum == 0 && usiStartSend())
+      break;
+#endif
+#if BurstXPram
+    if (serialBitNum == 8 && burst && burstLeft) {
+      // Move on to the next byte of the burst.
+      burstLeft--;
+      address++;
+      serialData = pram[address];
+      serialBitNum = 0;
+    }
+#endif
+    if (serialBitNum <= 7)
+      halDataOut(bitRead(serialData, 7 - serialBitNum));
+    serialBitNum++;
+#if Telemetry
+    // The last bit is out, the host doesn't clock any further.
+    if (serialBitNum == 8 && !telemetryWindow
+#if BurstXPram
+        && !(burst && burstLeft)
+#endif
+        )
+      TELEMETRY_COUNT(reads);
+#endif
+    if (serialBitNum >= 9)
+      clearState();
+
+    /* NOTE: The last output cycle is treated specially if we act
+       on the rising edge of the clock, hold the data line as an
+       output for at least one full next cycle, then until the
+       falling edge of the serial clock, then switch back to an
+       input and reset the serial communication state.  It's for
+       bug compatibility with the ROM, but with a little bit of
+       sanity too.
+
+       However, for the time being, I've changed the code so all
+       actuions are preformed on the falling edge of the clock.
+       This seems to make things more consistent/robust given the
+       documented errors in the Macintosh ROM.  */
+    break;
+
+#if !defined(NoXPRAM) || !NoXPRAM
+  case RECEIVING_XCMD_ADDR:
+    shiftReadData(serialData, 7 - serialBitNum);
+    serialBitNum++;
+    if (serialBitNum <= 7)
+      break;
+
+    // The MSB determines if it's a write request or not.
+    writeRequest = !(address&(1<<7));
+    // Assemble the extended address.
+    address = xCmdAddr(address, serialData);
+
+#if Telemetry
+    if ((serialData&0x83) == 0x02) {
+      // An access to the telemetry window rather than to XPRAM.
+      telemetryWindow = true;
+      if (writeRequest) {
+        serialState = RECEIVING_XCMD_DATA;
+        serialBitNum = 0;
+        break;
+      }
+      serialData = telemetryRead(address);
+      serialState = SENDING_DATA;
+      serialBitNum = 0;
+      break;
+    }
+#endif
+
+#if BurstXPram
+    if ((serialData&0x83) == 0x01) {
+      // Read the burst byte count before continuing.
+      burst = true;
+      burstWrite = writeRequest;
+      serialState = RECEIVING_BURST_COUNT;
+      serialBitNum = 0;
+      break;
+    }
+#endif
+
+    if (writeRequest) {
+      // Read the data byte before continuing.
+      serialState = RECEIVING_XCMD_DATA;
+      serialBitNum = 0;
+      serialData = 0;
+      break;
+    }
+
+    // Read and send the PRAM register.
+    serialData = pram[address];
+    serialState = SENDING_DATA;
+    serialBitNum = 0;
+    break;
+
+  case RECEIVING_XCMD_DATA:
+    shiftReadData(serialData, 7 - serialBitNum);
+    serialBitNum++;
+    if (serialBitNum <= 7)
+      break;
+
+#if Telemetry
+    if (telemetryWindow) {
+      // Quick enough to do right here.
+      telemetryReset();
+      clearState();
+      break;
+    }
+#endif
+
+#if BurstXPram
+    if (burst) {
+      /* XPRAM writes are quick enough to do right here, and there is
+         no time to queue them with the next byte already coming
+         in.  */
+      if (!writeProtect)
+        writePram(address, serialData);
+      if (burstLeft == 0) {
+        TELEMETRY_COUNT(writes);
+        clearState();
+        break;
+      }
+      burstLeft--;
+      address++;
+      serialBitNum = 0;
+      break;
+    }
+#endif
+
+    // Finished with the write command, execute it.
+    queueWrite(true);
+    break;
+#endif
+
+#if BurstXPram
+  case RECEIVING_BURST_COUNT:
+    shiftReadData(serialData, 7 - serialBitNum);
+    serialBitNum++;
+    if (serialBitNum <= 7)
+      break;
+
+    burstLeft = serialData - 1; // zero means 256 bytes
+    serialBitNum = 0;
+    if (burstWrite) {
+      serialState = RECEIVING_XCMD_DATA;
+      break;
+    }
+
+    // Read and send the first PRAM register.
+    serialData = pram[address];
+    serialState = SENDING_DATA;
+    break;
+#endif
+
+  case SERIAL_DISABLED:
+    /* The session is over, but the host may still be clocking, e.g.
+       out the data byte of an invalid read.  Nothing to do.  */
+    break;
+
+  default:
+    // Invalid state.
+    TELEMETRY_COUNT(invalid);
+    clearState();
+    break;
+  }
+}
@@ -0,0 +1,161 @@
+/* Macintosh RTC protocol core: the serial state machine and the
+   register file, independent of the pins and timers.  `rtc-core.c`
+   builds into the AVR firmware together with `MacRTC.c`, and into
+   native host programs, see `rtc-hal.h` for the interface between
+   the core and either.
+
+   Build options go on the command line so that every source file
+   sees the same ones.  */
+
+#ifndef RTC_CORE_H
+#define RTC_CORE_H
+
+#include <stdint.h>
+
+#include "rtc-regs.h"
+
+/********************************************************************/
+// Simplified Arduino.h definitions.
+typedef enum { false, true } bool; // Compatibility with C++.
+typedef bool boolean;
+typedef uint8_t bool8_t;
+typedef uint8_t byte;
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+// END simplified Arduino.h definitions.
+/********************************************************************/
+
+#if NoXPRAM
+// Models earlier than the Plus had 20 bytes of PRAM
+#define PRAM_SIZE 20
+#define GROUP1_BASE 0x00
+#define GROUP2_BASE 0x10
+#else
+// Mac Plus used the xPRAM chip with 256 bytes
+#define PRAM_SIZE 256
+#define GROUP1_BASE 0x10
+#define GROUP2_BASE 0x08
+#endif
+
+/* Burst XPRAM transfers, a vendor extension to the extended command.
+   The Macintosh always sends the second extended command byte as
+   0defgh00, so we take 0defgh01 to start a burst at the given
+   address.  The next byte is the number of bytes to transfer, zero
+   meaning 256, then the data bytes follow one after another in the
+   same CE-low session, at consecutive addresses that wrap around at
+   the end of XPRAM.  A whole XPRAM dump or restore then takes one
+   session rather than 256 sessions of two or three bytes each.  */
+#ifndef BurstXPram
+#define BurstXPram 1
+#endif
+#if NoXPRAM
+#undef BurstXPram
+#define BurstXPram 0
+#endif
+
+/* With `Telemetry`, the firmware counts completed reads and writes,
+   sessions that CE ended partway through, invalid commands, and
+   half-seconds that the timer handler started too late to keep exact
+   time, and keeps the worst serial clock edge-to-service latency
+   seen.  The host reads the counters with extended commands whose
+   second byte ends in `10` (`z0000aaa 0defgh10`), the address picking
+   the register, see `struct TelemetryRegs`.  Writing any register
+   through that window resets the counters.  The counters aren't PRAM
+   and aren't saved to EEPROM.  Accesses to the window aren't counted
+   themselves.
+
+   Latencies are measured with whichever timer isn't keeping time,
+   running at 1/8 of the CPU clock while the RTC is selected.  With
+   the INT0 engine, that's the length of any interrupt handler that
+   ends with a serial clock edge waiting, an upper bound on how long
+   the edge waited.  With the pin change engine, it's the time from
+   the pin change interrupt to `loop()` shifting the bit.  Latencies
+   saturate at 255 ticks.
+
+   20-byte PRAM chips have no extended commands, so this is left out
+   of those builds.  */
+#ifndef Telemetry
+#define Telemetry 0
+#endif
+#if NoXPRAM
+#undef Telemetry
+#define Telemetry 0
+#endif
+
+enum SerialStateType { SERIAL_DISABLED, RECEIVING_COMMAND,
+                       SENDING_DATA, RECEIVING_DATA,
+                       RECEIVING_XCMD_ADDR, RECEIVING_XCMD_DATA,
+                       RECEIVING_BURST_COUNT };
+
+extern volatile byte serialState;
+extern volatile byte serialBitNum;
+extern volatile byte address;
+extern volatile byte serialData;
+
+#if BurstXPram
+extern volatile bool8_t burst;
+extern volatile bool8_t burstWrite;
+extern volatile byte burstLeft;
+#endif
+
+extern volatile bool8_t writePending;
+extern volatile bool8_t pendingXCmd;
+extern volatile byte pendingAddress;
+extern volatile byte pendingData;
+
+extern volatile uint32_t seconds;
+extern volatile byte writeProtect;
+extern volatile byte pram[PRAM_SIZE];
+extern volatile uint32_t secondsLatch;
+extern volatile byte latchBytes;
+extern volatile byte latchAge;
+extern volatile uint32_t secondsShadow;
+extern volatile byte shadowBytes;
+
+#if Telemetry
+/* Telemetry registers, in the order the host reads them.  Counters
+   are little endian and wrap around.  */
+#define TELEMETRY_MAGIC 0x54 // 'T'
+#define TELEMETRY_REGS 18
+#define LATENCY_UNIT 8 // CPU cycles per latency timer tick
+struct TelemetryRegs {
+  byte magic;           // 0: `TELEMETRY_MAGIC`
+  byte size;            // 1: `TELEMETRY_REGS`
+  byte latencyUnit;     // 2: `LATENCY_UNIT`
+  byte maxLatency;      // 3: worst edge-to-service latency, in ticks
+  uint32_t reads;       // 4-7: completed read sessions
+  uint32_t writes;      // 8-11: completed write sessions
+  uint16_t aborts;      // 12-13: sessions ended partway through
+  uint16_t invalid;     // 14-15: invalid commands
+  uint16_t slips;       // 16-17: late half-second timer handlers
+};
+extern volatile struct TelemetryRegs telemetry;
+extern volatile bool8_t telemetryWindow;
+#define TELEMETRY_COUNT(counter) (telemetry.counter++)
+void telemetryReset(void);
+byte telemetryRead(byte reg);
+void telemetrySessionEnd(void);
+#else
+#define TELEMETRY_COUNT(counter)
+#endif
+
+void writePram(byte addr, byte data);
+void clearState(void);
+void serialSelect(void);
+void serialDeselect(void);
+void serClockFallingEdge(void);
+bool8_t execTradPramCmd(byte cmd, volatile byte *data,
+                        bool8_t writeRequest);
+void execPendingWrite(void);
+void advanceHalfSecond(bool8_t newSecond);
+
+/* Platform hooks, defined alongside the pin and timer code.  */
+// The host committed a clock write, restart the current half-second.
+void halTimeCommitted(void);
+// The host changed a PRAM byte.
+void halPramWritten(byte addr);
+
+#endif /* not RTC_CORE_H */
@@ -0,0 +1,110 @@
+/* The interface between the RTC protocol core and the platform it
+   runs on: the serial data line, interrupt masking, and the hardware
+   serial engines.  These are macros so that the core's serial clock
+   edge handler doesn't pay for a call per bit.
+
+   On the AVR, the serial data line is PB1, see the pinout in
+   `MacRTC.c`.  On the host, it is a pair of variables, one for the
+   level the host drives and one for the level the RTC drives, and the
+   line reads as the AND of both, like the pull-up resistor with
+   open-drain drivers on either side.  */
+
+#ifndef RTC_HAL_H
+#define RTC_HAL_H
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/* Serial engine selection.  With `Int0Serial`, falling edges of the
+   serial clock trigger INT0 (`SERIAL_CLOCK_PIN` is the INT0 pin), and
+   the bits are shifted right in the interrupt handler, leaving only
+   write commands to `loop()`.  Otherwise, both CE and CLK edges
+   trigger the pin change interrupt, which only records the edge, and
+   `loop()` shifts the bits after waking up.  The INT0 engine has a
+   much shorter edge-to-action path and spends less time awake per
+   bit, so it can keep up with much faster serial clocks.  */
+#ifndef Int0Serial
+#define Int0Serial 1
+#endif
+
+/* With `UsiSerial`, the Universal Serial Interface shifts out the
+   data byte of read commands in three-wire mode, clocked externally
+   from `SERIAL_CLOCK_PIN`, which is also the USCK pin.  The CPU is
+   then interrupted once when the byte starts and once when it is
+   done, rather than on each of the 8 bits.  The USI can't receive for
+   us since its DI pin is `RTC_ENABLE_PIN`, so incoming bits are still
+   shifted by the INT0 engine.
+
+   Note that the USI drives DO as a push-pull output rather than
+   open-drain, see `usiStartSend()` for when that is safe, and the
+   bit-banged engine sends the byte when it isn't.  Also, `simavr`
+   does not emulate the USI, so this build can't be run on the
+   `test-rtc` test bench.  */
+#ifndef UsiSerial
+#define UsiSerial 0
+#endif
+#if UsiSerial && !Int0Serial
+#error "UsiSerial requires Int0Serial"
+#endif
+
+#define HAL_DATA_PIN 1 // PB1
+
+/* Mask interrupts for an atomic section.  We may be called from an
+   interrupt handler, so restore rather than enable interrupts.  */
+#define HAL_ATOMIC_BEGIN() byte oldSREG = SREG; cli()
+#define HAL_ATOMIC_END() SREG = oldSREG
+
+#define halDataIn() ((PINB&_BV(HAL_DATA_PIN)) ? 1 : 0)
+// Digital write in an open-drain fashion: set as output-low for zero,
+// set as input-no-pullup for one.
+#define halDataOut(bit) \
+  ((bit) ? (DDRB &= ~_BV(HAL_DATA_PIN)) : (DDRB |= _BV(HAL_DATA_PIN)))
+#define halDataRelease() (DDRB &= ~_BV(HAL_DATA_PIN))
+
+#if UsiSerial
+bool8_t usiStartSend(void);
+// True while the USI is sending a byte.
+#define halUsiSending() (USICR != 0)
+/* Stop the USI if it was sending a byte, and go back to taking
+   serial clock edges on INT0.  */
+#define halSerialStop() \
+  do { \
+    if (USICR) { \
+      USICR = 0; \
+      USISR = _BV(USIOIF); \
+      GIFR = _BV(INTF0); \
+      bitSet(GIMSK, INT0); \
+    } \
+  } while (0)
+#else
+#define halSerialStop()
+#endif
+
+#else /* not __AVR__ */
+
+#define UsiSerial 0
+
+extern volatile byte halHostData;
+extern volatile byte halRtcData;
+
+#define HAL_ATOMIC_BEGIN()
+#define HAL_ATOMIC_END()
+
+#define halDataIn() (halHostData & halRtcData)
+#define halDataOut(bit) (halRtcData = (bit) ? 1 : 0)
+#define halDataRelease() (halRtcData = 1)
+#define halSerialStop()
+
+/* Host-side driver, in `rtc-host.c`.  */
+void rtcHostReset(void);
+byte rtcHostTransact(const byte *sent, uint8_t numSent, bool8_t recv);
+#if BurstXPram
+void rtcHostBurst(byte addr, byte *data, uint16_t count,
+                  bool8_t writeRequest);
+#endif
+
+#endif /* not __AVR__ */
+
+#endif /* not RTC_HAL_H */
@@ -0,0 +1,109 @@
+/* Host side of the RTC protocol core: the platform hooks, and a
+   driver that clocks whole transactions through the core the way the
+   Macintosh does, for unit tests and benchmarks that run natively
+   without `simavr`.  */
+
+#include "rtc-core.h"
+#include "rtc-hal.h"
+
+// The data line levels driven by the host and by the RTC, see
+// `rtc-hal.h`.
+volatile byte halHostData = 1;
+volatile byte halRtcData = 1;
+
+void halTimeCommitted(void)
+{
+}
+
+void halPramWritten(byte addr)
+{
+}
+
+/* Reset the core to its power-up state, the same as `setup()` on the
+   AVR, except that PRAM starts zeroed rather than restored.  */
+void rtcHostReset(void)
+{
+  uint16_t i;
+  clearState();
+  writePending = false;
+  seconds = 60UL * 60 * 24 * (365 * 4 + 1) * 20;
+  writeProtect = 0;
+  for (i = 0; i < PRAM_SIZE; i++)
+    pram[i] = 0;
+  latchBytes = 0;
+  shadowBytes = 0;
+#if Telemetry
+  telemetryReset();
+#endif
+  halHostData = 1;
+  halRtcData = 1;
+}
+
+// Clock one byte in from the host, MSB first.
+static void hostSendByte(byte data)
+{
+  uint8_t bitNum;
+  for (bitNum = 0; bitNum <= 7; bitNum++) {
+    halHostData = (data >> (7 - bitNum)) & 1;
+    serClockFallingEdge();
+  }
+  halHostData = 1;
+}
+
+// Clock one byte out to the host, MSB first.
+static byte hostRecvByte(void)
+{
+  byte data = 0;
+  uint8_t bitNum;
+  for (bitNum = 0; bitNum <= 7; bitNum++) {
+    serClockFallingEdge();
+    data |= halDataIn() << (7 - bitNum);
+  }
+  return data;
+}
+
+// Deselect the RTC, then execute a queued write as `loop()` would.
+static void hostEndSession(void)
+{
+  serialDeselect();
+  if (writePending)
+    execPendingWrite();
+}
+
+/* Perform a complete serial transaction, like `serialTransact()` in
+   `test-rtc`: select the RTC, send the given bytes, then if `recv`
+   is true, receive one byte and return it.  Otherwise return zero.
+   Each bit is one falling edge of the serial clock.  */
+byte rtcHostTransact(const byte *sent, uint8_t numSent, bool8_t recv)
+{
+  byte result = 0;
+  uint8_t i;
+  serialSelect();
+  for (i = 0; i < numSent; i++)
+    hostSendByte(sent[i]);
+  if (recv)
+    result = hostRecvByte();
+  hostEndSession();
+  return result;
+}
+
+#if BurstXPram
+/* Perform a burst XPRAM transaction, like `serialBurstTransact()` in
+   `test-rtc`.  `count` must be between 1 and 256.  */
+void rtcHostBurst(byte addr, byte *data, uint16_t count,
+                  bool8_t writeRequest)
+{
+  uint16_t i;
+  serialSelect();
+  hostSendByte(0x38 | ((addr & 0xe0) >> 5) | ((writeRequest) ? 0 : 0x80));
+  hostSendByte(((addr & 0x1f) << 2) | 0x01);
+  hostSendByte(count & 0xff); // zero means 256
+  for (i = 0; i < count; i++) {
+    if (writeRequest)
+      hostSendByte(data[i]);
+    else
+      data[i] = hostRecvByte();
+  }
+  hostEndSession();
+}
+#endif
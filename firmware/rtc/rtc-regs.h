@@ -0,0 +1,44 @@
+/* Macintosh RTC register decoding, shared by the firmware and the
+   host side of the test bench so that both interpret traditional
+   commands the same way.  */
+
+#ifndef RTC_REGS_H
+#define RTC_REGS_H
+
+#include <stdint.h>
+
+/* Registers addressed by a traditional command.  */
+enum TradRegType { TRAD_CLOCK, TRAD_GROUP2, TRAD_TEST, TRAD_WRITE_PROTECT,
+                   TRAD_XCMD, TRAD_GROUP1 };
+
+/* Decode the traditional command `cmd`: return the register type, and
+   store the clock byte number or the offset into the PRAM group in
+   `index`.  The first bit is the read/write bit and the last two bits
+   are not part of the address.  Addresses 14 and 15 are the encoding
+   of the first byte of an extended command.  */
+static inline uint8_t tradCmdReg(uint8_t cmd, uint8_t *index)
+{
+  uint8_t lAddress = (cmd&~(1<<7))>>2;
+  *index = lAddress&0x03;
+  if (lAddress < 8)
+    return TRAD_CLOCK; // Little endian clock data byte
+  if (lAddress < 12)
+    return TRAD_GROUP2;
+  if (lAddress == 12)
+    return TRAD_TEST;
+  if (lAddress == 13)
+    return TRAD_WRITE_PROTECT;
+  if (lAddress < 16)
+    return TRAD_XCMD;
+  *index = lAddress&0x0f;
+  return TRAD_GROUP1;
+}
+
+// Return true if `cmd` is the first byte of an extended command.
+#define isXCmd(cmd) (((cmd)&0x78) == 0x38)
+
+/* Assemble the XPRAM address from the two extended command bytes,
+   z0000aaa 0defgh??.  */
+#define xCmdAddr(cmd1, cmd2) ((((cmd1)&0x07)<<5) | (((cmd2)&0x7c)>>2))
+
+#endif /* not RTC_REGS_H */
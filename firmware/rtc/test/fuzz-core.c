@@ -0,0 +1,212 @@
+/* Coverage-guided fuzzer for the RTC protocol core.
+
+   `LLVMFuzzerTestOneInput()` plays an input as a sequence of CE, CLK
+   and DATA events, see `fuzz-edges.h`, into `rtc-core.c` built for
+   the host, and checks the protocol's invariants after every event:
+
+   * The RTC only drives the data line while sending data, and never
+     sends for longer than its longest reply.
+   * Nothing changes PRAM or the clock while write-protect is set.
+   * CE high always returns the core to idle, with the data line
+     released, and it then answers a valid command correctly.
+
+   A violation aborts, which libFuzzer reports as a crash and saves
+   the input.  Build with clang's `-fsanitize=fuzzer`, or with
+   `-DFUZZ_STANDALONE` for a plain driver:
+
+   Usage: fuzz-replay FILE...
+          fuzz-replay -r N [SEED]
+
+   The first form replays the given inputs, the second runs N random
+   inputs.  To replay an input against the firmware under `simavr`,
+   use `test-rtc -F FILE`.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtc-core.h"
+#include "rtc-hal.h"
+#include "fuzz-edges.h"
+
+// Longest run of serial clock edges that can leave the core sending
+// data, from the last command bit to the last data bit.
+#if BurstXPram
+#define MAX_SENDING_EDGES (256 * 8 + 1)
+#else
+#define MAX_SENDING_EDGES (8 + 1)
+#endif
+
+#define FUZZ_CHECK(cond) \
+  ((cond) ? (void)0 : fuzzFail(#cond, __LINE__))
+
+static void fuzzFail(const char *cond, int line)
+{
+  fprintf(stderr, "fuzz-core.c:%d: invariant failed: %s\n", line, cond);
+  abort();
+}
+
+static bool8_t coreIdle(void)
+{
+  return serialState == SERIAL_DISABLED && serialBitNum == 0 &&
+    halRtcData == 1;
+}
+
+static void snapPram(byte *dest)
+{
+  uint16_t i;
+  for (i = 0; i < PRAM_SIZE; i++)
+    dest[i] = pram[i];
+}
+
+// Check that the core answers a valid write and read.
+static void checkRecovery(void)
+{
+  byte sent[2];
+  byte cmd = 0x80 | (16 << 2) | 0x01;
+  sent[0] = (13 << 2) | 0x01; // clear write-protect
+  sent[1] = 0x00;
+  rtcHostTransact(sent, 2, false);
+  sent[0] = (16 << 2) | 0x01;
+  sent[1] = 0xa5;
+  rtcHostTransact(sent, 2, false);
+  FUZZ_CHECK(rtcHostTransact(&cmd, 1, true) == 0xa5);
+  FUZZ_CHECK(coreIdle() && !writePending);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static byte pramBefore[PRAM_SIZE], pramAfter[PRAM_SIZE];
+  bool8_t selected = false;
+  unsigned sendingEdges = 0;
+  size_t i;
+
+  rtcHostReset();
+  for (i = 0; i < size; i++) {
+    byte ev = data[i];
+    bool8_t protect = writeProtect;
+    uint32_t secondsBefore = seconds;
+    if (protect)
+      snapPram(pramBefore);
+
+    if (EDGE_IS_CLK(ev)) {
+      if (!selected)
+        continue;
+      halHostData = (EDGE_CLK_RELEASE(ev)) ? 1 : EDGE_CLK_DATA(ev);
+      serClockFallingEdge();
+      halHostData = 1;
+      if (serialState == SENDING_DATA) {
+        sendingEdges++;
+        FUZZ_CHECK(sendingEdges <= MAX_SENDING_EDGES);
+        FUZZ_CHECK(serialBitNum <= 8);
+      } else
+        sendingEdges = 0;
+    } else {
+      switch (EDGE_OP(ev)) {
+      case EDGE_CE_HIGH:
+        if (selected) {
+          serialDeselect();
+          selected = false;
+          sendingEdges = 0;
+          FUZZ_CHECK(coreIdle());
+        }
+        break;
+      case EDGE_CE_LOW:
+        if (!selected) {
+          serialSelect();
+          selected = true;
+        }
+        break;
+      case EDGE_HALF_SEC:
+        advanceHalfSecond(false);
+        break;
+      case EDGE_NEW_SEC:
+        advanceHalfSecond(true);
+        secondsBefore++;
+        break;
+      }
+    }
+    // `loop()` runs a queued write long before the next edge.
+    if (writePending)
+      execPendingWrite();
+
+    FUZZ_CHECK(serialState <= RECEIVING_BURST_COUNT);
+    FUZZ_CHECK(selected || serialState == SERIAL_DISABLED);
+    FUZZ_CHECK(halRtcData || serialState == SENDING_DATA);
+    if (protect) {
+      snapPram(pramAfter);
+      FUZZ_CHECK(memcmp(pramBefore, pramAfter, PRAM_SIZE) == 0);
+      FUZZ_CHECK(seconds == secondsBefore);
+    }
+  }
+
+  if (selected)
+    serialDeselect();
+  FUZZ_CHECK(coreIdle());
+  checkRecovery();
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+// Replay one input file.  Return false if it can't be read.
+static bool8_t replayFile(const char *fname)
+{
+  static uint8_t buf[65536];
+  size_t size;
+  FILE *fp = fopen(fname, "rb");
+  if (fp == NULL) {
+    perror(fname);
+    return false;
+  }
+  size = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+  LLVMFuzzerTestOneInput(buf, size);
+  printf("%s: %u events OK\n", fname, (unsigned)size);
+  return true;
+}
+
+/* Run random inputs, weighted towards sessions of whole bytes with
+   few CE changes so that they get past the command byte.  */
+static void runRandom(unsigned long count, unsigned seed)
+{
+  static uint8_t buf[4096];
+  unsigned long n;
+  srand(seed);
+  for (n = 0; n < count; n++) {
+    size_t size = rand() % sizeof(buf);
+    size_t i;
+    for (i = 0; i < size; i++) {
+      int r = rand() % 64;
+      if (r == 0)
+        buf[i] = 0x80 | EDGE_CE_HIGH;
+      else if (r == 1)
+        buf[i] = 0x80 | EDGE_CE_LOW;
+      else if (r == 2)
+        buf[i] = 0x80 | (rand() & 0x03);
+      else
+        buf[i] = rand() & 0x7f;
+    }
+    LLVMFuzzerTestOneInput(buf, size);
+  }
+  printf("%lu random inputs OK\n", count);
+}
+
+int main(int argc, char *argv[])
+{
+  int i;
+  if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+    runRandom(strtoul(argv[2], NULL, 0),
+              (argc >= 4) ? strtoul(argv[3], NULL, 0) : 1);
+    return 0;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s FILE...\n"
+            "       %s -r N [SEED]\n", argv[0], argv[0]);
+    return 1;
+  }
+  for (i = 1; i < argc; i++)
+    if (!replayFile(argv[i]))
+      return 1;
+  return 0;
+}
+#endif
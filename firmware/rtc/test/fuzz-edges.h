@@ -0,0 +1,22 @@
+/* Input format of the `fuzz-core` fuzzer, shared with `test-rtc` so
+   that an input found on the host core can be replayed against the
+   firmware under `simavr`.
+
+   Each input byte is one event on the RTC's pins.  If the MSB is
+   clear, it's a serial clock pulse, with the host driving the data
+   line to bit 0, or releasing it if bit 1 is set.  Otherwise, bits 1
+   and 0 select CE high, CE low, or half a second passing, with or
+   without the seconds counter ticking.  Clock pulses while CE is high
+   are ignored by the firmware, and repeated CE levels are no-ops.  */
+
+#ifndef FUZZ_EDGES_H
+#define FUZZ_EDGES_H
+
+#define EDGE_IS_CLK(ev) (!((ev) & 0x80))
+#define EDGE_CLK_RELEASE(ev) (((ev) & 0x02) ? 1 : 0)
+#define EDGE_CLK_DATA(ev) ((ev) & 0x01)
+#define EDGE_OP(ev) ((ev) & 0x03)
+
+enum EdgeOpType { EDGE_CE_HIGH, EDGE_CE_LOW, EDGE_HALF_SEC, EDGE_NEW_SEC };
+
+#endif /* not FUZZ_EDGES_H */
@@ -0,0 +1,397 @@
+/* Native unit tests and benchmark for the RTC protocol core.
+
+   This builds `rtc-core.c` together with `rtc-host.c` for the host,
+   so the serial state machine and register file can be checked in a
+   fraction of a second, without `simavr` or an AVR toolchain.  Every
+   serial clock edge is a function call, so there is no timing here:
+   timekeeping, power management, and the pin and timer code are left
+   to `test-rtc`.
+
+   Build it with the same feature macros as the firmware image under
+   test, i.e. `-DNoXPRAM=1` for the 20-byte PRAM models.
+
+   Usage: test-core [-b N]
+
+   With `-b N`, run N transactions of each kind as a benchmark and
+   print the rate, rather than running the tests.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtc-core.h"
+#include "rtc-hal.h"
+
+unsigned g_passCount;
+unsigned g_failCount;
+
+void recTsResult(bool8_t result, const char *desc)
+{
+  fputs((result) ? "PASS:" : "FAIL:", stdout);
+  fputs(desc, stdout);
+  putchar('\n');
+  if (result)
+    g_passCount++;
+  else
+    g_failCount++;
+}
+
+/********************************************************************/
+/* Command helpers, mirroring the ones in `test-rtc`.  */
+
+// Generate a traditional command byte for the given register address.
+byte genCmd(byte address, bool8_t writeRequest)
+{
+  return ((writeRequest) ? 0x00 : 0x80) | ((address & 0x1f) << 2) | 0x01;
+}
+
+byte readTrad(byte address)
+{
+  byte cmd = genCmd(address, false);
+  return rtcHostTransact(&cmd, 1, true);
+}
+
+void writeTrad(byte address, byte data)
+{
+  byte sent[2] = { genCmd(address, true), data };
+  rtcHostTransact(sent, 2, false);
+}
+
+#if !NoXPRAM
+byte readX(byte address)
+{
+  byte sent[2] = { 0xb8 | ((address & 0xe0) >> 5),
+                   (address & 0x1f) << 2 };
+  return rtcHostTransact(sent, 2, true);
+}
+
+void writeX(byte address, byte data)
+{
+  byte sent[3] = { 0x38 | ((address & 0xe0) >> 5),
+                   (address & 0x1f) << 2, data };
+  rtcHostTransact(sent, 3, false);
+}
+#endif
+
+uint32_t readClock(void)
+{
+  uint32_t value = 0;
+  byte i;
+  for (i = 0; i < 4; i++)
+    value |= (uint32_t)readTrad(i) << (i << 3);
+  return value;
+}
+
+// True if the core is idle with the data line released.
+bool8_t isIdle(void)
+{
+  return serialState == SERIAL_DISABLED && serialBitNum == 0 &&
+    halRtcData == 1 && !writePending;
+}
+
+/********************************************************************/
+/* Tests.  Each one starts from `rtcHostReset()`.  */
+
+// Traditional PRAM registers, groups 1 and 2, round trip and land at
+// the right PRAM offsets.
+bool8_t testTradPram(void)
+{
+  byte i;
+  for (i = 0; i < 4; i++)
+    writeTrad(8 + i, 0xa0 + i);
+  for (i = 0; i < 16; i++)
+    writeTrad(16 + i, 0x50 + i);
+  for (i = 0; i < 4; i++)
+    if (readTrad(8 + i) != 0xa0 + i || pram[GROUP2_BASE + i] != 0xa0 + i)
+      return false;
+  for (i = 0; i < 16; i++)
+    if (readTrad(16 + i) != 0x50 + i || pram[GROUP1_BASE + i] != 0x50 + i)
+      return false;
+  return isIdle();
+}
+
+// Write-protect register blocks all writes but its own.
+bool8_t testWriteProtect(void)
+{
+  writeTrad(16, 0x11);
+  writeTrad(13, 0x80);
+  writeTrad(16, 0x22);
+  writeTrad(0, 0x33);
+  writeTrad(3, 0x44);
+#if !NoXPRAM
+  writeX(0x80, 0x55);
+#endif
+  if (readTrad(16) != 0x11 || shadowBytes != 0)
+    return false;
+#if !NoXPRAM
+  if (pram[0x80] != 0)
+    return false;
+#endif
+  writeTrad(13, 0x00);
+  writeTrad(16, 0x22);
+  return readTrad(16) == 0x22 && isIdle();
+}
+
+// Clock writes commit on the MSB, and a tick between the reads of a
+// four-byte time comes from the latch.
+bool8_t testClock(void)
+{
+  uint32_t value;
+  writeTrad(0, 0x78);
+  writeTrad(1, 0x56);
+  writeTrad(2, 0x34);
+  advanceHalfSecond(true);
+  if (shadowBytes != 0x07)
+    return false;
+  writeTrad(3, 0x12);
+  if (seconds != 0x12345678 || shadowBytes != 0)
+    return false;
+  seconds = 0x000000ff;
+  value = readTrad(0);
+  advanceHalfSecond(true);
+  value |= (uint32_t)readTrad(1) << 8;
+  value |= (uint32_t)readTrad(2) << 16;
+  value |= (uint32_t)readTrad(3) << 24;
+  if (value != 0x000000ff || latchBytes != 0)
+    return false;
+  // A latch that was left unread expires.
+  readTrad(0);
+  advanceHalfSecond(false);
+  advanceHalfSecond(true);
+  return readTrad(1) == 0x01 && readClock() == 0x00000101;
+}
+
+// Invalid reads and the extended command prefix on 20-byte chips
+// release the data line and leave the core idle.
+bool8_t testInvalid(void)
+{
+  if (readTrad(12) != 0xff || !isIdle())
+    return false;
+  if (readTrad(13) != 0xff || !isIdle())
+    return false;
+#if NoXPRAM
+  {
+    byte sent[2] = { 0xb8, 0x00 };
+    if (rtcHostTransact(sent, 2, true) != 0xff || !isIdle())
+      return false;
+  }
+#endif
+  // Test write does nothing.
+  writeTrad(12, 0xff);
+  return isIdle();
+}
+
+// A session cut short partway through a byte doesn't disturb the
+// next one.
+bool8_t testAbort(void)
+{
+  byte cmd = genCmd(16, true);
+  writeTrad(16, 0x5a);
+  // Two bits of a command byte, then a command and half a data
+  // byte.
+  serialSelect();
+  halHostData = 0;
+  serClockFallingEdge();
+  serClockFallingEdge();
+  halHostData = 1;
+  serialDeselect();
+  if (!isIdle())
+    return false;
+  serialSelect();
+  for (cmd = 0; cmd < 12; cmd++) {
+    halHostData = bitRead(genCmd(16, true), 7 - (cmd & 7));
+    serClockFallingEdge();
+  }
+  halHostData = 1;
+  serialDeselect();
+  return isIdle() && readTrad(16) == 0x5a;
+}
+
+#if !NoXPRAM
+// Every XPRAM address round trips through extended commands, and
+// the traditional registers alias into it.
+bool8_t testXPram(void)
+{
+  uint16_t i;
+  for (i = 0; i < PRAM_SIZE; i++)
+    writeX(i, i ^ 0xa5);
+  for (i = 0; i < PRAM_SIZE; i++)
+    if (readX(i) != (i ^ 0xa5) || pram[i] != (i ^ 0xa5))
+      return false;
+  return readTrad(16) == (GROUP1_BASE ^ 0xa5) &&
+    readTrad(8) == (GROUP2_BASE ^ 0xa5) && isIdle();
+}
+#endif
+
+#if BurstXPram
+// Bursts wrap around at the end of XPRAM, and a count of zero moves
+// all 256 bytes.
+bool8_t testBurst(void)
+{
+  byte data[256];
+  uint16_t i;
+  for (i = 0; i < 16; i++)
+    data[i] = 0x30 + i;
+  rtcHostBurst(0xf8, data, 16, true);
+  for (i = 0; i < 16; i++)
+    if (pram[(0xf8 + i) & 0xff] != 0x30 + i)
+      return false;
+  memset(data, 0, sizeof(data));
+  rtcHostBurst(0x00, data, 256, false);
+  for (i = 0; i < 256; i++)
+    if (data[i] != pram[i])
+      return false;
+  for (i = 0; i < 256; i++)
+    data[i] = ~i;
+  rtcHostBurst(0x40, data, 256, true);
+  for (i = 0; i < 256; i++)
+    if (pram[(0x40 + i) & 0xff] != (byte)~i)
+      return false;
+  return isIdle() && readX(0x40) == 0xff;
+}
+#endif
+
+#if Telemetry
+uint32_t readTelemetryReg(byte reg, byte size)
+{
+  uint32_t value = 0;
+  byte i;
+  for (i = 0; i < size; i++) {
+    byte sent[2] = { 0xb8 | (((reg + i) & 0xe0) >> 5),
+                     (((reg + i) & 0x1f) << 2) | 0x02 };
+    value |= (uint32_t)rtcHostTransact(sent, 2, true) << (i << 3);
+  }
+  return value;
+}
+
+// Counters see the same sessions as the `telemetry` test in
+// `test-rtc`, and the window doesn't count itself.
+bool8_t testTelemetry(void)
+{
+  byte cmd;
+  if (readTelemetryReg(0, 1) != TELEMETRY_MAGIC ||
+      readTelemetryReg(1, 1) != TELEMETRY_REGS)
+    return false;
+  readTrad(16);
+  readTrad(8);
+  readX(0x80);
+  readTrad(0);
+  readTrad(1);
+  writeTrad(16, 1);
+  writeX(0x80, 2);
+  writeTrad(0, 3);
+  readTrad(12);
+  // Aborted write, command and half the data byte.
+  serialSelect();
+  for (cmd = 0; cmd < 12; cmd++) {
+    halHostData = bitRead(genCmd(16, true), 7 - (cmd & 7));
+    serClockFallingEdge();
+  }
+  halHostData = 1;
+  serialDeselect();
+  return readTelemetryReg(4, 4) == 5 && readTelemetryReg(8, 4) == 3 &&
+    readTelemetryReg(12, 2) == 1 && readTelemetryReg(14, 2) == 1;
+}
+#endif
+
+struct TestCase {
+  const char *name;
+  bool8_t (*func)(void);
+};
+
+const struct TestCase testCases[] = {
+  { "trad-pram", testTradPram },
+  { "write-protect", testWriteProtect },
+  { "clock", testClock },
+  { "invalid", testInvalid },
+  { "abort", testAbort },
+#if !NoXPRAM
+  { "xpram", testXPram },
+#endif
+#if BurstXPram
+  { "burst", testBurst },
+#endif
+#if Telemetry
+  { "telemetry", testTelemetry },
+#endif
+};
+
+#define NUM_TEST_CASES (sizeof(testCases) / sizeof(testCases[0]))
+
+/********************************************************************/
+/* Benchmark.  */
+
+double elapsedSecs(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) +
+    (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void prRate(const char *desc, unsigned long count, double secs)
+{
+  printf("%-16s %10lu in %6.3f s, %12.0f per second\n",
+         desc, count, secs, count / secs);
+}
+
+void benchmark(unsigned long count)
+{
+  struct timespec start;
+  unsigned long i;
+  volatile byte sink = 0;
+
+  rtcHostReset();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++)
+    sink ^= readTrad(16 + (i & 0x0f));
+  prRate("trad reads", count, elapsedSecs(&start));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++)
+    writeTrad(16 + (i & 0x0f), i);
+  prRate("trad writes", count, elapsedSecs(&start));
+
+#if !NoXPRAM
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++)
+    sink ^= readX(i);
+  prRate("xpram reads", count, elapsedSecs(&start));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++)
+    writeX(i, i);
+  prRate("xpram writes", count, elapsedSecs(&start));
+#endif
+
+#if BurstXPram
+  {
+    byte data[256];
+    unsigned long bursts = count / 256 + 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < bursts; i++)
+      rtcHostBurst(0, data, 256, false);
+    prRate("256-byte bursts", bursts, elapsedSecs(&start));
+  }
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned i;
+  if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+    benchmark(strtoul(argv[2], NULL, 0));
+    return 0;
+  }
+  if (argc != 1) {
+    fprintf(stderr, "Usage: %s [-b N]\n", argv[0]);
+    return 1;
+  }
+  for (i = 0; i < NUM_TEST_CASES; i++) {
+    rtcHostReset();
+    recTsResult(testCases[i].func(), testCases[i].name);
+  }
+  printf("%u passed, %u failed\n", g_passCount, g_failCount);
+  return (g_failCount) ? 1 : 0;
+}
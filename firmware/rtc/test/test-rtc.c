@@ -59,32 +59,31 @@
 #include <time.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <sys/mman.h>
-#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <libelf.h>
+#include <gelf.h>
 
 #include "sim_avr.h"
 #include "avr_ioport.h"
 #include "avr_timer.h"
+#include "avr_eeprom.h"
 #include "sim_elf.h"
 #include "sim_gdb.h"
 #include "sim_vcd_file.h"
 
 /********************************************************************/
-/* Simplified Arduino definitions support module header */
-
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned uint32_t;
-typedef enum { false, true } bool;
-
-typedef uint8_t byte;
-typedef bool boolean;
-typedef uint8_t bool8_t;
-
-#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
-#define bitSet(value, bit) ((value) |= (1UL << (bit)))
-#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
-#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+/* The protocol core, built natively to keep the host copy of the RTC
+   memory, see `mirrorTransact()`.  It also brings in the simplified
+   Arduino definitions and the command decoding shared with the
+   firmware.  */
+#include "../rtc-core.h"
+#include "../rtc-hal.h"
+// Input format of the `fuzz-core` fuzzer.
+#include "fuzz-edges.h"
 
 /********************************************************************/
 /* Miniature Apple II monitor module header */
@@ -103,6 +102,9 @@ enum BenchIrqs { IRQ_SEC1, IRQ_CE, IRQ_CLK, IRQ_DATA_IN, IRQ_DATA_OUT };
 
 extern avr_t *avr;
 extern avr_irq_t *bench_irqs;
+extern bool8_t g_simVirtTime;
+
+uint64_t simTimeNsec(void);
 
 /********************************************************************/
 /* Automated test suite module header */
@@ -308,8 +310,8 @@ rpi_gpio_unwatch_async_fe (unsigned char idx)
 /********************************************************************/
 /* Linux GPIO interrupts support module */
 
-/* Linux `epoll` is an ugly way to get GPIO interrupts into
-   user-space, but it works and it is relativelly old/stable.  Matter
+/* Linux `poll()` and `epoll` are an ugly way to get GPIO interrupts
+   into user-space, but it works and it is relativelly old/stable.  Matter
    of fact, Raspbian was first released without any Linux kernel
    support for GPIO interrupts in user-space, despite the hardware
    having the capability.  As soon as the software capability was
@@ -322,12 +324,13 @@ rpi_gpio_unwatch_async_fe (unsigned char idx)
    possible for the rest on Raspberry Pi.
 
    Only a single GPIO pin is supported for interrupt wait-and-notify.
-   To support more than one thread, though, we simply use a single
-   epfd_thread descriptor (likewise only a single wait-notify thread)
-   and then open and add one file descriptor per GPIO pin.  Adding
-   watches on all read pins can be particularly useful for producing
-   VCD files for poor man's oscilloscope analysis of Apple's custom
-   silicon RTC.
+   Rather than dedicating a thread to waiting on it, the GPIO value
+   file descriptor is added to the `poll()` calls of the command-line
+   event loop and of the test bench's wait routines, which then call
+   `lingpirq_service()` when an edge is signaled.  Adding watches on
+   all read pins can be particularly useful for producing VCD files
+   for poor man's oscilloscope analysis of Apple's custom silicon
+   RTC.
 */
 
 /*
@@ -335,62 +338,55 @@ rpi_gpio_unwatch_async_fe (unsigned char idx)
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
-#include <pthread.h>
-#include <sys/epoll.h>
+#include <poll.h>
 
 #include "arduino_sdef.h"
 */
 
 int g_gpio_num;
-pthread_t g_epoll_thread;
-bool8_t g_thread_running = false;
-bool8_t g_thread_initial = true;
 int g_gpio_fd = -1;
-int epfd_thread = -1;
 
 void sec1Isr(void);
 
-void *lingpirq_poll_thread(void *thread_arg)
+// Return the file descriptor to `poll()` for `POLLPRI` to wait for
+// GPIO interrupts.
+int lingpirq_fd(void)
 {
-  int old_type;
-  struct epoll_event events;
-  char buf;
+  return g_gpio_fd;
+}
 
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old_type);
-  g_thread_running = true;
-  while (g_thread_running) {
-    int result = epoll_wait(epfd_thread, &events, 1, -1);
-    if (result > 0) {
-      lseek(events.data.fd, 0, SEEK_SET);
-      if (read(events.data.fd, &buf, 1) != 1) {
-        g_thread_running = false;
-        pthread_exit((void*)0);
-      }
-      if (g_thread_initial) // ignore first epoll trigger
-        g_thread_initial = false;
-      else
-        sec1Isr();
-    } else if (result == -1) {
-      if (errno == EINTR)
-        continue;
-      g_thread_running = false;
-      pthread_exit((void*)0);
-    }
-  }
+// Acknowledge a signaled GPIO interrupt and notify the interrupt
+// handler.  Return false on error.
+bool8_t lingpirq_service(void)
+{
+  char buf;
+  lseek(g_gpio_fd, 0, SEEK_SET);
+  if (read(g_gpio_fd, &buf, 1) != 1)
+    return false;
+  sec1Isr();
+  return true;
+}
 
-  pthread_exit((void*)0);
+// Wait up to the given number of milliseconds for a GPIO interrupt
+// and service it.  Return true if there was one.
+bool8_t lingpirq_wait(int timeout)
+{
+  struct pollfd fds;
+  fds.fd = g_gpio_fd;
+  fds.events = POLLPRI;
+  if (poll(&fds, 1, timeout) > 0 && (fds.revents & (POLLPRI | POLLERR)))
+    return lingpirq_service();
+  return false;
 }
 
 // If `falling_edge` is `false`, then use the rising edge instead.
 bool8_t lingpirq_setup(int gpio_num, bool8_t falling_edge)
 {
-  struct epoll_event ev;
-
   char cmd[64];
   char filename[64];
+  char buf;
   g_gpio_num = gpio_num;
   g_gpio_fd = -1;
-  epfd_thread = -1;
   snprintf(cmd, sizeof(cmd), "echo %d >/sys/class/gpio/export", g_gpio_num);
   if (system(cmd) != 0)
     return false; /* error */
@@ -411,23 +407,13 @@ bool8_t lingpirq_setup(int gpio_num, bool8_t falling_edge)
   if (g_gpio_fd < 0)
     goto cleanup_fail; /* error */
 
-  // Create and configure an `epoll` for the GPIO file descriptor.
-  epfd_thread = epoll_create(1);
-  if (epfd_thread == -1)
-    goto cleanup_fail; /* error */
-  ev.events = EPOLLIN | EPOLLET | EPOLLPRI;
-  ev.data.fd = g_gpio_fd;
-  if (epoll_ctl(epfd_thread, EPOLL_CTL_ADD, g_gpio_fd, &ev) == -1)
-    goto cleanup_fail; /* error */
-
-  // Create the wait-and-notify thread.
-  if (pthread_create(&g_epoll_thread, NULL,
-                     lingpirq_poll_thread, (void*)0) != 0)
+  // The value file always starts out signaled, so read it once to
+  // ignore the first trigger.
+  if (read(g_gpio_fd, &buf, 1) != 1)
     goto cleanup_fail; /* error */
 
   return true; /* success */
  cleanup_fail:
-  close(epfd_thread);
   close(g_gpio_fd);
   snprintf(cmd, sizeof(cmd), "echo %d >/sys/class/gpio/unexport", g_gpio_num);
   system(cmd);
@@ -436,19 +422,9 @@ bool8_t lingpirq_setup(int gpio_num, bool8_t falling_edge)
 
 void lingpirq_cleanup(void)
 {
-  void *thread_retval;
-  struct epoll_event ev;
   char cmd[64];
-  pthread_cancel(g_epoll_thread);
-  pthread_join(g_epoll_thread, &thread_retval);
-  g_thread_running = false;
-  ev.events = EPOLLIN | EPOLLET | EPOLLPRI;
-  ev.data.fd = g_gpio_fd;
-  close(g_gpio_fd);
-  epoll_ctl(epfd_thread, EPOLL_CTL_DEL, g_gpio_fd, &ev);
-  close(epfd_thread);
-
   close(g_gpio_fd);
+  g_gpio_fd = -1;
   snprintf(cmd, sizeof(cmd), "echo %d >/sys/class/gpio/unexport", g_gpio_num);
   system(cmd);
 }
@@ -467,6 +443,12 @@ void lingpirq_cleanup(void)
 */
 
 bool8_t simAvrStep(void);
+bool8_t simIdle(int *timeout);
+void simWaitUsec(uint32_t usec);
+bool8_t simBatchBegin(void);
+uint32_t simBatchEnd(void);
+bool8_t simQueueViaWrite(uint8_t *ptr, uint8_t bit, uint8_t bitvalue);
+bool8_t simQueueViaSample(uint8_t *ptr, uint8_t bit);
 avr_cycle_count_t notify_timeup(avr_t *avr, avr_cycle_count_t when,
                                 void *param);
 
@@ -488,7 +470,6 @@ uint8_t vBase[4];
 uint8_t const *VIA = vBase;
 
 bool g_waitTimeUp = true;
-uint8_t g_timePoll = 0;
 
 enum PhyPins { PHY_SEC1, PHY_CE, PHY_CLK, PHY_DATA };
 
@@ -511,7 +492,22 @@ uint8_t viaBitRead(uint8_t *ptr, uint8_t bit)
   return bitRead(*(ptr), (bit));
 }
 
-void viaBitWrite(uint8_t *ptr, uint8_t bit, uint8_t bitvalue)
+/* Sample a VIA register bit, like `viaBitRead()`.  While a
+   simulation batch is being queued, the sample is taken when the
+   batch runs and gets returned by `simBatchEnd()`, so zero is
+   returned here.  */
+uint8_t viaBitSample(uint8_t *ptr, uint8_t bit)
+{
+  if (!g_phyMode && simQueueViaSample(ptr, bit))
+    return 0;
+  return viaBitRead(ptr, bit);
+}
+
+/* Perform a VIA register bit write immediately, driving the
+   corresponding pin of the hardware or the simulation.  Under
+   simulation, this is only called on the thread that runs the
+   simulator.  */
+void viaBitWriteNow(uint8_t *ptr, uint8_t bit, uint8_t bitvalue)
 {
   // Only handle the vBufB and vDirB registers for now.
   if (ptr == vBase + vBufB) {
@@ -564,6 +560,15 @@ void viaBitWrite(uint8_t *ptr, uint8_t bit, uint8_t bitvalue)
   bitWrite(*ptr, bit, bitvalue);
 }
 
+void viaBitWrite(uint8_t *ptr, uint8_t bit, uint8_t bitvalue)
+{
+  // If we're queuing a simulation batch or the simulator runs on its
+  // own thread, perform the write when the simulation gets there.
+  if (!g_phyMode && simQueueViaWrite(ptr, bit, bitvalue))
+    return;
+  viaBitWriteNow(ptr, bit, bitvalue);
+}
+
 /* Time our wait periods based off of a maximum 500 Hz (minimum 2 ms
    period) clock signal.  That means we need to wait at least 0.5 ms
    (500 us = 500000 ns) for a quarter-cycle wait time.
@@ -574,42 +579,46 @@ void viaBitWrite(uint8_t *ptr, uint8_t bit, uint8_t bitvalue)
    clock, so it takes 128 seconds to write all 256 bytes of XPRAM.
    This should be compared with the speed limits of Apple custom
    silicon RTC.  */
+/* Wait for the given number of microseconds on physical hardware,
+   servicing 1-second interrupts in the meantime.  */
+void phyWaitUsec(uint32_t usec)
+{
+  struct timespec tvEnd, tv;
+  clock_gettime(CLOCK_MONOTONIC, &tvEnd);
+  tvEnd.tv_sec += usec / 1000000;
+  tvEnd.tv_nsec += (usec % 1000000) * 1000;
+  if (tvEnd.tv_nsec >= 1000000000) {
+    tvEnd.tv_nsec -= 1000000000;
+    tvEnd.tv_sec++;
+  }
+  while (1) {
+    long remainMs;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    remainMs = (tvEnd.tv_sec - tv.tv_sec) * 1000 +
+      (tvEnd.tv_nsec - tv.tv_nsec) / 1000000;
+    // `poll()` only has millisecond resolution, so sleep precisely
+    // for the final stretch.
+    if (remainMs < 2)
+      break;
+    lingpirq_wait(remainMs - 1);
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                         &tvEnd, NULL) == EINTR);
+  // Pick up an interrupt that came in during the final stretch.
+  lingpirq_wait(0);
+}
+
 void waitQuarterCycle(void)
 {
   if (g_phyMode) {
-    struct timespec tv = { 0, 500000 };
-    struct timespec tvNext;
-    do {
-      if (clock_nanosleep(CLOCK_MONOTONIC, 0, &tv, &tvNext) == 0)
-        break;
-      tv.tv_nsec = tvNext.tv_nsec;
-    } while (tv.tv_nsec > 0);
+    phyWaitUsec(500);
   } else {
     // Unfortunately, if the AVR runs at 32.768 kHz, I've found from
     // simulation that serial communications are only reliable at an
     // abysmal 50 Hz serial clock speed.  Therefore, running at a
     // higher core speed and using a phase-locked loop on the crystal
     // clock frequency a must.
-    struct timespec tv, tvTarget;
-    // N.B. Over here we are using cycle timers mainly to prevent
-    // simulation waits stretching unbearably long.
-    g_timePoll = 16;
-    avr_cycle_timer_register(avr, g_timePoll, notify_timeup, NULL);
-    clock_gettime(CLOCK_MONOTONIC, &tv);
-    tvTarget.tv_nsec = tv.tv_nsec + 500000;
-    tvTarget.tv_sec = tv.tv_sec;
-    if (tvTarget.tv_nsec >= 1000000000) {
-      tvTarget.tv_nsec -= 1000000000;
-      tvTarget.tv_sec++;
-    }
-    while (tv.tv_sec < tvTarget.tv_sec ||
-           (tv.tv_sec == tvTarget.tv_sec &&
-            tv.tv_nsec < tvTarget.tv_nsec)) {
-      if (!simAvrStep())
-        break;
-      clock_gettime(CLOCK_MONOTONIC, &tv);
-    }
-    g_timePoll = 0;
+    simWaitUsec(500);
   }
 }
 
@@ -628,24 +637,9 @@ void waitCycle(void)
 void waitOneSec(void)
 {
   if (g_phyMode) {
-    sleep(1);
+    phyWaitUsec(1000000);
   } else {
-    struct timespec tv, tvTarget;
-    // N.B. Over here we are using cycle timers mainly to prevent
-    // simulation waits stretching unbearably long.
-    g_timePoll = 16;
-    avr_cycle_timer_register(avr, g_timePoll, notify_timeup, NULL);
-    clock_gettime(CLOCK_MONOTONIC, &tv);
-    tvTarget.tv_nsec = tv.tv_nsec;
-    tvTarget.tv_sec = tv.tv_sec + 1;
-    while (tv.tv_sec < tvTarget.tv_sec ||
-           (tv.tv_sec == tvTarget.tv_sec &&
-            tv.tv_nsec < tvTarget.tv_nsec)) {
-      if (!simAvrStep())
-        break;
-      clock_gettime(CLOCK_MONOTONIC, &tv);
-    }
-    g_timePoll = 0;
+    simWaitUsec(1000000);
   }
 }
 
@@ -699,17 +693,52 @@ void viaDestroy(void)
 #include "simavr-support.h"
 */
 
-// PRAM configuration, set to XPRAM by default
+extern bool8_t g_simTlMode;
+void simPersistMarkDirty(uint8_t addr);
+byte simTlTransact(const byte *sent, uint8_t numSent, bool8_t recv);
+void simTlBurst(byte addr, byte *data, uint16_t count, bool8_t writeRequest);
+
+// PRAM configuration of the firmware, set to XPRAM by default.  The
+// host copy always has the XPRAM layout, see `mirrorTransact()`.
 int pramSize = 256;
 int group1Base = 0x10;
 int group2Base = 0x08;
 
-// Host copy of RTC chip memory.  Note that the write-protect register
-// cannot be read.
+/* Host copy of RTC chip memory.  The write-protect register and PRAM
+   are `writeProtect` and `pram` in the protocol core, which keeps the
+   clock in `seconds`, synchronized with `timeSecs` by
+   `mirrorTransact()`.  Note that the write-protect register cannot be
+   read.  */
 volatile uint32_t timeSecs = 0;
 pthread_mutex_t timeSecsMutex;
-byte writeProtect = 0;
-byte pram[256];
+// The host copy of PRAM, for bulk copies.
+#define hostPram ((byte *)pram)
+
+byte hostTradCmd(byte cmd, byte data);
+
+/* Perform a serial transaction on the host copy, running it through
+   the same protocol core as the firmware, so that the host copy
+   follows the write-protect register, the clock shadow register and
+   the command decoding exactly.  Arguments and result are as for
+   `rtcHostTransact()`.  */
+byte mirrorTransact(const byte *sent, uint8_t numSent, bool8_t recv)
+{
+  byte result;
+  pthread_mutex_lock(&timeSecsMutex);
+  seconds = timeSecs;
+  result = rtcHostTransact(sent, numSent, recv);
+  timeSecs = seconds;
+  pthread_mutex_unlock(&timeSecsMutex);
+  return result;
+}
+
+// Read the time in a single pass, for RTCs that latch the seconds
+// counter when byte 0 is read, see `dumpTime()`.
+bool8_t fastTimeRead = false;
+
+// Transfer all of XPRAM in one burst, for RTCs that have the burst
+// extended command, see `serialBurstTransact()`.
+bool8_t burstXPram = false;
 
 // Delta between Macintosh time epoch and Unix time epoch.  Number of
 // seconds between 1904 and 1970 = 16 4-year cycles plus 1 regular
@@ -718,10 +747,11 @@ byte pram[256];
 const uint32_t macUnixDelta = 60UL * 60 * 24 *
   ((365 * 4 + 1) * 16 + (365 * 2 + 1));
 
-// Initialize the `timeSecs` mutex.
+// Initialize the `timeSecs` mutex and the host copy of RTC memory.
 void pramInit(void)
 {
   pthread_mutex_init(&timeSecsMutex, NULL);
+  rtcHostReset();
 }
 
 // Destroy the `timeSecs` mutex.
@@ -753,25 +783,57 @@ bool8_t getPramType(void)
   return false;
 }
 
+void setFastTimeRead(bool8_t fast)
+{
+  fastTimeRead = fast;
+}
+
+bool8_t getFastTimeRead(void)
+{
+  return fastTimeRead;
+}
+
+void setBurstXPram(bool8_t burst)
+{
+  burstXPram = burst;
+}
+
+bool8_t getBurstXPram(void)
+{
+  return burstXPram;
+}
+
+/* N.B. Under simulation, the following bit-level subroutines queue
+   their VIA pin changes and samples as a batch of timestamped events,
+   then run the simulator uninterrupted until the batch is complete.
+   On physical hardware, the batch subroutines do nothing.  */
+
 void serialBegin(void)
 {
+  bool8_t batch = simBatchBegin();
   viaBitWrite(vBase + vDirB, rtcEnb, DIR_OUT);
   viaBitWrite(vBase + vDirB, rtcData, DIR_OUT);
   viaBitWrite(vBase + vDirB, rtcClk, DIR_OUT);
   viaBitWrite(vBase + vBufB, rtcClk, 0);
   viaBitWrite(vBase + vBufB, rtcEnb, 0);
   waitQuarterCycle();
+  if (batch)
+    simBatchEnd();
 }
 
 void serialEnd(void)
 {
+  bool8_t batch = simBatchBegin();
   viaBitWrite(vBase + vBufB, rtcEnb, 1);
   waitQuarterCycle();
+  if (batch)
+    simBatchEnd();
 }
 
 void sendByte(byte data)
 {
   uint8_t bitNum = 0;
+  bool8_t batch = simBatchBegin();
   viaBitWrite(vBase + vDirB, rtcData, DIR_OUT);
   while (bitNum <= 7) {
     uint8_t bit = (data >> (7 - bitNum)) & 1;
@@ -783,12 +845,15 @@ void sendByte(byte data)
     viaBitWrite(vBase + vBufB, rtcClk, 0);
     waitQuarterCycle();
   }
+  if (batch)
+    simBatchEnd();
 }
 
 byte recvByte(void)
 {
   byte serialData = 0;
   uint8_t bitNum = 0;
+  bool8_t batch = simBatchBegin();
   viaBitWrite(vBase + vDirB, rtcData, DIR_IN);
   while (bitNum <= 7) {
     uint8_t bit;
@@ -797,49 +862,98 @@ byte recvByte(void)
     waitHalfCycle();
     viaBitWrite(vBase + vBufB, rtcClk, 0);
     waitQuarterCycle();
-    bit = viaBitRead(vBase + vBufB, rtcData);
+    bit = viaBitSample(vBase + vBufB, rtcData);
     serialData |= bit << (7 - bitNum);
     bitNum++;
   }
+  if (batch)
+    serialData = simBatchEnd();
   return serialData;
 }
 
-byte sendReadCmd(byte cmd)
+/* Perform a complete serial transaction at the bit level: send the
+   given bytes, then if `recv` is true, receive one byte and return
+   it.  Otherwise return zero.  */
+byte serialTransact(const byte *sent, uint8_t numSent, bool8_t recv)
 {
-  byte serialData;
+  byte serialData = 0;
+  uint8_t i;
   serialBegin();
-  sendByte(cmd);
-  serialData = recvByte();
+  for (i = 0; i < numSent; i++)
+    sendByte(sent[i]);
+  if (recv)
+    serialData = recvByte();
   serialEnd();
   return serialData;
 }
 
-void sendWriteCmd(byte cmd, byte data)
+/* Perform a complete serial transaction.  Under simulation in
+   transaction-level mode, the firmware's memory is accessed directly
+   instead, see `simTlTransact()`.  */
+byte pramTransact(const byte *sent, uint8_t numSent, bool8_t recv)
+{
+  if (!g_phyMode && g_simTlMode)
+    return simTlTransact(sent, numSent, recv);
+  return serialTransact(sent, numSent, recv);
+}
+
+uint16_t genXCmd(byte addr, bool8_t writeRequest);
+
+/* Perform a burst XPRAM transaction at the bit level: send an
+   extended command with the low bits of the second byte set to 01,
+   then the byte count, then send or receive `count` bytes at
+   consecutive addresses starting at `addr`, all in one session.
+   `count` must be between 1 and 256.  */
+void serialBurstTransact(byte addr, byte *data, uint16_t count,
+                         bool8_t writeRequest)
 {
+  uint16_t xcmd = genXCmd(addr, writeRequest) | 0x0001;
+  uint16_t i;
   serialBegin();
-  sendByte(cmd);
-  sendByte(data);
+  sendByte((xcmd >> 8) & 0xff);
+  sendByte(xcmd & 0xff);
+  sendByte(count & 0xff); // zero means 256
+  for (i = 0; i < count; i++) {
+    if (writeRequest)
+      sendByte(data[i]);
+    else
+      data[i] = recvByte();
+  }
   serialEnd();
 }
 
+/* Perform a burst XPRAM transaction, see `serialBurstTransact()`.
+   Under simulation in transaction-level mode, the firmware's memory
+   is accessed directly instead.  */
+void pramBurst(byte addr, byte *data, uint16_t count, bool8_t writeRequest)
+{
+  if (!g_phyMode && g_simTlMode)
+    simTlBurst(addr, data, count, writeRequest);
+  else
+    serialBurstTransact(addr, data, count, writeRequest);
+}
+
+byte sendReadCmd(byte cmd)
+{
+  return pramTransact(&cmd, 1, true);
+}
+
+void sendWriteCmd(byte cmd, byte data)
+{
+  byte sent[2] = { cmd, data };
+  pramTransact(sent, 2, false);
+}
+
 byte sendReadXCmd(byte cmd1, byte cmd2)
 {
-  byte serialData;
-  serialBegin();
-  sendByte(cmd1);
-  sendByte(cmd2);
-  serialData = recvByte();
-  serialEnd();
-  return serialData;
+  byte sent[2] = { cmd1, cmd2 };
+  return pramTransact(sent, 2, true);
 }
 
 void sendWriteXCmd(byte cmd1, byte cmd2, byte data)
 {
-  serialBegin();
-  sendByte(cmd1);
-  sendByte(cmd2);
-  sendByte(data);
-  serialEnd();
+  byte sent[3] = { cmd1, cmd2, data };
+  pramTransact(sent, 3, false);
 }
 
 // Perform a test write, does nothing since there is no indication if
@@ -852,26 +966,39 @@ void testWrite(void)
 // Set the write-protect register on the RTC.
 void setWriteProtect(void)
 {
-  sendWriteCmd(0x34, 0x80);
-  writeProtect = 1;
+  hostTradCmd(0x34, 0x80);
 }
 
 // Clear the write-protect register on the RTC.
 void clearWriteProtect(void)
 {
-  sendWriteCmd(0x34, 0x00);
-  writeProtect = 0;
+  hostTradCmd(0x34, 0x00);
 }
 
 /* Copy the time from RTC to host.  The time is read twice and
    compared for equality to verify a consistent read.  If the read is
    inconsistent, this function will retry up to a maximum of 4 times
-   before returning failure.  */
+   before returning failure.
+
+   In fast time read mode, the RTC serves all four bytes from a copy
+   of the seconds counter latched when byte 0 is read, so the time is
+   read only once, in byte order.  */
 bool8_t dumpTime(void)
 {
   uint8_t retry = 0;
   uint32_t newTime1, newTime2;
 
+  if (fastTimeRead) {
+    newTime1 = sendReadCmd(0x80);
+    newTime1 |= sendReadCmd(0x84) << 8;
+    newTime1 |= sendReadCmd(0x88) << 16;
+    newTime1 |= sendReadCmd(0x8c) << 24;
+    pthread_mutex_lock(&timeSecsMutex);
+    timeSecs = newTime1;
+    pthread_mutex_unlock(&timeSecsMutex);
+    return true;
+  }
+
   while (retry < 4) {
     newTime1 = 0; newTime2 = 0;
 
@@ -916,13 +1043,13 @@ void loadTime(void)
   ourTimeSecs = getTime();
   clearWriteProtect();
   serialData = ourTimeSecs & 0xff;
-  sendWriteCmd(0x00, serialData);
+  hostTradCmd(0x00, serialData);
   serialData = (ourTimeSecs >> 8) & 0xff;
-  sendWriteCmd(0x04, serialData);
+  hostTradCmd(0x04, serialData);
   serialData = (ourTimeSecs >> 16) & 0xff;
-  sendWriteCmd(0x08, serialData);
+  hostTradCmd(0x08, serialData);
   serialData = (ourTimeSecs >> 24) & 0xff;
-  sendWriteCmd(0x0c, serialData);
+  hostTradCmd(0x0c, serialData);
 }
 
 // Set the host time to the given new time and propagate it to the
@@ -935,11 +1062,15 @@ void setTime(uint32_t newTimeSecs)
   loadTime();
 }
 
-// 1-second interrupt service routine, increment the current time.
+// 1-second interrupt service routine, increment the current time and
+// age the read latch of the host copy.
 void sec1Isr(void)
 {
   pthread_mutex_lock(&timeSecsMutex);
-  timeSecs++;
+  seconds = timeSecs;
+  advanceHalfSecond(false);
+  advanceHalfSecond(true);
+  timeSecs = seconds;
   pthread_mutex_unlock(&timeSecsMutex);
 }
 
@@ -1042,11 +1173,11 @@ void dumpAllTradMem(void)
   uint8_t i;
   // Copy group 2 registers.
   for (i = 0; i < 4; i++) {
-    pram[group2Base+i] = genSendReadCmd(8 + i);
+    hostPram[GROUP2_BASE+i] = genSendReadCmd(8 + i);
   }
   // Copy group 1 registers.
   for (i = 0; i < 16; i++) {
-    pram[group1Base+i] = genSendReadCmd(16 + i);
+    hostPram[GROUP1_BASE+i] = genSendReadCmd(16 + i);
   }
 }
 
@@ -1058,11 +1189,11 @@ void loadAllTradMem(void)
   clearWriteProtect();
   // Copy group 2 registers.
   for (i = 0; i < 4; i++) {
-    genSendWriteCmd(8 + i, pram[group2Base+i]);
+    genSendWriteCmd(8 + i, hostPram[GROUP2_BASE+i]);
   }
   // Copy group 1 registers.
   for (i = 0; i < 16; i++) {
-    genSendWriteCmd(16 + i, pram[group1Base+i]);
+    genSendWriteCmd(16 + i, hostPram[GROUP1_BASE+i]);
   }
 }
 
@@ -1095,8 +1226,12 @@ void genSendWriteXCmd(byte addr, byte data)
 void dumpAllXMem(void)
 {
   uint8_t i = 0;
+  if (burstXPram) {
+    pramBurst(0, hostPram, 256, false);
+    return;
+  }
   do {
-    pram[i] = genSendReadXCmd(i);
+    hostPram[i] = genSendReadXCmd(i);
     i++;
   } while (i != 0);
   // N.B. We rely on overflow here to copy all 256 bytes.
@@ -1107,93 +1242,134 @@ void loadAllXMem(void)
 {
   uint8_t i = 0;
   clearWriteProtect();
+  if (burstXPram) {
+    pramBurst(0, hostPram, 256, true);
+    return;
+  }
   do {
-    genSendWriteXCmd(i, pram[i]);
+    genSendWriteXCmd(i, hostPram[i]);
     i++;
   } while (i != 0);
   // N.B. We rely on overflow here to copy all 256 bytes.
 }
 
-/* For 20-byte equivalent PRAM commands, read or write the
-   corresponding host memory.  Writes are also propagated to the RTC.
-   For reads, `data` is ignored.  Invalid reads return zero.
-   Successful writes return 1, unsuccessful writes return zero.
+/* Firmware telemetry, see the explanation in `MacRTC.c`.  The
+   registers are accessed with extended commands whose second byte
+   ends in 10, always at the bit level, so that the firmware sees them
+   even in transaction-level mode.  */
+#define TELEMETRY_MAGIC 0x54
+#define TELEMETRY_REGS 18
+
+struct TelemetryCounts {
+  uint8_t latencyUnit;
+  uint8_t maxLatency;
+  uint32_t reads;
+  uint32_t writes;
+  uint16_t aborts;
+  uint16_t invalid;
+  uint16_t slips;
+};
 
-   Copied almost exactly from the corresponding subroutine in the
-   firmware.  */
-byte hostTradPramCmd(byte cmd, byte data)
-{
-  bool8_t writeRequest = !(cmd&(1<<7));
-  // Discard the first bit and the last two bits, it's not pertinent
-  // to address interpretation.
-  byte address = (cmd&~(1<<7))>>2;
-  if (writeRequest && writeProtect &&
-      address != 13) // 13 == update write-protect register
-    return 0; // invalid command
-  if (address < 8) {
-    // Little endian clock data byte
-    if (writeRequest) {
-      address = (address&0x03)<<3;
-      timeSecs &= ~(0xff<<address);
-      timeSecs |= data<<address;
-      // Fall through to send command to RTC.
-    } else {
-      address = (address&0x03)<<3;
-      return (timeSecs>>address)&0xff;
-    }
-  } else if (address < 12) {
-    // Group 2 register
-    address = (address&0x03) + group2Base;
-    if (writeRequest) {
-      pram[address] = data;
-      // Fall through to send command to RTC.
-    } else
-      return pram[address];
-  } else if (address < 16) {
-    if (writeRequest) {
-      if (address == 12) // test write, do nothing
-        ; // Fall through to send command to RTC.
-      else if (address == 13) {
-        // Update the write-protect register.
-        writeProtect = ((data & 0x80)) ? 1 : 0;
-        // Fall through to send command to RTC.
-      }
-      else {
-        // Addresses 14 and 15 are used for the encoding of the first
-        // byte of an extended command.  Therefore, interpretation as
-        // a traditional PRAM command is invalid.
-        return 0;
-      }
-    } else
-      return 0; // invalid command
-  } else {
-    // Group 1 register
-    address = (address&0x0f) + group1Base;
-    if (writeRequest) {
-      pram[address] = data;
-      // Fall through to send command to RTC.
-    } else
-      return pram[address];
+// Read one telemetry register.
+byte readTelemetryReg(byte reg)
+{
+  uint16_t xcmd = genXCmd(reg, false) | 0x0002;
+  byte sent[2] = { (xcmd >> 8) & 0xff, xcmd & 0xff };
+  return serialTransact(sent, 2, true);
+}
+
+/* Read all telemetry registers into `tm`.  The counters are read one
+   byte per transaction, so read them until two passes agree.  Return
+   false if the RTC has no telemetry or the counters wouldn't hold
+   still.  */
+bool8_t readTelemetry(struct TelemetryCounts *tm)
+{
+  byte regs[2][TELEMETRY_REGS];
+  unsigned tries;
+  byte i;
+  if (readTelemetryReg(0) != TELEMETRY_MAGIC ||
+      readTelemetryReg(1) != TELEMETRY_REGS)
+    return false;
+  for (i = 0; i < TELEMETRY_REGS; i++)
+    regs[0][i] = readTelemetryReg(i);
+  for (tries = 0; tries < 4; tries++) {
+    byte *cur = regs[(tries + 1) & 1];
+    for (i = 0; i < TELEMETRY_REGS; i++)
+      cur[i] = readTelemetryReg(i);
+    if (memcmp(regs[0], regs[1], TELEMETRY_REGS) == 0)
+      break;
+  }
+  if (tries >= 4)
+    return false;
+  tm->latencyUnit = regs[0][2];
+  tm->maxLatency = regs[0][3];
+  tm->reads = regs[0][4] | (regs[0][5] << 8) | (regs[0][6] << 16) |
+    ((uint32_t)regs[0][7] << 24);
+  tm->writes = regs[0][8] | (regs[0][9] << 8) | (regs[0][10] << 16) |
+    ((uint32_t)regs[0][11] << 24);
+  tm->aborts = regs[0][12] | (regs[0][13] << 8);
+  tm->invalid = regs[0][14] | (regs[0][15] << 8);
+  tm->slips = regs[0][16] | (regs[0][17] << 8);
+  return true;
+}
+
+// Reset the telemetry counters, any write to the window does.
+void resetTelemetry(void)
+{
+  uint16_t xcmd = genXCmd(0, true) | 0x0002;
+  byte sent[3] = { (xcmd >> 8) & 0xff, xcmd & 0xff, 0 };
+  serialTransact(sent, 3, false);
+}
+
+// Read and print the telemetry counters.
+bool8_t dumpTelemetry(void)
+{
+  struct TelemetryCounts tm;
+  if (!readTelemetry(&tm)) {
+    puts("no telemetry");
+    return false;
   }
+  printf("reads: %lu\n", (unsigned long)tm.reads);
+  printf("writes: %lu\n", (unsigned long)tm.writes);
+  printf("aborted sessions: %u\n", tm.aborts);
+  printf("invalid commands: %u\n", tm.invalid);
+  printf("timer slips: %u\n", tm.slips);
+  printf("worst latency: %u ticks, %u cycles\n",
+         tm.maxLatency, tm.maxLatency * tm.latencyUnit);
+  return true;
+}
 
-  // We only reach this point for valid write commands.
+/* For 20-byte equivalent PRAM commands, read or write the host copy
+   of RTC memory, see `mirrorTransact()`.  Writes are also propagated
+   to the RTC, and return 1 whether or not the command took effect.
+   For reads, `data` is ignored and the byte read from the host copy
+   is returned, 0xff for commands that can't be read, as the released
+   data line reads.  */
+byte hostTradCmd(byte cmd, byte data)
+{
+  byte sent[2] = { cmd, data };
+  if ((cmd&(1<<7)))
+    return mirrorTransact(sent, 1, true);
   sendWriteCmd(cmd, data);
+  mirrorTransact(sent, 2, false);
   return 1;
 }
 
 // Write to host XPRAM memory and also propagate the changes to the
-// RTC.  Always succeeds and returns 1.
+// RTC.  Returns 1 whether or not the write took effect.
 byte hostWriteXMem(byte address, byte data)
 {
+  uint16_t xcmd = genXCmd(address, true);
+  byte sent[3] = { (xcmd >> 8) & 0xff, xcmd & 0xff, data };
   genSendWriteXCmd(address, data);
-  pram[address] = data;
+  mirrorTransact(sent, 3, false);
   return 1;
 }
 
 // Accessor function to read host XPRAM memory.
 byte hostReadXMem(byte address)
 {
-  return pram[address];
+  return hostPram[address];
 }
 
 // Load the host copy of the traditional PRAM from a file and update
@@ -1214,7 +1390,7 @@ bool8_t fileLoadAllTradMem(const char *filename)
     if (ch == EOF)
       goto cleanup_fail;
     data = ch;
-    pram[group1Base+i] = data;
+    hostPram[GROUP1_BASE+i] = data;
     genSendWriteCmd(16 + i, data);
   }
   // Copy group 2 registers.
@@ -1224,7 +1400,7 @@ bool8_t fileLoadAllTradMem(const char *filename)
     if (ch == EOF)
       goto cleanup_fail;
     data = ch;
-    pram[group2Base+i] = data;
+    hostPram[GROUP2_BASE+i] = data;
     genSendWriteCmd(8 + i, data);
   }
   if (fclose(fp) == EOF)
@@ -1245,13 +1421,13 @@ bool8_t fileDumpAllTradMem(const char *filename)
     return false;
   // Copy group 1 registers.
   for (i = 0; i < 16; i++) {
-    byte data = pram[group1Base+i];
+    byte data = hostPram[GROUP1_BASE+i];
     if (putc(data, fp) == EOF)
       goto cleanup_fail;
   }
   // Copy group 2 registers.
   for (i = 0; i < 4; i++) {
-    byte data = pram[group2Base+i];
+    byte data = hostPram[GROUP2_BASE+i];
     if (putc(data, fp) == EOF)
       goto cleanup_fail;
   }
@@ -1271,7 +1447,7 @@ bool8_t fileLoadAllXMem(const char *filename)
   FILE *fp = fopen(filename, "rb");
   if (fp == NULL)
     return false;
-  if (fread(pram, 1, 256, fp) != 256) {
+  if (fread(hostPram, 1, 256, fp) != 256) {
     fclose(fp);
     return false;
   }
@@ -1288,7 +1464,7 @@ bool8_t fileDumpAllXMem(const char *filename)
   FILE *fp = fopen(filename, "wb");
   if (fp == NULL)
     return false;
-  if (fwrite(pram, 1, 256, fp) != 256) {
+  if (fwrite(hostPram, 1, 256, fp) != 256) {
     fclose(fp);
     return false;
   }
@@ -1297,6 +1473,28 @@ bool8_t fileDumpAllXMem(const char *filename)
   return true;
 }
 
+// Load the host copy of whichever PRAM type is configured from a file
+// and update the RTC device memory.  Also clears write-protect.
+// Returns true on success, false on failure.
+bool8_t fileLoadAllMem(const char *filename)
+{
+  if (getPramType())
+    return fileLoadAllXMem(filename);
+  return fileLoadAllTradMem(filename);
+}
+
+// Copy whichever PRAM type is configured from the RTC to host and
+// save it to a file.  Returns true on success, false on failure.
+bool8_t fileDumpAllMem(const char *filename)
+{
+  if (getPramType()) {
+    dumpAllXMem();
+    return fileDumpAllXMem(filename);
+  }
+  dumpAllTradMem();
+  return fileDumpAllTradMem(filename);
+}
+
 /********************************************************************/
 /* PRAM interactive command line module */
 
@@ -1315,6 +1513,16 @@ bool8_t fileDumpAllXMem(const char *filename)
 
 void simRec(void);
 void simNoRec(void);
+void simStats(void);
+void simEepromDump(void);
+void simCall(void (*fn)(void));
+bool8_t simThreadPoll(void);
+bool8_t simSnapshot(void);
+bool8_t simRestore(void);
+bool8_t fileSimSnapshot(const char *filename);
+bool8_t fileSimRestore(const char *filename);
+bool8_t fileReplayEdges(const char *filename);
+extern bool8_t g_simThreaded;
 void setMonMode(uint8_t newMonMode);
 uint8_t getMonMode(void);
 byte monMemAccess(uint16_t address, bool8_t writeRequest, byte data);
@@ -1389,6 +1597,12 @@ uint8_t execCmdLine(char *lineBuf)
 "    echo str\n"
 "    set-pram-type isXPram -- 0 for 20-byte PRAM, 1 for XPRAM (default)\n"
 "    get-pram-type\n"
+"    set-fast-time-read fast -- 1 to read the time in a single pass, for\n"
+"                               RTCs that latch it\n"
+"    get-fast-time-read\n"
+"    set-burst-xpram burst -- 1 to transfer all of XPRAM in one burst, for\n"
+"                             RTCs that have the burst extension\n"
+"    get-burst-xpram\n"
 "    send-read-cmd cmd\n"
 "    send-write-cmd cmd data\n"
 "    send-read-xcmd cmd1 cmd2\n"
@@ -1416,6 +1630,9 @@ uint8_t execCmdLine(char *lineBuf)
 "    gen-send-write-xcmd address data\n"
 "    dump-all-xmem\n"
 "    load-all-xmem -- also clears write-protect\n"
+"    dump-telemetry -- show the RTC's telemetry counters, for telemetry\n"
+"                      builds of the firmware\n"
+"    reset-telemetry\n"
 "    host-trad-pram-cmd cmd data\n"
 "    host-write-xmem address data\n"
 "    host-read-xmem address\n"
@@ -1429,6 +1646,14 @@ uint8_t execCmdLine(char *lineBuf)
 "    file-dump-all-xmem filename\n"
 "    sim-rec -- start recording RTC pin signal waveforms\n"
 "    sim-no-rec -- stop recording RTC pin signal waveforms\n"
+"    sim-stats -- show simulated time, sleep and power statistics\n"
+"    dump-sim-eeprom -- show the simulated AVR's EEPROM\n"
+"    sim-snapshot -- save simulation and host state in memory\n"
+"    sim-restore -- restore the in-memory snapshot\n"
+"    file-sim-snapshot filename\n"
+"    file-sim-restore filename\n"
+"    file-replay-edges filename -- replay a fuzz-core input, then check\n"
+"                                  that the RTC recovers\n"
 "    auto-test-suite verbose simRealTime testXPram\n"
 "    suite-start\n"
 "    suite-end\n"
@@ -1496,6 +1721,26 @@ uint8_t execCmdLine(char *lineBuf)
     result = getPramType();
     printf("0x%02x\n", result);
     return 1;
+  } else if (strcmp(cmdName,  "set-fast-time-read") == 0) {
+    PARSE_8BIT_HEAD(1);
+    setFastTimeRead(params[0]);
+    return 1;
+  } else if (strcmp(cmdName,  "get-fast-time-read") == 0) {
+    byte result;
+    PARSE_8BIT_HEAD(0);
+    result = getFastTimeRead();
+    printf("0x%02x\n", result);
+    return 1;
+  } else if (strcmp(cmdName,  "set-burst-xpram") == 0) {
+    PARSE_8BIT_HEAD(1);
+    setBurstXPram(params[0]);
+    return 1;
+  } else if (strcmp(cmdName,  "get-burst-xpram") == 0) {
+    byte result;
+    PARSE_8BIT_HEAD(0);
+    result = getBurstXPram();
+    printf("0x%02x\n", result);
+    return 1;
   } else if (strcmp(cmdName, "send-read-cmd") == 0) {
     byte result;
     PARSE_8BIT_HEAD(1);
@@ -1629,10 +1874,17 @@ uint8_t execCmdLine(char *lineBuf)
     PARSE_8BIT_HEAD(0);
     loadAllXMem();
     return 1;
+  } else if (strcmp(cmdName, "dump-telemetry") == 0) {
+    PARSE_8BIT_HEAD(0);
+    return dumpTelemetry();
+  } else if (strcmp(cmdName, "reset-telemetry") == 0) {
+    PARSE_8BIT_HEAD(0);
+    resetTelemetry();
+    return 1;
   } else if (strcmp(cmdName, "host-trad-pram-cmd") == 0) {
     byte result;
     PARSE_8BIT_HEAD(2);
-    result = hostTradPramCmd(params[0], params[1]);
+    result = hostTradCmd(params[0], params[1]);
     printf("0x%02x\n", result);
     return 1;
   } else if (strcmp(cmdName, "host-write-xmem") == 0) {
@@ -1680,13 +1932,47 @@ uint8_t execCmdLine(char *lineBuf)
   } else if (strcmp(cmdName, "sim-rec") == 0) {
     PARSE_8BIT_HEAD(0);
     if (!g_phyMode)
-      simRec();
+      simCall(simRec);
     return 1;
   } else if (strcmp(cmdName, "sim-no-rec") == 0) {
     PARSE_8BIT_HEAD(0);
     if (!g_phyMode)
-      simNoRec();
+      simCall(simNoRec);
+    return 1;
+  } else if (strcmp(cmdName, "sim-stats") == 0) {
+    PARSE_8BIT_HEAD(0);
+    if (!g_phyMode)
+      simCall(simStats);
+    return 1;
+  } else if (strcmp(cmdName, "dump-sim-eeprom") == 0) {
+    PARSE_8BIT_HEAD(0);
+    if (!g_phyMode)
+      simCall(simEepromDump);
     return 1;
+  } else if (strcmp(cmdName, "sim-snapshot") == 0) {
+    byte result;
+    PARSE_8BIT_HEAD(0);
+    result = !g_phyMode && simSnapshot();
+    printf("0x%02x\n", result);
+    return result;
+  } else if (strcmp(cmdName, "sim-restore") == 0) {
+    byte result;
+    PARSE_8BIT_HEAD(0);
+    result = !g_phyMode && simRestore();
+    printf("0x%02x\n", result);
+    return result;
+  } else if (strcmp(cmdName, "file-sim-snapshot") == 0) {
+    byte result = !g_phyMode && fileSimSnapshot(parsePtr);
+    printf("0x%02x\n", result);
+    return result;
+  } else if (strcmp(cmdName, "file-sim-restore") == 0) {
+    byte result = !g_phyMode && fileSimRestore(parsePtr);
+    printf("0x%02x\n", result);
+    return result;
+  } else if (strcmp(cmdName, "file-replay-edges") == 0) {
+    byte result = fileReplayEdges(parsePtr);
+    printf("0x%02x\n", result);
+    return result;
   } else if (strcmp(cmdName, "auto-test-suite") == 0) {
     byte result;
     PARSE_8BIT_HEAD(3);
@@ -1784,40 +2070,108 @@ uint8_t execMultiCmdLine(char *lineBuf)
   return retVal;
 }
 
+/* Wait until standard input is readable.  Meanwhile, keep the
+   simulation running, or service the 1-second interrupt on physical
+   hardware.  Return 1 when input is ready, 0 if the simulation
+   terminated, or -1 on error.  */
+int waitInput(void)
+{
+  // We only read standard input at the file descriptor level, so
+  // make sure the prompt gets out.
+  fflush(stdout);
+  while (1) {
+    struct pollfd fds[2];
+    nfds_t numFds = 1;
+    int timeout = -1;
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    if (g_phyMode) {
+      fds[1].fd = lingpirq_fd();
+      fds[1].events = POLLPRI;
+      numFds++;
+    } else if (!simIdle(&timeout))
+      return 0;
+    if (poll(fds, numFds, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (numFds > 1 && (fds[1].revents & (POLLPRI | POLLERR)))
+      lingpirq_service();
+    if (fds[0].revents != 0)
+      return 1;
+  }
+}
+
+enum ReadLineResult { LINE_OK, LINE_EOF, LINE_TOO_LONG, LINE_ERROR,
+                      LINE_SIM_DONE };
+
+// Buffered standard input not yet returned by `readCmdLine()`.
+char g_inBuf[512];
+size_t g_inLen = 0;
+bool8_t g_inEof = false;
+
+/* Read one line from standard input into `lineBuf`, without the
+   newline character.  Only read standard input when it is ready, see
+   `waitInput()`.  */
+int readCmdLine(char *lineBuf, size_t lineBufLen)
+{
+  while (1) {
+    char *newline = memchr(g_inBuf, '\n', g_inLen);
+    ssize_t result;
+    if (newline != NULL || (g_inEof && g_inLen > 0)) {
+      size_t len = (newline != NULL) ? newline - g_inBuf : g_inLen;
+      size_t used = (newline != NULL) ? len + 1 : len;
+      if (len >= lineBufLen)
+        return LINE_TOO_LONG;
+      memcpy(lineBuf, g_inBuf, len);
+      lineBuf[len] = '\0';
+      memmove(g_inBuf, g_inBuf + used, g_inLen - used);
+      g_inLen -= used;
+      return LINE_OK;
+    }
+    if (g_inEof)
+      return LINE_EOF;
+    if (g_inLen >= sizeof(g_inBuf))
+      return LINE_TOO_LONG;
+    switch (waitInput()) {
+    case 0: return LINE_SIM_DONE;
+    case -1: return LINE_ERROR;
+    }
+    result = read(STDIN_FILENO, g_inBuf + g_inLen,
+                  sizeof(g_inBuf) - g_inLen);
+    if (result == 0)
+      g_inEof = true;
+    else if (result > 0)
+      g_inLen += result;
+    else if (errno != EINTR && errno != EAGAIN)
+      return LINE_ERROR;
+  }
+}
+
 // Return false on exit with error, true on graceful exit.
 bool8_t cmdLoop(bool8_t notScripted)
 {
   uint8_t retVal = true;
   char lineBuf[512];
-  char *parsePtr;
 
   // Print the prompt character.
   if (notScripted) putchar('*');
 
   while (1) {
 
-    if (fgets(lineBuf, 512, stdin) == NULL) {
-      if (feof(stdin)) {
-        if (notScripted) putchar('\n');
-        break; // End of file
-      }
-      else if (errno == EWOULDBLOCK) {
-        // Run one simulation step.
-        if (!simAvrStep()) {
-          fputs("Simulation terminated.\n", stdout);
-          return true;
-        }
-        continue;
-      } else
-        break; // Other I/O error.
-    }
-
-    parsePtr = lineBuf + strlen(lineBuf) - 1;
-    if (*parsePtr != '\n') {
+    int result = readCmdLine(lineBuf, sizeof(lineBuf));
+    if (result == LINE_EOF) {
+      if (notScripted) putchar('\n');
+      break; // End of file
+    } else if (result == LINE_SIM_DONE) {
+      fputs("Simulation terminated.\n", stdout);
+      return true;
+    } else if (result == LINE_TOO_LONG) {
       fputs("Error: Command line too long.\n", stderr);
       return false;
-    }
-    *parsePtr = '\0'; // Chomp off the newline character.
+    } else if (result != LINE_OK)
+      break; // Other I/O error.
 
     // Dispatch on the command name.
     retVal = execMultiCmdLine(lineBuf);
@@ -1857,15 +2211,15 @@ uint8_t getMonMode(void)
 /* Read/write to either traditional PRAM or XPRAM depending on the
    Apple II monitor mode.  Addresses out of range return zero on read
    and do nothing on write.  For reads, `data` is ignored.  Returns
-   data on successful reads, zero on unsuccessful reads, one on
-   successful writes, zero on unsuccessful writes.  */
+   data on reads, 0xff for traditional PRAM addresses that can't be
+   read, and one on writes, see `hostTradCmd()`.  */
 byte monMemAccess(uint16_t address, bool8_t writeRequest, byte data)
 {
   if (monMode == 1) {
     // Traditional PRAM
     if (address > 0x1f)
       return 0; // invalid address
-    return hostTradPramCmd(genCmd(address, writeRequest), data);
+    return hostTradCmd(genCmd(address, writeRequest), data);
   } else if (monMode == 2) {
     // XPRAM
     if (address > 0xff)
@@ -2142,10 +2496,14 @@ void writehex(char *rch)
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "sim_avr.h"
 #include "avr_ioport.h"
 #include "avr_timer.h"
+#include "avr_eeprom.h"
 #include "sim_elf.h"
 #include "sim_gdb.h"
 #include "sim_vcd_file.h"
@@ -2163,275 +2521,2782 @@ avr_t *avr = NULL;
 avr_vcd_t vcd_file;
 avr_irq_t *bench_irqs = NULL;
 
+/* Virtual time mode: every test bench wait is measured in AVR cycles
+   rather than host wall-clock time, so the simulation runs as fast as
+   the host CPU allows and timing is fully deterministic.  When
+   disabled, the simulation is paced to real time.  */
+bool8_t g_simVirtTime = true;
+
+// Set when the RTC changes one of its output pins.
+bool8_t g_simOutEvent = false;
+
+// Set while a snapshot is being restored, to ignore the spurious pin
+// changes that this causes.
+bool8_t g_simRestoring = false;
+
+// Host time corresponding to simulated time zero, for pacing the
+// simulation in real time mode.
+struct timespec g_simRtBase;
+
+// Simulation statistics: the number of times the AVR went to sleep
+// and the number of cycles skipped over while sleeping.
+unsigned long g_simSleepCount = 0;
+avr_cycle_count_t g_simSleepCycles = 0;
+// Number of times the AVR woke up, simulated time spent asleep, and
+// the cycle count at which the last sleep period ended.
+unsigned long g_simWakeCount = 0;
+uint64_t g_simSleepNs = 0;
+avr_cycle_count_t g_simSleepEnd = 0;
+
+/* Residency in each power state at each system clock division, in
+   cycles, for estimating the supply current.  States 0 to 3 are the
+   sleep modes by their MCUCR SM bits, then running.  */
+#define SIM_RES_ACTIVE 4
+#define SIM_RES_STATES 5
+#define SIM_RES_CLKPS 9
+struct SimResidency {
+  avr_cycle_count_t cycles[SIM_RES_STATES][SIM_RES_CLKPS];
+};
+// Cycles asleep so far, plus all cycles up to `g_simResCycle`.
+struct SimResidency g_simRes;
+avr_cycle_count_t g_simResTotal[SIM_RES_CLKPS];
+avr_cycle_count_t g_simResCycle = 0;
+
+// AVR core clock frequency override, zero to use the frequency the
+// firmware was built for.
+uint32_t g_simFrequency = 0;
+
+// Timer constants that the firmware derived from its F_CPU, see
+// `simTimerSetup()`.
+struct SimTimerConsts {
+  bool8_t valid;
+  uint32_t fCpu;
+  uint32_t prescaler;
+  uint32_t limOflows;
+  uint32_t limRemain;
+  uint32_t numerFrac;
+  uint32_t denomFrac;
+  uint32_t clkps; // CLKPR clock division at F_CPU
+  uint32_t idleClkps; // CLKPR clock division while idle
+  uint32_t timer1; // nonzero if timekeeping runs from Timer1
+};
+
+struct SimTimerConsts g_simTimerConsts;
+
+/* EEPROM persistence of PRAM, see `PersistPram` in the firmware.  The
+   firmware exports its write-back delay and where its journal
+   starts, and we look up its write-back state so that we can wait
+   for the write-back to finish.  */
+struct SimPersist {
+  bool8_t valid;
+  uint32_t delay; // half-seconds without PRAM writes before write-back
+  uint32_t journal; // EEPROM address of the journal
+  // AVR data addresses of the firmware's write-back state.
+  uint16_t dirtyAddr;
+  uint16_t dirtySize;
+  uint16_t delayAddr;
+  uint16_t busyAddr;
+  uint16_t stateAddr;
+  uint16_t posAddr;
+  uint16_t pendingAddr;
+};
+struct SimPersist g_simPersist;
+// The firmware's `persistState` while it folds the journal into the
+// image.
+#define SIM_PERSIST_IMAGE 1
+
+// Number of SEC1 falling edges and the simulated time of the last
+// one, only touched on the thread that runs the simulator.
+unsigned long g_simSec1Count = 0;
+uint64_t g_simSec1Ns = 0;
+
+/* System clock prescaler emulation, see `sim_clkpr_write()`.  Once the
+   firmware changes CLKPR, a cycle no longer has a fixed length, so we
+   keep track of the cycle count and simulated time at which the clock
+   was last switched.  */
+uint32_t g_simClkRefFreq = 0; // undivided system clock
+uint32_t g_simClkNormFreq = 0; // F_CPU, the clock at the normal division
+uint8_t g_simClkps = 0;
+avr_cycle_count_t g_simClkBaseCycle = 0;
+uint64_t g_simClkBaseNs = 0;
+/* The simulator thread may switch the clock at any time, so the test
+   bench thread reads the clock base and frequency from this copy
+   instead, which `simClkPublish()` updates under `g_simClkMutex`
+   together with the cycle count.  */
+struct SimClkBase {
+  avr_cycle_count_t cycle;
+  uint64_t ns;
+  uint32_t frequency;
+};
+pthread_mutex_t g_simClkMutex = PTHREAD_MUTEX_INITIALIZER;
+struct SimClkBase g_simClkShared;
+bool8_t g_simClkpceArmed = false;
+avr_cycle_count_t g_simClkpceCycle = 0;
+// Number of clock switches, and of CLK edges that the RTC saw while
+// selected but not running at F_CPU.
+unsigned long g_simClkSwitches = 0;
+unsigned long g_simClkSlowEdges = 0;
+
+// Transaction-level mode, see `simTlTransact()`.
+bool8_t g_simTlMode = false;
+unsigned g_simTlCheck = 0; // zero to never cross-check
+unsigned long g_simTlCount = 0;
+unsigned long g_simTlChecked = 0;
+unsigned long g_simTlMismatches = 0;
+
+/* Simulator thread.  When enabled, the AVR simulation runs on its
+   own thread so that the command line and test bench logic never
+   stall the simulated MCU.  The two threads only talk to each other
+   through a pair of single-producer, single-consumer ring buffers of
+   timestamped messages: VIA pin writes, samples, and "run until"
+   requests flow from the test bench to the simulator, and samples,
+   SEC1 edges, and acknowledgements flow back.  The VIA registers and
+   everything owned by `simavr` are only touched by the simulator
+   thread.  */
+bool8_t g_simThreaded = false;
+
+enum SimMsgType {
+  SIMMSG_VIA_WRITE, // bench -> sim: VIA register bit write
+  SIMMSG_VIA_SAMPLE, // bench -> sim: sample a VIA register bit
+  SIMMSG_RUN_UNTIL, // bench -> sim: run until `when`, then acknowledge
+  SIMMSG_CALL, // bench -> sim: call `fn` on the simulator thread
+  SIMMSG_ACK, // sim -> bench: last request completed
+  SIMMSG_SAMPLE, // sim -> bench: sampled bit value
+  SIMMSG_SEC1, // sim -> bench: falling edge on SEC1
+  SIMMSG_STOPPED, // sim -> bench: simulation terminated
+};
+
+struct SimMsg {
+  avr_cycle_count_t when;
+  uint8_t type;
+  uint8_t reg; // VIA register offset
+  uint8_t bit;
+  uint8_t value;
+  void (*fn)(void);
+};
+
+#define SIMRING_SIZE 256 // must be a power of two
+
+struct SimRing {
+  struct SimMsg buf[SIMRING_SIZE];
+  atomic_uint head; // next slot to read, only written by the consumer
+  atomic_uint tail; // next slot to write, only written by the producer
+};
+
+struct SimRing g_benchToSim;
+struct SimRing g_simToBench;
+pthread_t g_simThread;
+atomic_bool g_simThreadQuit;
+// Cycle count most recently reached by the simulator thread.
+_Atomic avr_cycle_count_t g_simCycleNow;
+// Bench side: set when the outstanding request has been acknowledged
+// or the simulation stopped.
+bool8_t g_simAcked = false;
+bool8_t g_simStopped = false;
+/* Real-time mode only: the simulator thread polls for bench messages
+   at least this often in simulated time, and the bench timestamps
+   its events this far into the future so that they are never
+   late.  */
+avr_cycle_count_t g_simPollCycles;
+avr_cycle_count_t g_simLeadCycles;
+
+void simThreadSend(const struct SimMsg *msg);
+void simThreadReply(const struct SimMsg *msg);
+bool8_t simThreadRequest(uint8_t type, avr_cycle_count_t when,
+                         void (*fn)(void));
+
+// Return true if the message was added, false if the ring is full.
+bool8_t simRingPush(struct SimRing *ring, const struct SimMsg *msg)
+{
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head >= SIMRING_SIZE)
+    return false;
+  ring->buf[tail & (SIMRING_SIZE - 1)] = *msg;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+// Return true if a message was removed, false if the ring is empty.
+bool8_t simRingPop(struct SimRing *ring, struct SimMsg *msg)
+{
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail)
+    return false;
+  *msg = ring->buf[head & (SIMRING_SIZE - 1)];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+/* Back off while waiting on the other thread: spin with yields for a
+   while, then start sleeping so that an idle thread doesn't burn a
+   host CPU.  */
+void simBackoff(unsigned *spins)
+{
+  if (++*spins < 1000)
+    sched_yield();
+  else {
+    struct timespec tv = { 0, 100000 };
+    nanosleep(&tv, NULL);
+  }
+}
+
 avr_cycle_count_t notify_timeup(avr_t *avr, avr_cycle_count_t when,
                                 void *param)
 {
   g_waitTimeUp = true;
-  if (g_timePoll)
-    return avr->cycle + g_timePoll;
   return 0;
 }
 
-// Start recording VCD signal waveforms for RTC pins.  Only applicable
-// when running under simulation.
-void simRec(void)
+/* Return the simulated time at the given cycle count, in nanoseconds
+   since the AVR was powered on.  Cycles after the last clock switch
+   are counted at the current clock frequency.  */
+uint64_t simClkTimeNsec(uint64_t baseNs, avr_cycle_count_t delta,
+                        uint32_t frequency)
 {
-    printf("Starting VCD trace\n");
-    avr_vcd_start(&vcd_file);
+  // Split the division so that the multiplication can't overflow.
+  return baseNs + delta / frequency * 1000000000 +
+    delta % frequency * 1000000000 / frequency;
 }
 
-// Stop recording VCD signal waveforms for RTC pins.  Only applicable
-// when running under simulation.
-void simNoRec(void)
+uint64_t simCycleTimeNsec(avr_cycle_count_t cycle)
 {
-    printf("Stopping VCD trace\n");
-    avr_vcd_stop(&vcd_file);
+  return simClkTimeNsec(g_simClkBaseNs, cycle - g_simClkBaseCycle,
+                        avr->frequency);
 }
 
-void pin_change_notify(avr_irq_t *irq, uint32_t value, void *param)
+// Inverse of `simCycleTimeNsec()`, assuming that the clock isn't
+// switched again in between.
+avr_cycle_count_t simNsecToCycle(uint64_t ns)
 {
-  if (irq == bench_irqs + IRQ_SEC1 && !value)
-    sec1Isr();
-  else if (irq == bench_irqs + IRQ_DATA_OUT) {
-    // Only write the updated value to the buffer register if the VIA
-    // is in the input mode.  Also, note that the value we receive is
-    // inverted.
-    if (bitRead(vBase[vDirB], rtcData) == DIR_IN)
-      bitWrite(vBase[vBufB], rtcData, !value);
-  }
+  uint64_t delta;
+  if (ns <= g_simClkBaseNs)
+    return g_simClkBaseCycle;
+  delta = ns - g_simClkBaseNs;
+  return g_simClkBaseCycle + delta / 1000000000 * avr->frequency +
+    delta % 1000000000 * avr->frequency / 1000000000;
 }
 
-int setupSimAvr(char *progName, const char *fname, bool8_t interactMode)
+// Return the current cycle count, safe to call from the test bench
+// thread.
+avr_cycle_count_t simNowCycle(void)
 {
-  elf_firmware_t f;
+  if (g_simThreaded)
+    return atomic_load(&g_simCycleNow);
+  return avr->cycle;
+}
 
-  if (elf_read_firmware(fname, &f) != 0) {
-    fprintf(stderr, "%s: firmware '%s' invalid\n", progName, fname);
-    return 1;
-  }
-  strcpy(f.mmcu, "attiny85");
-  //f.frequency = 8000000;
-  // DEBUG NOTE: I'm only able to do real-time simulation at 400 kHz.
-  f.frequency = 400000;
-  
-  printf("firmware %s f=%d mmcu=%s\n", fname, (int)f.frequency, f.mmcu);
+// Return the cycle count at which the test bench's next event should
+// take place.
+avr_cycle_count_t simBenchCycle(void)
+{
+  if (g_simThreaded && !g_simVirtTime)
+    return simNowCycle() + g_simLeadCycles;
+  return simNowCycle();
+}
 
-  avr = avr_make_mcu_by_name(f.mmcu);
-  if (!avr) {
-    fprintf(stderr, "%s: AVR '%s' not known\n", progName, f.mmcu);
-    return 1;
-  }
-  avr_init(avr);
-  avr_load_firmware(avr, &f);
+/* Publish the clock base and frequency and the current cycle count
+   to the test bench thread.  Call this on the thread that runs the
+   simulator whenever the clock is switched or the cycle count is
+   moved.  */
+void simClkPublish(void)
+{
+  pthread_mutex_lock(&g_simClkMutex);
+  g_simClkShared.cycle = g_simClkBaseCycle;
+  g_simClkShared.ns = g_simClkBaseNs;
+  g_simClkShared.frequency = avr->frequency;
+  atomic_store(&g_simCycleNow, avr->cycle);
+  pthread_mutex_unlock(&g_simClkMutex);
+}
 
-  // Initialize our host circuit "peripheral."
+// Return the simulated time elapsed since the AVR was powered on, in
+// nanoseconds.
+uint64_t simTimeNsec(void)
+{
+  struct SimClkBase clk;
+  avr_cycle_count_t cycle;
+  if (!g_simThreaded)
+    return simCycleTimeNsec(avr->cycle);
+  /* Read the cycle count under the lock too, so that it can't be
+     from before the clock switch that set the base.  */
+  pthread_mutex_lock(&g_simClkMutex);
+  clk = g_simClkShared;
+  cycle = atomic_load(&g_simCycleNow);
+  pthread_mutex_unlock(&g_simClkMutex);
+  return simClkTimeNsec(clk.ns, cycle - clk.cycle, clk.frequency);
+}
 
-  // Setup IRQ connections and connect our test bench and AVR
-  // together.
-  bench_irqs = avr_alloc_irq(&avr->irq_pool, 0, 5, bench_irq_names);
+// Convert microseconds to cycles at the current clock frequency, safe
+// to call from the test bench thread.
+avr_cycle_count_t simUsecToCycles(uint32_t usec)
+{
+  uint32_t frequency = avr->frequency;
+  if (g_simThreaded) {
+    pthread_mutex_lock(&g_simClkMutex);
+    frequency = g_simClkShared.frequency;
+    pthread_mutex_unlock(&g_simClkMutex);
+  }
+  return (avr_cycle_count_t)frequency * usec / 1000000;
+}
 
-  avr_connect_irq(bench_irqs + IRQ_CE,
-                  avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0));
-  avr_connect_irq(bench_irqs + IRQ_CLK,
-                  avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2));
+/* Sleep callbacks.  Whenever the AVR is sleeping, `simavr` advances
+   the cycle count straight to the next pending cycle timer, which is
+   either the next peripheral event (i.e. a Timer0 overflow) or the
+   end of the current test bench wait.  So long idle stretches cost
+   one iteration per event rather than one per cycle.
+
+   In virtual time mode, there is nothing else to do.  In real time
+   mode, we sleep the host until the wall clock catches up with the
+   simulated wake-up time.  If the simulation has fallen behind, we
+   return immediately so that it can catch up.
+
+   `simavr` calls the sleep callback once per cycle timer that expires
+   while the AVR is asleep, and most of them don't wake it up.  So we
+   only count a wakeup when the AVR ran in between sleep periods.  */
+void simSleepAccount(avr_cycle_count_t howLong)
+{
+  if (avr->cycle != g_simSleepEnd)
+    g_simWakeCount++;
+  g_simSleepCount++;
+  g_simSleepCycles += howLong;
+  g_simSleepNs += simCycleTimeNsec(avr->cycle + howLong) -
+    simCycleTimeNsec(avr->cycle);
+  g_simSleepEnd = avr->cycle + howLong;
+  g_simRes.cycles[(avr->data[0x55] >> 3) & 3][g_simClkps] += howLong; // MCUCR
+}
 
-  // Since we use open-drain signaling on sec1 and data, this a bit
-  // trickier to connect to, but this is how to do it.
-  avr_connect_irq(avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.SEC1*", 5),
-                  bench_irqs + IRQ_SEC1);
-  avr_connect_irq(bench_irqs + IRQ_DATA_IN,
-                  avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1));
-  avr_connect_irq(avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.DATA.OUT*", 1),
-                  bench_irqs + IRQ_DATA_OUT);
+void sim_sleep_virtual(avr_t *avr, avr_cycle_count_t howLong)
+{
+  simSleepAccount(howLong);
+}
 
-  // Register notify functions for inputs to test bench (outputs):
-  avr_irq_register_notify(bench_irqs + IRQ_SEC1,
-                          pin_change_notify, NULL);
-  avr_irq_register_notify(bench_irqs + IRQ_DATA_OUT,
-                          pin_change_notify, NULL);
+void sim_sleep_realtime(avr_t *avr, avr_cycle_count_t howLong)
+{
+  uint64_t wakeNs = simCycleTimeNsec(avr->cycle + howLong);
+  struct timespec tvWake;
+  simSleepAccount(howLong);
+  tvWake.tv_sec = g_simRtBase.tv_sec + wakeNs / 1000000000;
+  tvWake.tv_nsec = g_simRtBase.tv_nsec + wakeNs % 1000000000;
+  if (tvWake.tv_nsec >= 1000000000) {
+    tvWake.tv_nsec -= 1000000000;
+    tvWake.tv_sec++;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                         &tvWake, NULL) == EINTR);
+}
 
-  // Give the RTC input pins sane initial values.
-  avr_raise_irq(bench_irqs + IRQ_CE, 1);
-  avr_raise_irq(bench_irqs + IRQ_CLK, 0);
-  avr_raise_irq(bench_irqs + IRQ_DATA_IN, 0);
+// Account for the cycles run at the current clock division, i.e.
+// before switching the clock.
+void simResFlush(void)
+{
+  g_simResTotal[g_simClkps] += avr->cycle - g_simResCycle;
+  g_simResCycle = avr->cycle;
+}
 
-  // NOTE: Propagation of connected IRQs is unidirectional, so we need
-  // special handling for the bi-directional communication pin.
-  // Actually, we always need special handling due to our quirk used
-  // for open collector communication.  We always end up using two
-  // different IRQs, and we decide whether to listen or ignore outputs
-  // based off of the VIA direction register.
+// Residency most recently fetched by `simResRead()`, with the
+// running cycles filled in.
+struct SimResidency g_simResRead;
 
-  // even if not setup at startup, activate gdb if crashing
-  avr->gdb_port = 1234;
-  if (0) {
-    //avr->state = cpu_Stopped;
-    avr_gdb_init(avr);
+void simResRead(void)
+{
+  unsigned i, j;
+  simResFlush();
+  g_simResRead = g_simRes;
+  for (j = 0; j < SIM_RES_CLKPS; j++) {
+    avr_cycle_count_t asleep = 0;
+    for (i = 0; i < SIM_RES_ACTIVE; i++)
+      asleep += g_simRes.cycles[i][j];
+    g_simResRead.cycles[SIM_RES_ACTIVE][j] = g_simResTotal[j] - asleep;
   }
+}
 
-  /*
-   *    VCD file initialization
-   *    
-   *    This will allow you to create a "wave" file and display it in
-   *    gtkwave.  Use the `sim-rec`/`sim-no-rec` commands to
-   *    start/stop recording pin changes.
-   */
-  avr_vcd_init(avr, "gtkwave_trace.vcd", &vcd_file, 10000 /* usec */);
+void simResDiff(struct SimResidency *diff, const struct SimResidency *end,
+                const struct SimResidency *start)
+{
+  unsigned i, j;
+  for (i = 0; i < SIM_RES_STATES; i++) {
+    for (j = 0; j < SIM_RES_CLKPS; j++)
+      diff->cycles[i][j] = end->cycles[i][j] - start->cycles[i][j];
+  }
+}
 
-  // ATTiny85 PINB == 0x16
-  // ATTiny85 DDRB == 0x17
-  // ATTiny85 PORTB == 0x18
+/* Supply current model for the residency report, linear in the
+   system clock frequency.  The figures are the ATtiny25/45/85
+   datasheet's typical supply currents at 4 MHz and VCC = 3 V, and the
+   power-down current with the watchdog disabled.  Peripherals that
+   are left running, like Timer1, aren't accounted for.  Good for
+   comparing builds, not a substitute for measuring a real part.  */
+struct SimCurrentModel {
+  const char *name;
+  double maPerMhz;
+  double ma;
+};
 
-  avr_vcd_add_signal(&vcd_file,
-    avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0),
-    1  /* bits */,
-    "RTC.CE*" );
-  avr_vcd_add_signal(&vcd_file,
-    avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2),
-    1  /* bits */,
-    "RTC.CLK" );
+static const struct SimCurrentModel simCurrentModel[SIM_RES_STATES] = {
+  { "idle", 0.0625, 0 },
+  { "ADC noise reduction", 0.0625, 0 }, // no better figure than idle
+  { "power-down", 0, 0.0001 },
+  { "reserved sleep mode", 0, 0.0001 },
+  { "active", 0.37, 0 },
+};
 
-  // Since we use open-drain signaling on sec1 and data, this a bit
-  // trickier to monitor, but this is how to do it.
-  avr_irq_t *rtc_sec1_irq =
-    avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.SEC1*", 5);
-  avr_vcd_add_signal(&vcd_file, rtc_sec1_irq, 1  /* bits */,
-    "RTC.SEC1*" );
-  avr_vcd_add_signal(&vcd_file,
-    avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1),
-    1  /* bits */,
-    "RTC.DATA.IN" );
-  avr_irq_t *rtc_data_out_irq =
-    avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.DATA.OUT*", 1);
-  // Let's just process inverted data for now.
-  /* uint8_t flags = avr_irq_get_flags(rtc_data_out_irq);
-  flags |= IRQ_FLAG_NOT;
-  avr_irq_set_flags(rtc_data_out_irq, flags); */
-  avr_vcd_add_signal(&vcd_file, rtc_data_out_irq, 1  /* bits */,
-    "RTC.DATA.OUT*" );
+// Print the time spent in each power state and the estimated average
+// supply current.
+void simResReport(const struct SimResidency *res)
+{
+  double stateSecs[SIM_RES_STATES], stateMas[SIM_RES_STATES];
+  double totalSecs = 0, totalMas = 0;
+  unsigned i, j;
+  for (i = 0; i < SIM_RES_STATES; i++) {
+    const struct SimCurrentModel *m = &simCurrentModel[i];
+    stateSecs[i] = 0;
+    stateMas[i] = 0;
+    for (j = 0; j < SIM_RES_CLKPS; j++) {
+      double hz = g_simClkRefFreq >> j;
+      double secs = res->cycles[i][j] / hz;
+      stateSecs[i] += secs;
+      stateMas[i] += secs * (m->maPerMhz * hz / 1e6 + m->ma);
+    }
+    totalSecs += stateSecs[i];
+    totalMas += stateMas[i];
+  }
+  if (totalSecs == 0)
+    return;
+  for (i = 0; i < SIM_RES_STATES; i++) {
+    if (stateSecs[i] == 0)
+      continue;
+    printf("  %s: %.3f s (%.2f%%), %.2f uA of the average\n",
+           simCurrentModel[i].name, stateSecs[i],
+           stateSecs[i] * 100 / totalSecs, stateMas[i] * 1000 / totalSecs);
+  }
+  printf("  estimated average supply current at 3 V: %.2f uA\n",
+         totalMas * 1000 / totalSecs);
+}
 
-  // TIMER0_OVF == 5
-  avr_vcd_add_signal(&vcd_file,
-                     avr_get_interrupt_irq(avr, 5),
-                     1  /* bits */ ,
-                     "TIMER0_OVF" );
+/* Run the simulation uninterrupted until the given cycle count is
+   reached.  If `stopOnOutput` is true, also return early as soon as
+   the RTC changes one of its output pins.  Return true if the
+   simulation should continue, false if it should stop.  */
+bool8_t simRunUntil(avr_cycle_count_t target, bool8_t stopOnOutput)
+{
+  g_simOutEvent = false;
+  while (avr->cycle < target) {
+    avr->run(avr);
+    if (avr->state == cpu_Done || avr->state == cpu_Crashed)
+      return false;
+    if (stopOnOutput && g_simOutEvent)
+      break;
+  }
+  return true;
+}
 
-  // printf("Starting VCD trace\n");
-  // avr_vcd_start(&vcd_file);
+/* Test bench event queue.  Rather than stepping the simulator in
+   between each VIA pin change, the PRAM library queues a batch of
+   pin changes and samples as timestamped events, then the simulator
+   runs uninterrupted through the whole batch.  Events are delivered
+   by a `simavr` cycle timer, so a sleeping AVR is woken exactly on
+   time.  */
+
+enum BenchEventType { BEV_WRITE, BEV_SAMPLE };
+
+struct BenchEvent {
+  avr_cycle_count_t when;
+  uint8_t type;
+  uint8_t reg; // VIA register offset
+  uint8_t bit;
+  uint8_t value;
+};
 
-  if (interactMode) {
-    // Configure non-blocking mode on standard input so that the
-    // simulator can still run when we're waiting for user input.
-    int fflags = fcntl(STDIN_FILENO, F_GETFL);
-    int result;
-    if (fflags == -1) {
-      perror("error getting stdin flags");
-      return 1;
-    }
-    fflags |= O_NONBLOCK;
-    result = fcntl(STDIN_FILENO, F_SETFL, fflags);
-    if (result == -1) {
-      perror("error setting stdin flags");
-      return 1;
+#define BENCH_EVQ_SIZE 64
+
+struct BenchEvent g_benchEvq[BENCH_EVQ_SIZE];
+uint8_t g_benchEvqHead = 0;
+uint8_t g_benchEvqLen = 0;
+// True while a batch is being queued.
+bool8_t g_simBatch = false;
+// Timestamp of the end of the batch queued so far.
+avr_cycle_count_t g_simBatchCycle;
+// Bits sampled during the batch, most recent sample in the LSB.
+uint32_t g_simBatchSamples;
+
+avr_cycle_count_t bench_event_timer(avr_t *avr, avr_cycle_count_t when,
+                                    void *param)
+{
+  while (g_benchEvqLen > 0 &&
+         g_benchEvq[g_benchEvqHead].when <= avr->cycle) {
+    struct BenchEvent *ev = &g_benchEvq[g_benchEvqHead];
+    g_benchEvqHead = (g_benchEvqHead + 1) % BENCH_EVQ_SIZE;
+    g_benchEvqLen--;
+    if (ev->type == BEV_WRITE)
+      viaBitWriteNow(vBase + ev->reg, ev->bit, ev->value);
+    else {
+      uint8_t value = viaBitRead(vBase + ev->reg, ev->bit);
+      if (g_simThreaded) {
+        struct SimMsg msg = { avr->cycle, SIMMSG_SAMPLE, 0, 0, value };
+        simThreadReply(&msg);
+      } else
+        g_simBatchSamples = (g_simBatchSamples << 1) | value;
     }
   }
+  if (g_benchEvqLen > 0)
+    return g_benchEvq[g_benchEvqHead].when;
+  return 0;
+}
 
-  fputs( "\nSimulation launching:\n", stdout);
+/* Add an event to the queue.  The caller must make sure that there
+   is room.  Only called on the thread that runs the simulator.  */
+void benchEvqPush(avr_cycle_count_t when, uint8_t type, uint8_t reg,
+                  uint8_t bit, uint8_t value)
+{
+  struct BenchEvent *ev =
+    &g_benchEvq[(g_benchEvqHead + g_benchEvqLen) % BENCH_EVQ_SIZE];
+  ev->when = when;
+  ev->type = type;
+  ev->reg = reg;
+  ev->bit = bit;
+  ev->value = value;
+  if (g_benchEvqLen++ == 0) {
+    avr_cycle_count_t delay = (ev->when > avr->cycle) ?
+      ev->when - avr->cycle : 0;
+    avr_cycle_timer_register(avr, delay, bench_event_timer, NULL);
+  }
+}
 
-  return 0;
+// Append an event at the current batch time.
+void simQueueEvent(uint8_t type, uint8_t *ptr, uint8_t bit, uint8_t value)
+{
+  if (g_simThreaded) {
+    struct SimMsg msg = { g_simBatchCycle,
+                          (type == BEV_WRITE) ? SIMMSG_VIA_WRITE :
+                          SIMMSG_VIA_SAMPLE,
+                          ptr - vBase, bit, value };
+    simThreadSend(&msg);
+    return;
+  }
+  if (g_benchEvqLen >= BENCH_EVQ_SIZE) {
+    // Queue is full, run until the oldest event has been delivered.
+    while (g_benchEvqLen >= BENCH_EVQ_SIZE) {
+      if (!simAvrStep())
+        return;
+    }
+  }
+  benchEvqPush(g_simBatchCycle, type, ptr - vBase, bit, value);
 }
 
-// Run a single step of the AVR simulation, return true if the
-// simulation should continue, false if it should stop.
-bool8_t simAvrStep(void)
+/* If a batch is being queued, queue the VIA write and return true.
+   When the simulator runs on its own thread, always queue the write,
+   outside of a batch it takes place at the test bench's current
+   time.  Otherwise return false.  */
+bool8_t simQueueViaWrite(uint8_t *ptr, uint8_t bit, uint8_t bitvalue)
 {
-  // Simulation main loop.
-  int state = avr_run(avr);
-  if ((state == cpu_Done) || (state == cpu_Crashed))
-    return false;
+  if (!g_simBatch) {
+    if (!g_simThreaded)
+      return false;
+    g_simBatchCycle = simBenchCycle();
+  }
+  simQueueEvent(BEV_WRITE, ptr, bit, bitvalue);
   return true;
+}
 
-  // NOTE: In the main loop, if we're using multiple threads and
-  // message passing, we can check if we should send an I/O
-  // peripheral IRQ message.
+// If a batch is being queued, queue a sample of the VIA bit and
+// return true.  Otherwise return false.
+bool8_t simQueueViaSample(uint8_t *ptr, uint8_t bit)
+{
+  if (!g_simBatch)
+    return false;
+  simQueueEvent(BEV_SAMPLE, ptr, bit, 0);
+  return true;
 }
 
-/********************************************************************/
-/* Automated test suite module */
+/* Start queuing a batch of test bench events.  Return true if a new
+   batch was started, false if a batch is already being queued or if
+   we are not running under simulation.  */
+bool8_t simBatchBegin(void)
+{
+  if (g_phyMode || g_simBatch)
+    return false;
+  g_simBatch = true;
+  g_simBatchCycle = simBenchCycle();
+  g_simBatchSamples = 0;
+  return true;
+}
 
-/*
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
+/* Run the simulation through the end of the queued batch and return
+   the sampled bits, the last sample in the LSB.  */
+uint32_t simBatchEnd(void)
+{
+  avr_cycle_count_t target = g_simBatchCycle;
+  if (g_simThreaded) {
+    simThreadRequest(SIMMSG_RUN_UNTIL, target, NULL);
+    g_simBatch = false;
+    return g_simBatchSamples;
+  }
+  while (g_benchEvqLen > 0 || avr->cycle < target) {
+    if (!simRunUntil((avr->cycle < target) ? target : avr->cycle + 1,
+                     false))
+      break;
+  }
+  g_simBatch = false;
+  return g_simBatchSamples;
+}
 
-#include "arduino_sdef.h"
-#include "via-emu.h"
-#include "pram-lib.h"
-#include "a2mon-pram.h"
-*/
+/* Run the simulation for the given number of microseconds of
+   simulated time.  A cycle timer is registered at the target so that
+   a sleeping AVR is woken exactly when the wait is over rather than
+   at its next timer overflow.  If a batch is being queued, just
+   advance the batch time instead.  */
+void simWaitUsec(uint32_t usec)
+{
+  avr_cycle_count_t numCycles = simUsecToCycles(usec);
+  avr_cycle_count_t target;
+  if (g_simBatch) {
+    g_simBatchCycle += numCycles;
+    return;
+  }
+  if (g_simThreaded) {
+    simThreadRequest(SIMMSG_RUN_UNTIL, simBenchCycle() + numCycles, NULL);
+    return;
+  }
+  target = avr->cycle + numCycles;
+  avr_cycle_timer_register(avr, numCycles, notify_timeup, NULL);
+  simRunUntil(target, false);
+  avr_cycle_timer_cancel(avr, notify_timeup, NULL);
+}
 
-bool8_t g_suiteActive = false;
-struct timespec g_tsStartTm;
-uint8_t g_passCount;
-uint8_t g_failCount;
-uint8_t g_skipCount;
+/* Simulator thread support.  The functions below are used from the
+   test bench thread, except for `simThreadReply()` and
+   `simThreadMain()` which run on the simulator thread.  */
 
-// Print the elapsed time in the test suite.
-void prTestTime(void)
+// Send a message to the simulator thread, waiting for room in the
+// ring if necessary.
+void simThreadSend(const struct SimMsg *msg)
 {
-  struct timespec tv, tvDiff;
-  clock_gettime(CLOCK_MONOTONIC, &tv);
-  tvDiff.tv_sec = tv.tv_sec - g_tsStartTm.tv_sec;
-  tvDiff.tv_nsec = tv.tv_nsec - g_tsStartTm.tv_nsec;
-  if (tvDiff.tv_nsec < 0) {
-    tvDiff.tv_sec--;
-    tvDiff.tv_nsec += 1000000000;
+  unsigned spins = 0;
+  while (!simRingPush(&g_benchToSim, msg)) {
+    // Keep draining replies so that the simulator thread can't be
+    // blocked on us while we're blocked on it.
+    simThreadPoll();
+    simBackoff(&spins);
   }
-  printf("[ %3d.%09d ] ", tvDiff.tv_sec, tvDiff.tv_nsec);
 }
 
-void prTsStat(const char *status)
+/* Process all pending messages from the simulator thread.  Return
+   false if the simulation has stopped.  */
+bool8_t simThreadPoll(void)
 {
-  prTestTime();
-  fputs(status, stdout);
+  struct SimMsg msg;
+  while (simRingPop(&g_simToBench, &msg)) {
+    switch (msg.type) {
+    case SIMMSG_ACK:
+      g_simAcked = true;
+      break;
+    case SIMMSG_SAMPLE:
+      g_simBatchSamples = (g_simBatchSamples << 1) | msg.value;
+      break;
+    case SIMMSG_SEC1:
+      sec1Isr();
+      break;
+    case SIMMSG_STOPPED:
+      g_simStopped = true;
+      break;
+    }
+  }
+  return !g_simStopped;
 }
 
-void recTsResult(bool8_t result, const char *desc)
+/* Send a request to the simulator thread and wait until it has been
+   acknowledged.  Return false if the simulation has stopped.  */
+bool8_t simThreadRequest(uint8_t type, avr_cycle_count_t when,
+                         void (*fn)(void))
 {
-  prTsStat((result) ? "PASS:" : "FAIL:");
-  fputs(desc, stdout);
-  putchar('\n');
-  if (result)
-    g_passCount++;
-  else
-    g_failCount++;
+  struct SimMsg msg = { when, type, 0, 0, 0, fn };
+  unsigned spins = 0;
+  g_simAcked = false;
+  simThreadSend(&msg);
+  while (simThreadPoll() && !g_simAcked)
+    simBackoff(&spins);
+  return !g_simStopped;
 }
 
-void recTsSkip(const char *desc)
+/* Call the given function on the thread that runs the simulator, for
+   commands that touch `simavr` state directly.  */
+void simCall(void (*fn)(void))
 {
-  prTsStat("SKIP:");
-  fputs(desc, stdout);
-  putchar('\n');
-  g_skipCount++;
+  if (g_simThreaded)
+    simThreadRequest(SIMMSG_CALL, 0, fn);
+  else
+    fn();
 }
 
-void suiteStart(void)
+// Send a message to the test bench thread, waiting for room in the
+// ring if necessary.
+void simThreadReply(const struct SimMsg *msg)
 {
-  g_suiteActive = true;
-  clock_gettime(CLOCK_MONOTONIC, &g_tsStartTm);
-  g_passCount = 0;
-  g_failCount = 0;
-  g_skipCount = 0;
+  unsigned spins = 0;
+  while (!simRingPush(&g_simToBench, msg) &&
+         !atomic_load(&g_simThreadQuit))
+    simBackoff(&spins);
 }
 
-bool8_t suiteEnd(void)
+// Keep a free-running real-time simulation responsive to the test
+// bench by bounding how long the AVR can sleep in one go.
+avr_cycle_count_t sim_poll_timer(avr_t *avr, avr_cycle_count_t when,
+                                 void *param)
 {
-  putchar('\n'); prTsStat("INFO:");
-  printf("%d passed, %d failed, %d skipped\n",
-         g_passCount, g_failCount, g_skipCount);
-  g_suiteActive = false;
-  return (g_failCount == 0);
+  return when + g_simPollCycles;
+}
+
+void *simThreadMain(void *arg)
+{
+  /* In virtual time mode, the simulation only runs as far as the test
+     bench has asked it to, so that bench events are never late.  In
+     real time mode, the simulation runs freely and is paced by the
+     sleep callback.  */
+  avr_cycle_count_t runLimit = g_simVirtTime ? avr->cycle : ~0ULL;
+  avr_cycle_count_t ackCycle = 0;
+  bool8_t ackPending = false;
+  bool8_t running = true;
+  unsigned spins = 0;
+  if (!g_simVirtTime)
+    avr_cycle_timer_register(avr, g_simPollCycles, sim_poll_timer, NULL);
+
+  while (running && !atomic_load(&g_simThreadQuit)) {
+    struct SimMsg msg;
+    bool8_t gotMsg = false;
+    // Pull in requests from the test bench as long as there is room
+    // in the event queue.
+    while (!ackPending && g_benchEvqLen < BENCH_EVQ_SIZE &&
+           simRingPop(&g_benchToSim, &msg)) {
+      gotMsg = true;
+      switch (msg.type) {
+      case SIMMSG_VIA_WRITE:
+      case SIMMSG_VIA_SAMPLE:
+        benchEvqPush(msg.when, (msg.type == SIMMSG_VIA_WRITE) ?
+                     BEV_WRITE : BEV_SAMPLE, msg.reg, msg.bit, msg.value);
+        if (g_simVirtTime && msg.when > runLimit)
+          runLimit = msg.when;
+        break;
+      case SIMMSG_RUN_UNTIL:
+        ackCycle = msg.when;
+        ackPending = true;
+        if (g_simVirtTime && msg.when > runLimit) {
+          runLimit = msg.when;
+          // Wake a sleeping AVR exactly on time.
+          avr_cycle_timer_register(avr, runLimit - avr->cycle,
+                                   notify_timeup, NULL);
+        }
+        break;
+      case SIMMSG_CALL:
+        msg.fn();
+        // The call may have restored a snapshot, which moves the cycle
+        // count.
+        if (g_simVirtTime)
+          runLimit = avr->cycle;
+        atomic_store(&g_simCycleNow, avr->cycle);
+        msg.type = SIMMSG_ACK;
+        simThreadReply(&msg);
+        break;
+      }
+    }
+
+    if (avr->cycle < runLimit || g_benchEvqLen > 0) {
+      avr_cycle_count_t target = runLimit;
+      if (!g_simVirtTime)
+        target = avr->cycle + g_simPollCycles;
+      else if (avr->cycle >= runLimit)
+        target = avr->cycle + 1; // Deliver events at the current cycle.
+      running = simRunUntil(target, false);
+      atomic_store(&g_simCycleNow, avr->cycle);
+      spins = 0;
+    } else if (!gotMsg)
+      simBackoff(&spins); // Idle until the bench asks for more time.
+
+    if (ackPending && avr->cycle >= ackCycle && g_benchEvqLen == 0) {
+      msg.when = avr->cycle;
+      msg.type = SIMMSG_ACK;
+      simThreadReply(&msg);
+      ackPending = false;
+    }
+  }
+
+  if (!running) {
+    struct SimMsg msg = { avr->cycle, SIMMSG_STOPPED };
+    simThreadReply(&msg);
+  }
+  return NULL;
+}
+
+// Start running the simulation on its own thread.  Return true on
+// success.
+bool8_t simThreadStart(void)
+{
+  g_simPollCycles = avr_usec_to_cycles(avr, 1000);
+  g_simLeadCycles = 2 * g_simPollCycles;
+  atomic_store(&g_simThreadQuit, false);
+  simClkPublish();
+  if (pthread_create(&g_simThread, NULL, simThreadMain, NULL) != 0) {
+    g_simThreaded = false;
+    return false;
+  }
+  return true;
+}
+
+// Stop the simulator thread and wait for it to exit.
+void simThreadStop(void)
+{
+  if (!g_simThreaded)
+    return;
+  atomic_store(&g_simThreadQuit, true);
+  pthread_join(g_simThread, NULL);
+  g_simThreaded = false;
+}
+
+// Start recording VCD signal waveforms for RTC pins.  Only applicable
+// when running under simulation.
+void simRec(void)
+{
+    printf("Starting VCD trace\n");
+    avr_vcd_start(&vcd_file);
+}
+
+// Stop recording VCD signal waveforms for RTC pins.  Only applicable
+// when running under simulation.
+void simNoRec(void)
+{
+    printf("Stopping VCD trace\n");
+    avr_vcd_stop(&vcd_file);
+}
+
+// Print simulated time and AVR sleep statistics.  Only applicable
+// when running under simulation.
+void simStats(void)
+{
+  uint64_t simNs = simTimeNsec();
+  printf("simulated time: %d.%09d s, %llu cycles at %d Hz\n",
+         (int)(simNs / 1000000000), (int)(simNs % 1000000000),
+         (unsigned long long)avr->cycle, (int)avr->frequency);
+  printf("sleep periods: %lu, cycles skipped while sleeping: %llu\n",
+         g_simSleepCount, (unsigned long long)g_simSleepCycles);
+  printf("wakeups: %lu, time awake: %.6f s\n", g_simWakeCount,
+         (simNs - g_simSleepNs) / 1e9);
+  simResRead();
+  printf("power state residency:\n");
+  simResReport(&g_simResRead);
+  if (g_simTlMode)
+    printf("transaction-level: %lu transactions, %lu cross-checked, "
+           "%lu mismatches\n", g_simTlCount, g_simTlChecked,
+           g_simTlMismatches);
+}
+
+void simLatResync(void);
+
+/* Simulation snapshots.  A snapshot captures the AVR's memory,
+   registers, EEPROM, and peripheral state together with the test
+   bench state, so that a test can start from a prepared image rather
+   than booting the firmware and loading PRAM over the slow serial
+   protocol.
+
+   `simavr` doesn't give us direct access to its peripheral state, so
+   a snapshot can only be taken at a quiescent point: the AVR is
+   asleep with no interrupt pending and no test bench events are in
+   flight, which is the case in between commands.  On restore, we
+   reset the AVR and replay the saved I/O register values through
+   `simavr`'s register write handlers, which rebuilds the timer and
+   pin change state.  The Timer0 prescaler phase isn't preserved, so
+   restored timing is only accurate to within one prescaler period.  */
+
+#define SIM_SNAP_MAGIC 0x50414e53 // "SNAP"
+#define SIM_SNAP_VERSION 2
+#define SIM_SNAP_MAX_DATA 1024
+#define SIM_SNAP_MAX_EEPROM 1024
+
+struct SimSnapshot {
+  uint32_t magic;
+  uint32_t version;
+  char mmcu[16];
+  uint32_t frequency;
+  uint32_t dataSize;
+  uint32_t eepromSize;
+  avr_cycle_count_t cycle;
+  uint32_t pc;
+  // System clock prescaler emulation.
+  uint32_t clkps;
+  avr_cycle_count_t clkBaseCycle;
+  uint64_t clkBaseNs;
+  uint8_t data[SIM_SNAP_MAX_DATA];
+  uint8_t eeprom[SIM_SNAP_MAX_EEPROM];
+  uint8_t benchIrqs[IRQ_DATA_OUT];
+  // Test bench state.
+  uint8_t vBase[4];
+  uint32_t timeSecs;
+  uint8_t writeProtect;
+  uint8_t pram[256];
+  uint32_t secondsShadow;
+  uint8_t shadowBytes;
+  uint32_t secondsLatch;
+  uint8_t latchBytes;
+  uint8_t latchAge;
+};
+
+/* ATtiny85 I/O registers that need special handling, as data
+   addresses.  Registers in `simSnapReplay` are restored through their
+   write handlers in the listed order.  Interrupt flag registers are
+   write-one-to-clear, so they are copied verbatim once everything
+   else has been restored.  Registers in `simSnapSkip` have side
+   effects on write and are left at their reset values.  All other
+   registers are copied verbatim.  */
+static const uint16_t simSnapReplay[] = {
+  0x37, // DDRB
+  0x38, // PORTB
+  0x55, // MCUCR
+  0x35, // PCMSK
+  0x5b, // GIMSK
+  0x4c, // GTCCR
+  0x4a, // TCCR0A
+  0x49, // OCR0A
+  0x48, // OCR0B
+  0x59, // TIMSK
+  0x53, // TCCR0B
+  0x52, // TCNT0, must come after the clock select in TCCR0B
+  0x4d, // OCR1C
+  0x4e, // OCR1A
+  0x4b, // OCR1B
+  0x50, // TCCR1
+  0x4f, // TCNT1, must come after the clock select in TCCR1
+};
+static const uint16_t simSnapFlags[] = {
+  0x58, // TIFR
+  0x5a, // GIFR
+};
+static const uint16_t simSnapSkip[] = {
+  0x36, // PINB, writes toggle PORTB
+  0x3c, // EECR, writes start EEPROM operations
+  0x41, // WDTCR, timed write sequence
+  0x46, // CLKPR, timed write sequence, restored with our emulation
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+bool8_t simSnapInList(const uint16_t *list, unsigned len, uint16_t addr)
+{
+  unsigned i;
+  for (i = 0; i < len; i++) {
+    if (list[i] == addr)
+      return true;
+  }
+  return false;
+}
+
+// Return true if the simulation is at a quiescent point.
+bool8_t simQuiescent(void)
+{
+  return (avr->state == cpu_Sleeping && !avr_has_pending_interrupt(avr) &&
+          g_benchEvqLen == 0);
+}
+
+/* If the AVR is still busy, for example booting or servicing an
+   interrupt, give it up to 100 ms of simulated time to go back to
+   sleep.  Return true if the simulation is at a quiescent point.
+   Only call this on the thread that runs the simulator.  */
+bool8_t simSettle(void)
+{
+  avr_cycle_count_t limit = avr->cycle + avr_usec_to_cycles(avr, 100000);
+  while (!simQuiescent() && g_benchEvqLen == 0 && avr->cycle < limit) {
+    avr->run(avr);
+    if (avr->state == cpu_Done || avr->state == cpu_Crashed)
+      return false;
+  }
+  return simQuiescent();
+}
+
+/* Take a snapshot of the current simulation state.  Return false if
+   the simulation is not at a quiescent point.  Only call this on the
+   thread that runs the simulator.  */
+bool8_t simSnapTake(struct SimSnapshot *snap)
+{
+  avr_eeprom_desc_t ee;
+  unsigned i;
+  if (!simSettle() ||
+      avr->ramend + 1 > SIM_SNAP_MAX_DATA ||
+      avr->e2end + 1 > SIM_SNAP_MAX_EEPROM)
+    return false;
+  memset(snap, 0, sizeof(*snap));
+  snap->magic = SIM_SNAP_MAGIC;
+  snap->version = SIM_SNAP_VERSION;
+  strncpy(snap->mmcu, avr->mmcu, sizeof(snap->mmcu) - 1);
+  snap->frequency = g_simClkRefFreq;
+  snap->dataSize = avr->ramend + 1;
+  snap->eepromSize = avr->e2end + 1;
+  snap->cycle = avr->cycle;
+  snap->pc = avr->pc;
+  snap->clkps = g_simClkps;
+  snap->clkBaseCycle = g_simClkBaseCycle;
+  snap->clkBaseNs = g_simClkBaseNs;
+  memcpy(snap->data, avr->data, snap->dataSize);
+  // Some registers, like TCNT0, are only brought up to date when they
+  // are read.
+  for (i = 0; i < ARRAY_SIZE(simSnapReplay); i++) {
+    uint16_t addr = simSnapReplay[i];
+    avr_io_addr_t io = AVR_DATA_TO_IO(addr);
+    if (avr->io[io].r.c)
+      snap->data[addr] = avr->io[io].r.c(avr, addr, avr->io[io].r.param);
+  }
+  ee.ee = snap->eeprom;
+  ee.offset = 0;
+  ee.size = snap->eepromSize;
+  avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+  for (i = 0; i < IRQ_DATA_OUT; i++)
+    snap->benchIrqs[i] = bench_irqs[i].value;
+  memcpy(snap->vBase, vBase, 4);
+  pthread_mutex_lock(&timeSecsMutex);
+  snap->timeSecs = timeSecs;
+  pthread_mutex_unlock(&timeSecsMutex);
+  snap->writeProtect = writeProtect;
+  memcpy(snap->pram, hostPram, 256);
+  snap->secondsShadow = secondsShadow;
+  snap->shadowBytes = shadowBytes;
+  snap->secondsLatch = secondsLatch;
+  snap->latchBytes = latchBytes;
+  snap->latchAge = latchAge;
+  return true;
+}
+
+/* Restore the simulation state from a snapshot.  Return false if the
+   snapshot doesn't match the simulated AVR.  Only call this on the
+   thread that runs the simulator.  */
+bool8_t simSnapRestore(const struct SimSnapshot *snap)
+{
+  avr_eeprom_desc_t ee;
+  uint16_t addr;
+  unsigned i;
+  if (snap->magic != SIM_SNAP_MAGIC ||
+      snap->version != SIM_SNAP_VERSION ||
+      strncmp(snap->mmcu, avr->mmcu, sizeof(snap->mmcu) - 1) != 0 ||
+      snap->frequency != g_simClkRefFreq ||
+      snap->dataSize != avr->ramend + 1 ||
+      snap->eepromSize != avr->e2end + 1)
+    return false;
+
+  g_simRestoring = true;
+  simResFlush();
+  avr_reset(avr);
+  g_benchEvqHead = 0;
+  g_benchEvqLen = 0;
+  avr->cycle = snap->cycle;
+  avr->pc = snap->pc;
+  avr->state = cpu_Sleeping;
+  g_simClkps = snap->clkps;
+  g_simClkBaseCycle = snap->clkBaseCycle;
+  g_simClkBaseNs = snap->clkBaseNs;
+  g_simClkpceArmed = false;
+  avr->frequency = g_simClkRefFreq >> g_simClkps;
+  avr->data[0x46] = g_simClkps; // CLKPR
+  simClkPublish();
+
+  // Drive the RTC input pins first, while the pin change interrupts
+  // are still disabled.
+  for (i = IRQ_CE; i < IRQ_DATA_OUT; i++)
+    avr_raise_irq(bench_irqs + i, snap->benchIrqs[i]);
+
+  // Registers, I/O registers without side effects, and SRAM.
+  for (addr = 0; addr < snap->dataSize; addr++) {
+    if (addr >= 0x20 && addr <= avr->ioend &&
+        (simSnapInList(simSnapReplay, ARRAY_SIZE(simSnapReplay), addr) ||
+         simSnapInList(simSnapFlags, ARRAY_SIZE(simSnapFlags), addr) ||
+         simSnapInList(simSnapSkip, ARRAY_SIZE(simSnapSkip), addr)))
+      continue;
+    avr->data[addr] = snap->data[addr];
+  }
+  for (i = 0; i < 8; i++)
+    avr->sreg[i] = (snap->data[0x5f] >> i) & 1; // SREG
+
+  // Peripheral registers, through their write handlers.
+  for (i = 0; i < ARRAY_SIZE(simSnapReplay); i++) {
+    avr_io_addr_t io;
+    addr = simSnapReplay[i];
+    io = AVR_DATA_TO_IO(addr);
+    if (avr->io[io].w.c)
+      avr->io[io].w.c(avr, addr, snap->data[addr], avr->io[io].w.param);
+    else
+      avr->data[addr] = snap->data[addr];
+  }
+
+  // Nothing was pending when the snapshot was taken, so discard
+  // anything raised while replaying, then restore the flags exactly.
+  avr_interrupt_reset(avr);
+  for (i = 0; i < ARRAY_SIZE(simSnapFlags); i++)
+    avr->data[simSnapFlags[i]] = snap->data[simSnapFlags[i]];
+
+  ee.ee = (uint8_t *)snap->eeprom;
+  ee.offset = 0;
+  ee.size = snap->eepromSize;
+  avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+  /* `simavr` writes the EEPROM right away and only delays the ready
+     interrupt, which the reset cancelled, so an EEPROM write that
+     was in progress is done.  */
+  if (g_simPersist.valid)
+    avr->data[g_simPersist.busyAddr] = 0;
+
+  memcpy(vBase, snap->vBase, 4);
+  pthread_mutex_lock(&timeSecsMutex);
+  timeSecs = snap->timeSecs;
+  pthread_mutex_unlock(&timeSecsMutex);
+  writeProtect = snap->writeProtect;
+  memcpy(hostPram, snap->pram, 256);
+  secondsShadow = snap->secondsShadow;
+  shadowBytes = snap->shadowBytes;
+  secondsLatch = snap->secondsLatch;
+  latchBytes = snap->latchBytes;
+  latchAge = snap->latchAge;
+  g_simRestoring = false;
+  g_simResCycle = avr->cycle;
+  simLatResync();
+
+  // Resetting the AVR cancelled our own cycle timers too.
+  if (g_simThreaded && !g_simVirtTime)
+    avr_cycle_timer_register(avr, g_simPollCycles, sim_poll_timer, NULL);
+  // Keep real-time pacing continuous across the jump in simulated
+  // time.
+  if (!g_simVirtTime) {
+    uint64_t simNs = simCycleTimeNsec(avr->cycle);
+    clock_gettime(CLOCK_MONOTONIC, &g_simRtBase);
+    g_simRtBase.tv_sec -= simNs / 1000000000;
+    g_simRtBase.tv_nsec -= simNs % 1000000000;
+    if (g_simRtBase.tv_nsec < 0) {
+      g_simRtBase.tv_nsec += 1000000000;
+      g_simRtBase.tv_sec--;
+    }
+  }
+  return true;
+}
+
+// In-memory snapshot used by the `sim-snapshot` and `sim-restore`
+// commands, and the snapshot being worked on by `simSnapCall()`.
+struct SimSnapshot g_simSnap;
+bool8_t g_simSnapValid = false;
+struct SimSnapshot *g_simSnapArg;
+bool8_t g_simSnapResult;
+
+void simSnapTakeCall(void)
+{
+  g_simSnapResult = simSnapTake(g_simSnapArg);
+}
+
+void simSnapRestoreCall(void)
+{
+  g_simSnapResult = simSnapRestore(g_simSnapArg);
+}
+
+/* Take (`restore` false) or restore (`restore` true) a snapshot on
+   the thread that runs the simulator.  Return true on success.  */
+bool8_t simSnapCall(struct SimSnapshot *snap, bool8_t restore)
+{
+  g_simSnapArg = snap;
+  g_simSnapResult = false;
+  simCall(restore ? simSnapRestoreCall : simSnapTakeCall);
+  return g_simSnapResult;
+}
+
+// Take an in-memory snapshot.  Return true on success.
+bool8_t simSnapshot(void)
+{
+  g_simSnapValid = simSnapCall(&g_simSnap, false);
+  return g_simSnapValid;
+}
+
+// Restore the in-memory snapshot.  Return true on success.
+bool8_t simRestore(void)
+{
+  if (!g_simSnapValid)
+    return false;
+  return simSnapCall(&g_simSnap, true);
+}
+
+// Take a snapshot and save it to a file.  Returns true on success,
+// false on failure.
+bool8_t fileSimSnapshot(const char *filename)
+{
+  struct SimSnapshot *snap = (struct SimSnapshot *)
+    malloc(sizeof(struct SimSnapshot));
+  bool8_t result = false;
+  FILE *fp;
+  if (snap == NULL)
+    return false;
+  if (simSnapCall(snap, false)) {
+    fp = fopen(filename, "wb");
+    if (fp != NULL) {
+      result = (fwrite(snap, sizeof(*snap), 1, fp) == 1);
+      if (fclose(fp) == EOF)
+        result = false;
+    }
+  }
+  free(snap);
+  return result;
+}
+
+// Restore a snapshot from a file.  Returns true on success, false on
+// failure.
+bool8_t fileSimRestore(const char *filename)
+{
+  struct SimSnapshot *snap = (struct SimSnapshot *)
+    malloc(sizeof(struct SimSnapshot));
+  bool8_t result = false;
+  FILE *fp;
+  if (snap == NULL)
+    return false;
+  fp = fopen(filename, "rb");
+  if (fp != NULL) {
+    if (fread(snap, sizeof(*snap), 1, fp) == 1)
+      result = simSnapCall(snap, true);
+    fclose(fp);
+  }
+  free(snap);
+  return result;
+}
+
+void pin_change_notify(avr_irq_t *irq, uint32_t value, void *param)
+{
+  if (g_simRestoring)
+    return;
+  g_simOutEvent = true;
+  if (irq == bench_irqs + IRQ_SEC1 && !value) {
+    g_simSec1Count++;
+    g_simSec1Ns = simCycleTimeNsec(avr->cycle);
+    if (g_simThreaded) {
+      struct SimMsg msg = { avr->cycle, SIMMSG_SEC1 };
+      simThreadReply(&msg);
+    } else
+      sec1Isr();
+  } else if (irq == bench_irqs + IRQ_DATA_OUT) {
+    // Only write the updated value to the buffer register if the VIA
+    // is in the input mode.  Also, note that the value we receive is
+    // inverted.
+    if (bitRead(vBase[vDirB], rtcData) == DIR_IN)
+      bitWrite(vBase[vBufB], rtcData, !value);
+  }
+}
+
+/* Look up a symbol in the firmware ELF file's symbol table.  On
+   success, store its value and size and return true.  Return false if
+   the file can't be read or the symbol is not found.  */
+bool8_t elfLookupSym(const char *fname, const char *symName,
+                     uint32_t *value, uint32_t *size)
+{
+  bool8_t found = false;
+  Elf *elf;
+  Elf_Scn *scn = NULL;
+  int fd;
+  if (elf_version(EV_CURRENT) == EV_NONE)
+    return false;
+  fd = open(fname, O_RDONLY);
+  if (fd == -1)
+    return false;
+  elf = elf_begin(fd, ELF_C_READ, NULL);
+  if (elf == NULL) {
+    close(fd);
+    return false;
+  }
+  while (!found && (scn = elf_nextscn(elf, scn)) != NULL) {
+    GElf_Shdr shdr;
+    Elf_Data *data;
+    unsigned i, count;
+    if (gelf_getshdr(scn, &shdr) == NULL || shdr.sh_type != SHT_SYMTAB)
+      continue;
+    data = elf_getdata(scn, NULL);
+    if (data == NULL || shdr.sh_entsize == 0)
+      continue;
+    count = shdr.sh_size / shdr.sh_entsize;
+    for (i = 0; i < count; i++) {
+      GElf_Sym sym;
+      const char *name;
+      if (gelf_getsym(data, i, &sym) == NULL)
+        continue;
+      name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+      if (name != NULL && strcmp(name, symName) == 0) {
+        if (value) *value = sym.st_value;
+        if (size) *size = sym.st_size;
+        found = true;
+        break;
+      }
+    }
+  }
+  elf_end(elf);
+  close(fd);
+  return found;
+}
+
+/* Transaction-level mode.  Rather than bit-banging every PRAM
+   transaction through the serial protocol, which takes tens of
+   milliseconds of simulated time each, read and write the firmware's
+   `seconds`, `writeProtect`, and `pram` variables directly.  Their
+   addresses are looked up in the firmware ELF file.  The effect of a
+   transaction is computed by a model of the firmware's command
+   decoder.  If the firmware has the seconds read latch and the
+   shadowed clock writes, they are modeled too, but not the restart
+   of the half-second on a clock write commit.
+
+   To keep protocol coverage, one in every `g_simTlCheck` transactions
+   still goes through the bit level, and its results are
+   cross-checked against the model.  */
+// AVR data addresses of the firmware variables, and the PRAM size.
+uint16_t g_simTlSecondsAddr;
+uint16_t g_simTlWriteProtectAddr;
+uint16_t g_simTlPramAddr;
+uint16_t g_simTlPramSize;
+// Zero if the firmware doesn't have the read latch or shadowed writes.
+uint16_t g_simTlLatchAddr;
+uint16_t g_simTlLatchBytesAddr;
+uint16_t g_simTlLatchAgeAddr;
+uint16_t g_simTlShadowAddr;
+uint16_t g_simTlShadowBytesAddr;
+
+// Flash and data share one ELF address space on the AVR, data
+// addresses are offset by this much.
+#define AVR_ELF_DATA_OFFSET 0x800000
+
+struct SimTlState {
+  uint32_t seconds;
+  uint8_t writeProtect;
+  uint8_t pram[256];
+  uint32_t secondsLatch;
+  uint8_t latchBytes;
+  uint8_t latchAge;
+  uint32_t secondsShadow;
+  uint8_t shadowBytes;
+};
+
+// Read and write a little endian 32-bit firmware variable.
+uint32_t simTlGet32(uint16_t addr)
+{
+  uint8_t *p = avr->data + addr;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void simTlSet32(uint16_t addr, uint32_t value)
+{
+  uint8_t *p = avr->data + addr;
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+  p[2] = (value >> 16) & 0xff;
+  p[3] = (value >> 24) & 0xff;
+}
+
+// Read the firmware's state.  Only call this on the thread that runs
+// the simulator.
+void simTlGetState(struct SimTlState *st)
+{
+  st->seconds = simTlGet32(g_simTlSecondsAddr);
+  st->writeProtect = avr->data[g_simTlWriteProtectAddr];
+  memcpy(st->pram, avr->data + g_simTlPramAddr, g_simTlPramSize);
+  if (g_simTlLatchAddr) {
+    st->secondsLatch = simTlGet32(g_simTlLatchAddr);
+    st->latchBytes = avr->data[g_simTlLatchBytesAddr];
+    st->latchAge = avr->data[g_simTlLatchAgeAddr];
+  }
+  if (g_simTlShadowAddr) {
+    st->secondsShadow = simTlGet32(g_simTlShadowAddr);
+    st->shadowBytes = avr->data[g_simTlShadowBytesAddr];
+  }
+}
+
+// Write the firmware's state.  Only call this on the thread that runs
+// the simulator.
+void simTlSetState(const struct SimTlState *st)
+{
+  uint16_t i;
+  simTlSet32(g_simTlSecondsAddr, st->seconds);
+  avr->data[g_simTlWriteProtectAddr] = st->writeProtect;
+  // Changed PRAM bytes need writing back to EEPROM.
+  for (i = 0; i < g_simTlPramSize; i++) {
+    if (avr->data[g_simTlPramAddr + i] != st->pram[i])
+      simPersistMarkDirty(i);
+  }
+  memcpy(avr->data + g_simTlPramAddr, st->pram, g_simTlPramSize);
+  if (g_simTlLatchAddr) {
+    simTlSet32(g_simTlLatchAddr, st->secondsLatch);
+    avr->data[g_simTlLatchBytesAddr] = st->latchBytes;
+    avr->data[g_simTlLatchAgeAddr] = st->latchAge;
+  }
+  if (g_simTlShadowAddr) {
+    simTlSet32(g_simTlShadowAddr, st->secondsShadow);
+    avr->data[g_simTlShadowBytesAddr] = st->shadowBytes;
+  }
+}
+
+// Model of the firmware's clock byte reads and writes.
+void simTlClockCmd(struct SimTlState *st, byte byteNum,
+                   bool8_t writeRequest, byte *data)
+{
+  byte shift = byteNum<<3;
+  uint32_t value;
+  byte i;
+  if (writeRequest && g_simTlShadowAddr) {
+    st->shadowBytes |= 1<<byteNum;
+    st->secondsShadow &= ~((uint32_t)0xff<<shift);
+    st->secondsShadow |= (uint32_t)*data<<shift;
+    if (byteNum == 3) {
+      for (i = 0; i < 4; i++) {
+        if ((st->shadowBytes & (1<<i))) {
+          st->seconds &= ~((uint32_t)0xff<<(i<<3));
+          st->seconds |= st->secondsShadow & ((uint32_t)0xff<<(i<<3));
+        }
+      }
+      st->shadowBytes = 0;
+      st->latchBytes = 0;
+    }
+  } else if (writeRequest) {
+    st->seconds &= ~((uint32_t)0xff<<shift);
+    st->seconds |= (uint32_t)*data<<shift;
+    st->latchBytes = 0;
+  } else {
+    value = st->seconds;
+    if (g_simTlLatchAddr && byteNum == 0) {
+      st->secondsLatch = value;
+      st->latchBytes = 0x0e;
+      st->latchAge = 0;
+    } else if (g_simTlLatchAddr && (st->latchBytes & (1<<byteNum))) {
+      value = st->secondsLatch;
+      st->latchBytes &= ~(1<<byteNum);
+    }
+    *data = (value>>shift)&0xff;
+  }
+}
+
+/* Model of the firmware's `execTradPramCmd()`.  Return false for
+   invalid commands.  */
+bool8_t simTlTradCmd(struct SimTlState *st, byte address,
+                     bool8_t writeRequest, byte *data)
+{
+  bool8_t isXPram = (g_simTlPramSize == 256);
+  byte index;
+  byte reg = tradCmdReg(address, &index);
+  if (writeRequest && st->writeProtect && reg != TRAD_WRITE_PROTECT)
+    return true;
+  switch (reg) {
+  case TRAD_CLOCK:
+    simTlClockCmd(st, index, writeRequest, data);
+    break;
+  case TRAD_GROUP2:
+  case TRAD_GROUP1:
+    if (reg == TRAD_GROUP1)
+      index += isXPram ? 0x10 : 0x00;
+    else
+      index += isXPram ? 0x08 : 0x10;
+    if (writeRequest)
+      st->pram[index] = *data;
+    else
+      *data = st->pram[index];
+    break;
+  default:
+    if (!writeRequest)
+      return false;
+    if (reg == TRAD_WRITE_PROTECT)
+      st->writeProtect = (*data & 0x80) ? 1 : 0;
+    break;
+  }
+  return true;
+}
+
+/* Model of the firmware's serial command state machine, from chip
+   enable to chip disable.  The host sends the given bytes, then if
+   `recv` is true, releases the data line for one more byte, which
+   the firmware sees as all ones.  Return the byte that the host
+   receives, which is all ones unless the firmware drives the data
+   line.  */
+byte simTlExec(struct SimTlState *st, const byte *sent, uint8_t numSent,
+               bool8_t recv)
+{
+  enum { TL_DISABLED, TL_COMMAND, TL_DATA, TL_XCMD_ADDR, TL_XCMD_DATA,
+         TL_SENDING } state = TL_COMMAND;
+  byte address = 0, serialData = 0, result = 0xff;
+  bool8_t writeRequest;
+  uint8_t i;
+  for (i = 0; i < numSent + recv; i++) {
+    byte v = (i < numSent) ? sent[i] : 0xff;
+    switch (state) {
+    case TL_COMMAND:
+      address = v;
+      writeRequest = !(address&(1<<7));
+      if (isXCmd(address))
+        state = (g_simTlPramSize == 256) ? TL_XCMD_ADDR : TL_DISABLED;
+      else if (writeRequest)
+        state = TL_DATA;
+      else if (simTlTradCmd(st, address, false, &serialData))
+        state = TL_SENDING;
+      else
+        state = TL_DISABLED;
+      break;
+    case TL_DATA:
+      serialData = v;
+      simTlTradCmd(st, address, true, &serialData);
+      state = TL_DISABLED;
+      break;
+    case TL_XCMD_ADDR:
+      writeRequest = !(address&(1<<7));
+      address = xCmdAddr(address, v);
+      if (writeRequest)
+        state = TL_XCMD_DATA;
+      else {
+        serialData = st->pram[address];
+        state = TL_SENDING;
+      }
+      break;
+    case TL_XCMD_DATA:
+      if (!st->writeProtect)
+        st->pram[address] = v;
+      state = TL_DISABLED;
+      break;
+    case TL_SENDING:
+      if (i >= numSent)
+        result = serialData;
+      state = TL_DISABLED;
+      break;
+    case TL_DISABLED:
+      break;
+    }
+  }
+  return recv ? result : 0;
+}
+
+// Arguments and result of a transaction run on the simulator thread.
+const byte *g_simTlSent;
+uint8_t g_simTlNumSent;
+bool8_t g_simTlRecv;
+byte g_simTlResult;
+struct SimTlState g_simTlState;
+
+void simTlExecCall(void)
+{
+  if (!simSettle()) {
+    g_simTlResult = 0xff;
+    return;
+  }
+  simTlGetState(&g_simTlState);
+  g_simTlResult = simTlExec(&g_simTlState, g_simTlSent, g_simTlNumSent,
+                            g_simTlRecv);
+  simTlSetState(&g_simTlState);
+}
+
+void simTlGetStateCall(void)
+{
+  simSettle();
+  simTlGetState(&g_simTlState);
+}
+
+/* Perform a complete PRAM transaction at the transaction level, like
+   `serialTransact()`.  Cross-check against the bit level if it's
+   this transaction's turn.  */
+byte simTlTransact(const byte *sent, uint8_t numSent, bool8_t recv)
+{
+  struct SimTlState before, expect;
+  byte expectVal, actualVal;
+  bool8_t match;
+
+  g_simTlCount++;
+  if (g_simTlCheck == 0 || g_simTlCount % g_simTlCheck != 0) {
+    g_simTlSent = sent;
+    g_simTlNumSent = numSent;
+    g_simTlRecv = recv;
+    simCall(simTlExecCall);
+    return g_simTlResult;
+  }
+
+  g_simTlChecked++;
+  simCall(simTlGetStateCall);
+  before = g_simTlState;
+  expect = before;
+  expectVal = simTlExec(&expect, sent, numSent, recv);
+  actualVal = serialTransact(sent, numSent, recv);
+  simCall(simTlGetStateCall);
+
+  // The clock may have ticked during the bit-level transaction.
+  match = (g_simTlState.writeProtect == expect.writeProtect &&
+           memcmp(g_simTlState.pram, expect.pram, g_simTlPramSize) == 0 &&
+           g_simTlState.seconds - expect.seconds <= 1);
+  if (actualVal != expectVal) {
+    // Check against the clock value after the tick too.
+    struct SimTlState ticked = before;
+    ticked.seconds = g_simTlState.seconds;
+    match &= (actualVal == simTlExec(&ticked, sent, numSent, recv));
+  }
+  if (!match) {
+    uint8_t i;
+    g_simTlMismatches++;
+    fputs("transaction-level mismatch: sent", stderr);
+    for (i = 0; i < numSent; i++)
+      fprintf(stderr, " 0x%02x", sent[i]);
+    if (recv)
+      fprintf(stderr, ", received 0x%02x, expected 0x%02x",
+              actualVal, expectVal);
+    fputc('\n', stderr);
+  }
+  return actualVal;
+}
+
+// Arguments of a burst transaction run on the simulator thread.
+byte g_simTlBurstAddr;
+byte *g_simTlBurstData;
+uint16_t g_simTlBurstCount;
+bool8_t g_simTlBurstWrite;
+
+/* Model of the firmware's burst XPRAM transfers.  Addresses wrap
+   around at the end of XPRAM.  */
+void simTlBurstExec(struct SimTlState *st, byte addr, byte *data,
+                    uint16_t count, bool8_t writeRequest)
+{
+  uint16_t i;
+  for (i = 0; i < count; i++, addr++) {
+    if (!writeRequest)
+      data[i] = st->pram[addr];
+    else if (!st->writeProtect)
+      st->pram[addr] = data[i];
+  }
+}
+
+void simTlBurstCall(void)
+{
+  if (!simSettle()) {
+    if (!g_simTlBurstWrite)
+      memset(g_simTlBurstData, 0xff, g_simTlBurstCount);
+    return;
+  }
+  simTlGetState(&g_simTlState);
+  simTlBurstExec(&g_simTlState, g_simTlBurstAddr, g_simTlBurstData,
+                 g_simTlBurstCount, g_simTlBurstWrite);
+  simTlSetState(&g_simTlState);
+}
+
+/* Perform a burst XPRAM transaction at the transaction level, like
+   `serialBurstTransact()`.  Cross-check against the bit level if
+   it's this transaction's turn.  */
+void simTlBurst(byte addr, byte *data, uint16_t count, bool8_t writeRequest)
+{
+  struct SimTlState expect;
+  byte expectData[256];
+
+  g_simTlCount++;
+  if (g_simTlCheck == 0 || g_simTlCount % g_simTlCheck != 0) {
+    g_simTlBurstAddr = addr;
+    g_simTlBurstData = data;
+    g_simTlBurstCount = count;
+    g_simTlBurstWrite = writeRequest;
+    simCall(simTlBurstCall);
+    return;
+  }
+
+  g_simTlChecked++;
+  simCall(simTlGetStateCall);
+  expect = g_simTlState;
+  memcpy(expectData, data, count);
+  simTlBurstExec(&expect, addr, expectData, count, writeRequest);
+  serialBurstTransact(addr, data, count, writeRequest);
+  simCall(simTlGetStateCall);
+  if (memcmp(g_simTlState.pram, expect.pram, g_simTlPramSize) != 0 ||
+      memcmp(data, expectData, count) != 0) {
+    g_simTlMismatches++;
+    fprintf(stderr, "transaction-level mismatch: burst %s of %u bytes "
+            "at 0x%02x\n", writeRequest ? "write" : "read",
+            (unsigned)count, addr);
+  }
+}
+
+/* Look up the firmware variables used by transaction-level mode.
+   Return true if they were all found.  */
+bool8_t simTlSetup(const char *fname)
+{
+  uint32_t value, size;
+  if (!elfLookupSym(fname, "seconds", &value, &size) || size != 4)
+    return false;
+  g_simTlSecondsAddr = value - AVR_ELF_DATA_OFFSET;
+  if (!elfLookupSym(fname, "writeProtect", &value, &size) || size != 1)
+    return false;
+  g_simTlWriteProtectAddr = value - AVR_ELF_DATA_OFFSET;
+  if (!elfLookupSym(fname, "pram", &value, &size) || size > 256)
+    return false;
+  g_simTlPramAddr = value - AVR_ELF_DATA_OFFSET;
+  g_simTlPramSize = size;
+  // Optional firmware features.
+  g_simTlLatchAddr = 0;
+  if (elfLookupSym(fname, "secondsLatch", &value, &size) && size == 4) {
+    g_simTlLatchAddr = value - AVR_ELF_DATA_OFFSET;
+    if (!elfLookupSym(fname, "latchBytes", &value, NULL))
+      return false;
+    g_simTlLatchBytesAddr = value - AVR_ELF_DATA_OFFSET;
+    if (!elfLookupSym(fname, "latchAge", &value, NULL))
+      return false;
+    g_simTlLatchAgeAddr = value - AVR_ELF_DATA_OFFSET;
+  }
+  g_simTlShadowAddr = 0;
+  if (elfLookupSym(fname, "secondsShadow", &value, &size) && size == 4) {
+    g_simTlShadowAddr = value - AVR_ELF_DATA_OFFSET;
+    if (!elfLookupSym(fname, "shadowBytes", &value, NULL))
+      return false;
+    g_simTlShadowBytesAddr = value - AVR_ELF_DATA_OFFSET;
+  }
+  return true;
+}
+
+/* Interrupt latency histograms.  The cycles between a serial clock
+   edge and `loop()` shifting the bit, and between an interrupt being
+   raised and its handler running, make up the budget that limits the
+   maximum serial clock rate.  We hook `simavr`'s interrupt pending
+   and running IRQs and the test bench's CLK falling edges, and
+   collect histograms over each test suite run.
+
+   A bit shift is detected as a change in the firmware's
+   `serialBitNum` or `serialState` variables, checked after every
+   instruction until the next CLK edge, so it is accurate to within
+   one instruction.  */
+
+#define LAT_HIST_SIZE 4096 // longer samples go in the last bucket
+
+struct LatHist {
+  unsigned long count;
+  uint32_t min;
+  uint32_t max;
+  uint32_t bucket[LAT_HIST_SIZE];
+};
+
+struct SimLatVector {
+  const char *name;
+  uint8_t vector;
+};
+
+// ATtiny85 interrupt vectors that the firmware may use.
+const struct SimLatVector g_simLatVectors[] = {
+  { "INT0", 1 },
+  { "PCINT0", 2 },
+  { "TIMER1_COMPA", 3 },
+  { "TIMER1_OVF", 4 },
+  { "TIMER0_OVF", 5 },
+  { "TIMER0_COMPA", 10 },
+  { "WDT", 12 },
+  { "USI_START", 13 },
+  { "USI_OVF", 14 },
+};
+
+#define SIM_LAT_NUM_VECTORS ARRAY_SIZE(g_simLatVectors)
+
+struct SimLatStats {
+  struct LatHist shift; // CLK falling edge to bit shift
+  unsigned long shiftMissed; // CLK falling edges without a bit shift
+  struct LatHist latency[SIM_LAT_NUM_VECTORS]; // raised to running
+  struct LatHist service[SIM_LAT_NUM_VECTORS]; // running to return
+};
+
+struct SimLatVecState {
+  avr_cycle_count_t pendCycle; // when the interrupt was raised
+  avr_cycle_count_t servCycle; // when it stopped being pending
+  avr_cycle_count_t servPendCycle; // `pendCycle` at that point
+  avr_cycle_count_t runCycle; // when its handler started running
+  bool8_t pending;
+  bool8_t running;
+};
+
+struct SimLatStats g_simLat;
+struct SimLatVecState g_simLatVecs[SIM_LAT_NUM_VECTORS];
+// Firmware addresses of `serialBitNum` and `serialState`, zero if
+// unknown.
+uint16_t g_simLatBitNumAddr = 0;
+uint16_t g_simLatStateAddr = 0;
+// Watch for a bit shift after a CLK falling edge.
+bool8_t g_simLatWatching = false;
+avr_cycle_count_t g_simLatClkCycle;
+uint8_t g_simLatBitNum;
+uint8_t g_simLatState;
+
+void latHistAdd(struct LatHist *h, avr_cycle_count_t cycles)
+{
+  uint32_t value = (cycles > UINT32_MAX) ? UINT32_MAX : cycles;
+  if (h->count == 0 || value < h->min)
+    h->min = value;
+  if (h->count == 0 || value > h->max)
+    h->max = value;
+  h->count++;
+  h->bucket[(value < LAT_HIST_SIZE) ? value : LAT_HIST_SIZE - 1]++;
+}
+
+void latHistMerge(struct LatHist *dest, const struct LatHist *src)
+{
+  unsigned i;
+  if (src->count == 0)
+    return;
+  if (dest->count == 0 || src->min < dest->min)
+    dest->min = src->min;
+  if (dest->count == 0 || src->max > dest->max)
+    dest->max = src->max;
+  dest->count += src->count;
+  for (i = 0; i < LAT_HIST_SIZE; i++)
+    dest->bucket[i] += src->bucket[i];
+}
+
+// Return the given percentile of a histogram.
+uint32_t latHistPercentile(const struct LatHist *h, unsigned pct)
+{
+  unsigned long rank = (h->count * pct + 99) / 100;
+  unsigned long seen = 0;
+  uint32_t i;
+  for (i = 0; i < LAT_HIST_SIZE - 1; i++) {
+    seen += h->bucket[i];
+    if (seen >= rank)
+      return i;
+  }
+  return h->max;
+}
+
+void latHistPrint(const char *name, const char *what,
+                  const struct LatHist *h)
+{
+  uint32_t values[4];
+  const char *labels[4] = { "min", "p50", "p99", "max" };
+  unsigned i;
+  if (h->count == 0)
+    return;
+  values[0] = h->min;
+  values[1] = latHistPercentile(h, 50);
+  values[2] = latHistPercentile(h, 99);
+  values[3] = h->max;
+  printf("  %s %s: n=%lu", name, what, h->count);
+  for (i = 0; i < 4; i++)
+    printf(" %s %u (%.2f us)", labels[i], (unsigned)values[i],
+           values[i] * 1e6 / g_simClkNormFreq);
+  putchar('\n');
+}
+
+// Forget about interrupts and CLK edges in progress, i.e. after the
+// AVR state was replaced.
+void simLatResync(void)
+{
+  memset(g_simLatVecs, 0, sizeof(g_simLatVecs));
+  g_simLatWatching = false;
+}
+
+void simLatReset(void)
+{
+  memset(&g_simLat, 0, sizeof(g_simLat));
+}
+
+// Add histograms collected elsewhere, i.e. by a child process, to
+// ours.
+void simLatMerge(const struct SimLatStats *stats)
+{
+  unsigned i;
+  latHistMerge(&g_simLat.shift, &stats->shift);
+  g_simLat.shiftMissed += stats->shiftMissed;
+  for (i = 0; i < SIM_LAT_NUM_VECTORS; i++) {
+    latHistMerge(&g_simLat.latency[i], &stats->latency[i]);
+    latHistMerge(&g_simLat.service[i], &stats->service[i]);
+  }
+}
+
+void simLatReport(void)
+{
+  unsigned i;
+  prTsStat("INFO:");
+  printf("interrupt latency in cycles at %d Hz:\n", (int)g_simClkNormFreq);
+  latHistPrint("CLK edge to bit shift", "latency", &g_simLat.shift);
+  if (g_simLat.shiftMissed > 0)
+    printf("  CLK falling edges without a bit shift: %lu\n",
+           g_simLat.shiftMissed);
+  for (i = 0; i < SIM_LAT_NUM_VECTORS; i++) {
+    latHistPrint(g_simLatVectors[i].name, "latency", &g_simLat.latency[i]);
+    latHistPrint(g_simLatVectors[i].name, "service", &g_simLat.service[i]);
+  }
+}
+
+void sim_lat_pending_notify(avr_irq_t *irq, uint32_t value, void *param)
+{
+  struct SimLatVecState *vs = &g_simLatVecs[(uintptr_t)param];
+  if (g_simRestoring)
+    return;
+  if (value) {
+    // `simavr` raises this again if the flag is set again before the
+    // interrupt is serviced, keep the first time.
+    if (!vs->pending)
+      vs->pendCycle = avr->cycle;
+    vs->pending = true;
+  } else if (vs->pending) {
+    // Either the interrupt is being serviced right now, or its flag
+    // was cleared in software.
+    vs->servCycle = avr->cycle;
+    vs->servPendCycle = vs->pendCycle;
+    vs->pending = false;
+  }
+}
+
+void sim_lat_running_notify(avr_irq_t *irq, uint32_t value, void *param)
+{
+  uintptr_t i = (uintptr_t)param;
+  struct SimLatVecState *vs = &g_simLatVecs[i];
+  if (g_simRestoring)
+    return;
+  if (value) {
+    if (vs->servCycle == avr->cycle)
+      latHistAdd(&g_simLat.latency[i], avr->cycle - vs->servPendCycle);
+    vs->runCycle = avr->cycle;
+    vs->running = true;
+  } else if (vs->running) {
+    latHistAdd(&g_simLat.service[i], avr->cycle - vs->runCycle);
+    vs->running = false;
+  }
+}
+
+avr_cycle_count_t sim_lat_shift_timer(avr_t *avr, avr_cycle_count_t when,
+                                      void *param)
+{
+  if (avr->data[g_simLatBitNumAddr] == g_simLatBitNum &&
+      avr->data[g_simLatStateAddr] == g_simLatState)
+    return when + 1;
+  latHistAdd(&g_simLat.shift, avr->cycle - g_simLatClkCycle);
+  g_simLatWatching = false;
+  return 0;
+}
+
+void sim_lat_clk_notify(avr_irq_t *irq, uint32_t value, void *param)
+{
+  // Note that `irq->value` is still the previous value here.
+  if (g_simRestoring || g_simLatBitNumAddr == 0 || irq->value == value)
+    return;
+  if (g_simLatWatching) {
+    // The last falling edge didn't get a bit shifted in time.
+    avr_cycle_timer_cancel(avr, sim_lat_shift_timer, NULL);
+    g_simLatWatching = false;
+    g_simLat.shiftMissed++;
+  }
+  // Only falling edges with the RTC enabled shift a bit.
+  if (value || bench_irqs[IRQ_CE].value)
+    return;
+  g_simLatClkCycle = avr->cycle;
+  g_simLatBitNum = avr->data[g_simLatBitNumAddr];
+  g_simLatState = avr->data[g_simLatStateAddr];
+  g_simLatWatching = true;
+  avr_cycle_timer_register(avr, 1, sim_lat_shift_timer, NULL);
+}
+
+/* Command decode timing for the `decode-cycles` test case: the
+   cycles from the given CLK falling edge of a session, counting from
+   1, until the AVR goes back to sleep.  That covers the interrupt
+   handler and anything `loop()` does for the command.  */
+uint8_t g_simDecodeEdge = 0; // zero when not timing
+uint8_t g_simDecodeEdgeNum;
+avr_cycle_count_t g_simDecodeCycle;
+bool8_t g_simDecodeAwake;
+struct LatHist g_simDecode;
+// Parameter of `simDecodeArm()` and result of `simDecodeRead()`.
+uint8_t g_simDecodeArmEdge;
+struct LatHist g_simDecodeRead;
+
+avr_cycle_count_t sim_decode_timer(avr_t *avr, avr_cycle_count_t when,
+                                   void *param)
+{
+  if (avr->state != cpu_Sleeping) {
+    g_simDecodeAwake = true;
+    return when + 1;
+  }
+  // Allow for the interrupt wakeup.
+  if (!g_simDecodeAwake && avr->cycle - g_simDecodeCycle < 64)
+    return when + 1;
+  if (g_simDecodeAwake)
+    latHistAdd(&g_simDecode, avr->cycle - g_simDecodeCycle);
+  return 0;
+}
+
+void sim_decode_ce_notify(avr_irq_t *irq, uint32_t value, void *param)
+{
+  if (!value)
+    g_simDecodeEdgeNum = 0;
+}
+
+void sim_decode_clk_notify(avr_irq_t *irq, uint32_t value, void *param)
+{
+  if (g_simRestoring || g_simDecodeEdge == 0 || irq->value == value ||
+      value || bench_irqs[IRQ_CE].value)
+    return;
+  if (++g_simDecodeEdgeNum != g_simDecodeEdge)
+    return;
+  g_simDecodeCycle = avr->cycle;
+  g_simDecodeAwake = false;
+  avr_cycle_timer_register(avr, 1, sim_decode_timer, NULL);
+}
+
+// Start timing edge number `g_simDecodeArmEdge` of each session, or
+// stop timing if it's zero.
+void simDecodeArm(void)
+{
+  g_simDecodeEdge = g_simDecodeArmEdge;
+  memset(&g_simDecode, 0, sizeof(g_simDecode));
+}
+
+void simDecodeRead(void)
+{
+  simSettle();
+  g_simDecodeRead = g_simDecode;
+}
+
+/* Hook the interrupt vectors and the CLK line for the latency
+   histograms.  The bit shift latency is only measured if the firmware
+   has the expected serial state variables.  */
+void simLatSetup(const char *fname)
+{
+  uint32_t bitNumAddr, stateAddr, size;
+  uintptr_t i;
+  for (i = 0; i < SIM_LAT_NUM_VECTORS; i++) {
+    avr_irq_t *irq = avr_get_interrupt_irq(avr, g_simLatVectors[i].vector);
+    if (irq == NULL)
+      continue;
+    avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING,
+                            sim_lat_pending_notify, (void *)i);
+    avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING,
+                            sim_lat_running_notify, (void *)i);
+  }
+  if (elfLookupSym(fname, "serialBitNum", &bitNumAddr, &size) &&
+      size == 1 &&
+      elfLookupSym(fname, "serialState", &stateAddr, &size) &&
+      size == 1) {
+    g_simLatBitNumAddr = bitNumAddr - AVR_ELF_DATA_OFFSET;
+    g_simLatStateAddr = stateAddr - AVR_ELF_DATA_OFFSET;
+    avr_irq_register_notify(bench_irqs + IRQ_CLK, sim_lat_clk_notify, NULL);
+  }
+  avr_irq_register_notify(bench_irqs + IRQ_CE, sim_decode_ce_notify, NULL);
+  avr_irq_register_notify(bench_irqs + IRQ_CLK, sim_decode_clk_notify, NULL);
+}
+
+/* Look up the timer constants that the firmware exports, for the test
+   suite to verify.  Return true if they were all found.  */
+bool8_t simTimerSetup(const char *fname)
+{
+  struct SimTimerConsts *tc = &g_simTimerConsts;
+  tc->valid = (elfLookupSym(fname, "rtc_f_cpu", &tc->fCpu, NULL) &&
+               elfLookupSym(fname, "rtc_prescaler", &tc->prescaler, NULL) &&
+               elfLookupSym(fname, "rtc_lim_oflows", &tc->limOflows, NULL) &&
+               elfLookupSym(fname, "rtc_lim_remain", &tc->limRemain, NULL) &&
+               elfLookupSym(fname, "rtc_numer_frac", &tc->numerFrac, NULL) &&
+               elfLookupSym(fname, "rtc_denom_frac", &tc->denomFrac, NULL));
+  // Firmware without clock scaling runs at one division all the time.
+  if (!elfLookupSym(fname, "rtc_clkps", &tc->clkps, NULL))
+    tc->clkps = 0;
+  if (!elfLookupSym(fname, "rtc_idle_clkps", &tc->idleClkps, NULL))
+    tc->idleClkps = tc->clkps;
+  if (!elfLookupSym(fname, "rtc_timer1", &tc->timer1, NULL))
+    tc->timer1 = 0;
+  return tc->valid;
+}
+
+// Switch the emulated system clock to the given CLKPS division.
+void simClkSet(uint8_t clkps)
+{
+  simResFlush();
+  g_simClkBaseNs = simCycleTimeNsec(avr->cycle);
+  g_simClkBaseCycle = avr->cycle;
+  g_simClkps = clkps;
+  avr->frequency = g_simClkRefFreq >> clkps;
+  avr->data[0x46] = clkps; // CLKPR
+  g_simClkSwitches++;
+  simClkPublish();
+}
+
+/* `simavr` doesn't emulate the system clock prescaler, so we do.
+   Changing CLKPR takes writing CLKPCE alone, then the new division
+   within four cycles.  We run the AVR core at the divided frequency,
+   so peripheral timing in cycles stays right, and only the mapping
+   from cycles to time changes.  */
+void sim_clkpr_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+  if (v == 0x80) { // CLKPCE
+    g_simClkpceArmed = true;
+    g_simClkpceCycle = avr->cycle;
+    return;
+  }
+  if (g_simClkpceArmed && avr->cycle - g_simClkpceCycle <= 4 &&
+      (v & 0x0f) <= 8 && (v & 0x0f) != g_simClkps)
+    simClkSet(v & 0x0f);
+  g_simClkpceArmed = false;
+}
+
+// Count CLK edges that arrive while the RTC is selected but not
+// running at full speed.
+void sim_clk_speed_notify(avr_irq_t *irq, uint32_t value, void *param)
+{
+  if (!g_simRestoring && !bench_irqs[IRQ_CE].value &&
+      g_simClkps != g_simTimerConsts.clkps)
+    g_simClkSlowEdges++;
+}
+
+// System clock state most recently fetched by `simClkRead()`.
+struct SimClkState {
+  uint8_t clkps;
+  unsigned long switches;
+  unsigned long slowEdges;
+};
+struct SimClkState g_simClkRead;
+
+void simClkRead(void)
+{
+  g_simClkRead.clkps = g_simClkps;
+  g_simClkRead.switches = g_simClkSwitches;
+  g_simClkRead.slowEdges = g_simClkSlowEdges;
+}
+
+void simClkResetCounts(void)
+{
+  g_simClkSwitches = 0;
+  g_simClkSlowEdges = 0;
+}
+
+// Timekeeping timer prescaler and system clock division most recently
+// fetched by `simTimerReadPrescaler()`, zero if the timer is stopped.
+uint32_t g_simTimerPrescaler;
+uint8_t g_simTimerClkps;
+
+void simTimerReadPrescaler(void)
+{
+  static const uint16_t prescalers0[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  uint8_t cs;
+  if (g_simTimerConsts.timer1) {
+    cs = avr->data[0x50] & 0x0f; // TCCR1
+    g_simTimerPrescaler = (cs) ? 1 << (cs - 1) : 0;
+  } else {
+    cs = avr->data[0x53] & 0x07; // TCCR0B
+    g_simTimerPrescaler = prescalers0[cs];
+  }
+  g_simTimerClkps = g_simClkps;
+}
+
+// SEC1 edge count and time most recently fetched by `simSec1Read()`.
+unsigned long g_simSec1ReadCount;
+uint64_t g_simSec1ReadNs;
+
+void simSec1Read(void)
+{
+  g_simSec1ReadCount = g_simSec1Count;
+  g_simSec1ReadNs = g_simSec1Ns;
+}
+
+// Wait until the SEC1 edge count reaches `count`, giving up after
+// `maxUsec`.  Return true if it did.
+bool8_t simWaitSec1Count(unsigned long count, uint32_t maxUsec)
+{
+  uint32_t waited = 0;
+  simCall(simSec1Read);
+  while (g_simSec1ReadCount < count) {
+    if (waited >= maxUsec)
+      return false;
+    simWaitUsec(1000);
+    waited += 1000;
+    simCall(simSec1Read);
+  }
+  return true;
+}
+
+/* Measure the period of the 1-second interrupt line: wait for a SEC1
+   falling edge, then for `numSecs` more, and return the simulated
+   time in between, in nanoseconds.  Return zero if the edges didn't
+   come.  */
+uint64_t simMeasureSec1(unsigned numSecs)
+{
+  unsigned long startCount;
+  uint64_t startNs;
+  simCall(simSec1Read);
+  if (!simWaitSec1Count(g_simSec1ReadCount + 1, 2000000))
+    return 0;
+  startCount = g_simSec1ReadCount;
+  startNs = g_simSec1ReadNs;
+  // Skip most of the way there in one go.
+  simWaitUsec((numSecs - 1) * 1000000 + 500000);
+  if (!simWaitSec1Count(startCount + numSecs, 2000000))
+    return 0;
+  simCall(simSec1Read);
+  if (g_simSec1ReadCount != startCount + numSecs)
+    return 0;
+  return g_simSec1ReadNs - startNs;
+}
+
+/* Measure `numSecs` consecutive periods of the 1-second interrupt
+   line one by one, and return the shortest and the longest in
+   `minNs` and `maxNs`, in nanoseconds.  Return false if an edge
+   didn't come, or if more than one came in a period, as when a
+   half-second is counted twice.  */
+bool8_t simMeasureSec1Each(unsigned numSecs, uint64_t *minNs,
+                           uint64_t *maxNs)
+{
+  unsigned long count;
+  uint64_t lastNs;
+  unsigned i;
+  simCall(simSec1Read);
+  if (!simWaitSec1Count(g_simSec1ReadCount + 1, 2000000))
+    return false;
+  count = g_simSec1ReadCount;
+  lastNs = g_simSec1ReadNs;
+  *minNs = UINT64_MAX;
+  *maxNs = 0;
+  for (i = 0; i < numSecs; i++) {
+    simWaitUsec(900000);
+    if (!simWaitSec1Count(count + 1, 2000000) ||
+        g_simSec1ReadCount != count + 1)
+      return false;
+    if (g_simSec1ReadNs - lastNs < *minNs)
+      *minNs = g_simSec1ReadNs - lastNs;
+    if (g_simSec1ReadNs - lastNs > *maxNs)
+      *maxNs = g_simSec1ReadNs - lastNs;
+    count = g_simSec1ReadCount;
+    lastNs = g_simSec1ReadNs;
+  }
+  return true;
+}
+
+// Wakeup and activity counters fetched by `simPowerRead()`.
+struct SimPowerStats {
+  unsigned long wakeups;
+  avr_cycle_count_t activeCycles;
+  uint64_t activeNs;
+  uint64_t ns;
+};
+struct SimPowerStats g_simPowerRead;
+
+void simPowerRead(void)
+{
+  g_simPowerRead.wakeups = g_simWakeCount;
+  g_simPowerRead.activeCycles = avr->cycle - g_simSleepCycles;
+  g_simPowerRead.ns = simCycleTimeNsec(avr->cycle);
+  g_simPowerRead.activeNs = g_simPowerRead.ns - g_simSleepNs;
+}
+
+// Look up the firmware's EEPROM persistence symbols.  Return true if
+// they were all found.
+bool8_t simPersistSetup(const char *fname)
+{
+  struct SimPersist *sp = &g_simPersist;
+  uint32_t value, size;
+  sp->valid = false;
+  if (!elfLookupSym(fname, "rtc_persist_delay", &sp->delay, NULL) ||
+      !elfLookupSym(fname, "rtc_ee_journal", &sp->journal, NULL) ||
+      sp->journal == 0)
+    return false;
+  if (!elfLookupSym(fname, "dirtyPram", &value, &size))
+    return false;
+  sp->dirtyAddr = value - AVR_ELF_DATA_OFFSET;
+  sp->dirtySize = size;
+  if (!elfLookupSym(fname, "persistDelay", &value, NULL))
+    return false;
+  sp->delayAddr = value - AVR_ELF_DATA_OFFSET;
+  if (!elfLookupSym(fname, "eepromBusy", &value, NULL))
+    return false;
+  sp->busyAddr = value - AVR_ELF_DATA_OFFSET;
+  if (!elfLookupSym(fname, "persistState", &value, NULL))
+    return false;
+  sp->stateAddr = value - AVR_ELF_DATA_OFFSET;
+  if (!elfLookupSym(fname, "persistPos", &value, NULL))
+    return false;
+  sp->posAddr = value - AVR_ELF_DATA_OFFSET;
+  if (!elfLookupSym(fname, "recordPending", &value, NULL))
+    return false;
+  sp->pendingAddr = value - AVR_ELF_DATA_OFFSET;
+  sp->valid = true;
+  return true;
+}
+
+/* Mark a PRAM byte dirty in the firmware, like its `writePram()`, for
+   writes that bypass the firmware.  Only call this on the thread that
+   runs the simulator.  */
+void simPersistMarkDirty(uint8_t addr)
+{
+  if (!g_simPersist.valid)
+    return;
+  avr->data[g_simPersist.dirtyAddr + (addr >> 3)] |= 1 << (addr & 0x07);
+  avr->data[g_simPersist.delayAddr] = g_simPersist.delay;
+}
+
+// Copy of the simulated EEPROM and whether the firmware's write-back
+// was done, fetched by `simPersistRead()`.
+uint8_t g_simEeprom[SIM_SNAP_MAX_EEPROM];
+uint32_t g_simEepromSize;
+bool8_t g_simPersistIdle;
+
+void simPersistRead(void)
+{
+  const struct SimPersist *sp = &g_simPersist;
+  avr_eeprom_desc_t ee;
+  uint16_t i;
+  g_simEepromSize = avr->e2end + 1;
+  if (g_simEepromSize > SIM_SNAP_MAX_EEPROM)
+    g_simEepromSize = SIM_SNAP_MAX_EEPROM;
+  ee.ee = g_simEeprom;
+  ee.offset = 0;
+  ee.size = g_simEepromSize;
+  avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+  g_simPersistIdle = sp->valid;
+  if (!sp->valid)
+    return;
+  for (i = 0; i < sp->dirtySize; i++) {
+    if (avr->data[sp->dirtyAddr + i])
+      g_simPersistIdle = false;
+  }
+  if (avr->data[sp->busyAddr] || avr->data[sp->stateAddr] ||
+      avr->data[sp->pendingAddr])
+    g_simPersistIdle = false;
+}
+
+// Write `g_simEeprom` back to the simulated EEPROM.
+void simPersistWrite(void)
+{
+  avr_eeprom_desc_t ee;
+  ee.ee = g_simEeprom;
+  ee.offset = 0;
+  ee.size = g_simEepromSize;
+  avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+}
+
+// Print the simulated EEPROM in the same format as the monitor.
+void simEepromDump(void)
+{
+  uint32_t i;
+  simPersistRead();
+  for (i = 0; i < g_simEepromSize; i++) {
+    if ((i & 0x07) == 0) {
+      PR_TS_INFO();
+      printf("%04X-", (unsigned)i);
+    }
+    printf(" %02X", g_simEeprom[i]);
+    if ((i & 0x07) == 0x07)
+      putchar('\n');
+  }
+}
+
+// Wait until the firmware has written all of PRAM back to EEPROM,
+// giving up after `maxUsec`.  Return true if it did.
+bool8_t simWaitPersist(uint32_t maxUsec)
+{
+  uint32_t waited = 0;
+  simCall(simPersistRead);
+  while (!g_simPersistIdle) {
+    if (waited >= maxUsec)
+      return false;
+    simWaitUsec(10000);
+    waited += 10000;
+    simCall(simPersistRead);
+  }
+  return true;
+}
+
+/* Decode the PRAM saved in `g_simEeprom` the same way as the
+   firmware's `restorePram()`, into `out`.  Return the number of
+   journal records, or -1 if the EEPROM isn't formatted.  */
+int simPersistDecode(uint8_t *out, uint16_t size)
+{
+  uint32_t eeAddr;
+  int numRecords = 0;
+  if (g_simEeprom[size] != (0x5a ^ (size & 0xff)))
+    return -1;
+  memcpy(out, g_simEeprom, size);
+  for (eeAddr = g_simPersist.journal; eeAddr + 1 < g_simEepromSize;
+       eeAddr += 2) {
+    uint8_t addr = g_simEeprom[eeAddr];
+    if (addr == 0xff)
+      break;
+    if (addr < size)
+      out[addr] = g_simEeprom[eeAddr + 1];
+    numRecords++;
+  }
+  return numRecords;
+}
+
+/* Reset the AVR, keeping the EEPROM, as after the battery was changed,
+   and let it boot.  `g_simBootCycles` is set to the number of cycles
+   until it went to sleep.  */
+avr_cycle_count_t g_simBootCycles;
+
+void simReboot(void)
+{
+  avr_cycle_count_t start = avr->cycle;
+  unsigned i;
+  simResFlush();
+  avr_reset(avr);
+  avr->cycle = start;
+  g_simClkpceArmed = false;
+  simClkSet(g_simTimerConsts.clkps); // CLKPR resets to the fuse setting
+  // Drive the RTC input pins again, the reset cleared them.
+  for (i = IRQ_CE; i < IRQ_DATA_OUT; i++)
+    avr_raise_irq(bench_irqs + i, bench_irqs[i].value);
+  simLatResync();
+  // Resetting the AVR cancelled our own cycle timers too.
+  if (g_simThreaded && !g_simVirtTime)
+    avr_cycle_timer_register(avr, g_simPollCycles, sim_poll_timer, NULL);
+  simSettle();
+  g_simBootCycles = avr->cycle - start;
+}
+
+/* Let the firmware run until it is folding its journal into the
+   image and has got below the journal address `g_simFoldCutPos`,
+   then reset it like `simReboot()`, as if the power failed mid-fold.
+   `g_simFoldCut` is set to true if it got there within 10 seconds of
+   simulated time.  */
+uint16_t g_simFoldCutPos;
+bool8_t g_simFoldCut;
+
+void simPersistCutFold(void)
+{
+  const struct SimPersist *sp = &g_simPersist;
+  avr_cycle_count_t limit = avr->cycle + avr_usec_to_cycles(avr, 10000000);
+  g_simFoldCut = false;
+  while (avr->cycle < limit) {
+    uint16_t pos = avr->data[sp->posAddr] |
+      (avr->data[sp->posAddr + 1] << 8);
+    if (avr->data[sp->stateAddr] == SIM_PERSIST_IMAGE &&
+        pos < g_simFoldCutPos) {
+      g_simFoldCut = true;
+      break;
+    }
+    avr->run(avr);
+    if (avr->state == cpu_Done || avr->state == cpu_Crashed)
+      return;
+  }
+  simReboot();
+}
+
+int setupSimAvr(char *progName, const char *fname, bool8_t interactMode)
+{
+  elf_firmware_t f;
+  uint32_t elfFCpu;
+
+  if (elf_read_firmware(fname, &f) != 0) {
+    fprintf(stderr, "%s: firmware '%s' invalid\n", progName, fname);
+    return 1;
+  }
+  strcpy(f.mmcu, "attiny85");
+  /* The bench wires up an ATtiny85.  Images that keep time with an
+     asynchronous timer are built for the ATtiny87 or ATtiny167, which
+     `simavr` can't simulate and which have their pins elsewhere, so
+     refuse them rather than report failures that mean nothing.  */
+  {
+    uint32_t asyncSym;
+    if (elfLookupSym(fname, "rtc_async_clock", &asyncSym, NULL) &&
+        asyncSym != 0) {
+      fprintf(stderr, "%s: firmware '%s' is built for the ATtiny87 or "
+              "ATtiny167, which the test bench can't simulate\n",
+              progName, fname);
+      return 1;
+    }
+  }
+  /* Simulate at the frequency that the firmware was built for.  Use
+     the command-line override if given, otherwise a `simavr` `.mmcu`
+     section tag if present, otherwise the `rtc_f_cpu` symbol that
+     MacRTC.c exports from F_CPU.  */
+  if (g_simFrequency != 0)
+    f.frequency = g_simFrequency;
+  else if (f.frequency == 0) {
+    if (elfLookupSym(fname, "rtc_f_cpu", &elfFCpu, NULL))
+      f.frequency = elfFCpu;
+    else {
+      fprintf(stderr, "%s: firmware '%s' has no F_CPU, assuming 8 MHz\n",
+              progName, fname);
+      f.frequency = 8000000;
+    }
+  }
+  // Likewise, configure the host PRAM type to match the firmware, and
+  // read the time in a single pass if the firmware latches it.
+  {
+    uint32_t pramSymSize;
+    uint32_t burstSym;
+    if (elfLookupSym(fname, "pram", NULL, &pramSymSize))
+      setPramType(pramSymSize == 256);
+    setFastTimeRead(elfLookupSym(fname, "rtc_time_latch", NULL, NULL));
+    setBurstXPram(elfLookupSym(fname, "rtc_burst_xpram", &burstSym, NULL) &&
+                  burstSym != 0 && getPramType());
+  }
+  simTimerSetup(fname);
+  simPersistSetup(fname);
+  if (g_simTlMode && !simTlSetup(fname)) {
+    fprintf(stderr, "%s: firmware '%s' lacks PRAM symbols, "
+            "using bit-level transactions\n", progName, fname);
+    g_simTlMode = false;
+  }
+  if (!g_simVirtTime && f.frequency > 400000)
+    fprintf(stderr, "%s: warning: real-time simulation may not keep up "
+            "at %d Hz\n", progName, (int)f.frequency);
+
+  printf("firmware %s f=%d mmcu=%s\n", fname, (int)f.frequency, f.mmcu);
+  g_simClkNormFreq = f.frequency;
+  g_simClkRefFreq = f.frequency << g_simTimerConsts.clkps;
+  g_simClkps = g_simTimerConsts.clkps;
+
+  avr = avr_make_mcu_by_name(f.mmcu);
+  if (!avr) {
+    fprintf(stderr, "%s: AVR '%s' not known\n", progName, f.mmcu);
+    return 1;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &f);
+  avr->data[0x46] = g_simClkps; // CLKPR, as set by the CKDIV8 fuse
+  avr_register_io_write(avr, 0x46, sim_clkpr_write, NULL);
+
+  // Initialize our host circuit "peripheral."
+
+  // Setup IRQ connections and connect our test bench and AVR
+  // together.
+  bench_irqs = avr_alloc_irq(&avr->irq_pool, 0, 5, bench_irq_names);
+
+  avr_connect_irq(bench_irqs + IRQ_CE,
+                  avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0));
+  avr_connect_irq(bench_irqs + IRQ_CLK,
+                  avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2));
+
+  // Since we use open-drain signaling on sec1 and data, this a bit
+  // trickier to connect to, but this is how to do it.
+  avr_connect_irq(avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.SEC1*", 5),
+                  bench_irqs + IRQ_SEC1);
+  avr_connect_irq(bench_irqs + IRQ_DATA_IN,
+                  avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1));
+  avr_connect_irq(avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.DATA.OUT*", 1),
+                  bench_irqs + IRQ_DATA_OUT);
+
+  // Register notify functions for inputs to test bench (outputs):
+  avr_irq_register_notify(bench_irqs + IRQ_SEC1,
+                          pin_change_notify, NULL);
+  avr_irq_register_notify(bench_irqs + IRQ_DATA_OUT,
+                          pin_change_notify, NULL);
+
+  simLatSetup(fname);
+  avr_irq_register_notify(bench_irqs + IRQ_CLK, sim_clk_speed_notify, NULL);
+
+  // Give the RTC input pins sane initial values.
+  avr_raise_irq(bench_irqs + IRQ_CE, 1);
+  avr_raise_irq(bench_irqs + IRQ_CLK, 0);
+  avr_raise_irq(bench_irqs + IRQ_DATA_IN, 0);
+
+  // NOTE: Propagation of connected IRQs is unidirectional, so we need
+  // special handling for the bi-directional communication pin.
+  // Actually, we always need special handling due to our quirk used
+  // for open collector communication.  We always end up using two
+  // different IRQs, and we decide whether to listen or ignore outputs
+  // based off of the VIA direction register.
+
+  // even if not setup at startup, activate gdb if crashing
+  avr->gdb_port = 1234;
+  if (0) {
+    //avr->state = cpu_Stopped;
+    avr_gdb_init(avr);
+  }
+
+  // Use our own sleep callbacks, in virtual time mode don't pace AVR
+  // sleep periods to the host clock.
+  if (g_simVirtTime)
+    avr->sleep = sim_sleep_virtual;
+  else
+    avr->sleep = sim_sleep_realtime;
+  clock_gettime(CLOCK_MONOTONIC, &g_simRtBase);
+
+  /*
+   *    VCD file initialization
+   *    
+   *    This will allow you to create a "wave" file and display it in
+   *    gtkwave.  Use the `sim-rec`/`sim-no-rec` commands to
+   *    start/stop recording pin changes.
+   */
+  avr_vcd_init(avr, "gtkwave_trace.vcd", &vcd_file, 10000 /* usec */);
+
+  // ATTiny85 PINB == 0x16
+  // ATTiny85 DDRB == 0x17
+  // ATTiny85 PORTB == 0x18
+
+  avr_vcd_add_signal(&vcd_file,
+    avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0),
+    1  /* bits */,
+    "RTC.CE*" );
+  avr_vcd_add_signal(&vcd_file,
+    avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2),
+    1  /* bits */,
+    "RTC.CLK" );
+
+  // Since we use open-drain signaling on sec1 and data, this a bit
+  // trickier to monitor, but this is how to do it.
+  avr_irq_t *rtc_sec1_irq =
+    avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.SEC1*", 5);
+  avr_vcd_add_signal(&vcd_file, rtc_sec1_irq, 1  /* bits */,
+    "RTC.SEC1*" );
+  avr_vcd_add_signal(&vcd_file,
+    avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1),
+    1  /* bits */,
+    "RTC.DATA.IN" );
+  avr_irq_t *rtc_data_out_irq =
+    avr_iomem_getirq(avr, AVR_IO_TO_DATA(0x17), "RTC.DATA.OUT*", 1);
+  // Let's just process inverted data for now.
+  /* uint8_t flags = avr_irq_get_flags(rtc_data_out_irq);
+  flags |= IRQ_FLAG_NOT;
+  avr_irq_set_flags(rtc_data_out_irq, flags); */
+  avr_vcd_add_signal(&vcd_file, rtc_data_out_irq, 1  /* bits */,
+    "RTC.DATA.OUT*" );
+
+  // TIMER0_OVF == 5
+  avr_vcd_add_signal(&vcd_file,
+                     avr_get_interrupt_irq(avr, 5),
+                     1  /* bits */ ,
+                     "TIMER0_OVF" );
+
+  // printf("Starting VCD trace\n");
+  // avr_vcd_start(&vcd_file);
+
+  fputs( "\nSimulation launching:\n", stdout);
+
+  if (g_simThreaded && !simThreadStart()) {
+    fprintf(stderr, "%s: failed to start simulator thread\n", progName);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Run a single step of the AVR simulation, return true if the
+// simulation should continue, false if it should stop.
+bool8_t simAvrStep(void)
+{
+  // Simulation main loop.
+  int state = avr_run(avr);
+  if ((state == cpu_Done) || (state == cpu_Crashed))
+    return false;
+  return true;
+
+  // NOTE: When the simulator runs on its own thread, see
+  // `simThreadMain()` instead.
+}
+
+/* Let the simulation make progress while the command line is idle,
+   and set `timeout` to the number of milliseconds `poll()` may block
+   before we need to be called again.  Return true if the simulation
+   should continue, false if it should stop.  */
+bool8_t simIdle(int *timeout)
+{
+  struct timespec tv;
+  uint64_t elapsedUs;
+  avr_cycle_count_t target, maxTarget;
+
+  if (g_simThreaded) {
+    // The simulator runs on its own, just pick up its messages.
+    *timeout = 10;
+    return simThreadPoll();
+  }
+  if (g_simVirtTime) {
+    // Simulated time only advances when the test bench waits, so
+    // there is nothing to do until there is input.
+    *timeout = -1;
+    return true;
+  }
+
+  // Catch the simulation up with the wall clock, at most 10
+  // milliseconds of it at a time so that we stay responsive to
+  // input.  A cycle timer at the target keeps a sleeping AVR from
+  // overshooting it.
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  elapsedUs = (tv.tv_sec - g_simRtBase.tv_sec) * 1000000LL +
+    (tv.tv_nsec - g_simRtBase.tv_nsec) / 1000;
+  target = simNsecToCycle(elapsedUs * 1000);
+  maxTarget = avr->cycle + avr_usec_to_cycles(avr, 10000);
+  if (target > maxTarget)
+    target = maxTarget;
+  *timeout = 1;
+  if (target <= avr->cycle)
+    return true;
+  avr_cycle_timer_register(avr, target - avr->cycle, notify_timeup, NULL);
+  if (!simRunUntil(target, false))
+    return false;
+  avr_cycle_timer_cancel(avr, notify_timeup, NULL);
+  if (avr->cycle < maxTarget)
+    return true;
+  // Still behind the wall clock, come right back.
+  *timeout = 0;
+  return true;
+}
+
+/********************************************************************/
+/* Automated test suite module */
+
+/*
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "arduino_sdef.h"
+#include "via-emu.h"
+#include "pram-lib.h"
+#include "a2mon-pram.h"
+*/
+
+bool8_t g_suiteActive = false;
+struct timespec g_tsStartTm;
+uint64_t g_tsStartSimNs;
+uint8_t g_passCount;
+uint8_t g_failCount;
+uint8_t g_skipCount;
+
+// Print the elapsed time in the test suite.  In virtual time mode,
+// this is the simulated time rather than the host time.
+void prTestTime(void)
+{
+  struct timespec tv, tvDiff;
+  if (!g_phyMode && g_simVirtTime) {
+    uint64_t simDiff = simTimeNsec() - g_tsStartSimNs;
+    printf("[ %3d.%09d ] ", (int)(simDiff / 1000000000),
+           (int)(simDiff % 1000000000));
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  tvDiff.tv_sec = tv.tv_sec - g_tsStartTm.tv_sec;
+  tvDiff.tv_nsec = tv.tv_nsec - g_tsStartTm.tv_nsec;
+  if (tvDiff.tv_nsec < 0) {
+    tvDiff.tv_sec--;
+    tvDiff.tv_nsec += 1000000000;
+  }
+  printf("[ %3d.%09d ] ", tvDiff.tv_sec, tvDiff.tv_nsec);
+}
+
+void prTsStat(const char *status)
+{
+  prTestTime();
+  fputs(status, stdout);
+}
+
+void recTsResult(bool8_t result, const char *desc)
+{
+  prTsStat((result) ? "PASS:" : "FAIL:");
+  fputs(desc, stdout);
+  putchar('\n');
+  if (result)
+    g_passCount++;
+  else
+    g_failCount++;
+}
+
+void recTsSkip(const char *desc)
+{
+  prTsStat("SKIP:");
+  fputs(desc, stdout);
+  putchar('\n');
+  g_skipCount++;
+}
+
+void suiteStart(void)
+{
+  g_suiteActive = true;
+  clock_gettime(CLOCK_MONOTONIC, &g_tsStartTm);
+  if (!g_phyMode)
+    g_tsStartSimNs = simTimeNsec();
+  g_passCount = 0;
+  g_failCount = 0;
+  g_skipCount = 0;
+}
+
+bool8_t suiteEnd(void)
+{
+  putchar('\n'); prTsStat("INFO:");
+  printf("%d passed, %d failed, %d skipped\n",
+         g_passCount, g_failCount, g_skipCount);
+  g_suiteActive = false;
+  return (g_failCount == 0);
 }
 
 uint8_t getSuiteMode(void)
@@ -2439,34 +5304,577 @@ uint8_t getSuiteMode(void)
   return g_suiteActive;
 }
 
-bool8_t autoTestSuite(bool8_t verbose, bool8_t simRealTime,
-                      bool8_t testXPram)
+void tsSec1Line(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  if (!simRealTime)
+    recTsSkip("1-second interrupt line");
+  else {
+    /* Listen for 1-second ping, compare with host clock to verify
+       second counting is working correctly.  */
+    bool8_t result = false;
+    uint8_t tries = 0;
+    // Retry up to one time simply because we might cross a one-second
+    // time boundary intermittently.
+    do {
+      // Check that the 1-second line interrupt is working as expected
+      // for three seconds.
+      uint32_t expectTimeSecs, actualTimeSecs;
+      expectTimeSecs = getTime();
+      waitOneSec(); expectTimeSecs++;
+      actualTimeSecs = getTime();
+      if (verbose) {
+        prTsStat("INFO:");
+        printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
+      }
+      result = (expectTimeSecs == actualTimeSecs);
+      if (!result)
+        continue;
+      waitOneSec(); expectTimeSecs++;
+      actualTimeSecs = getTime();
+      if (verbose) {
+        prTsStat("INFO:");
+        printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
+      }
+      result = (expectTimeSecs == actualTimeSecs);
+      if (!result)
+        continue;
+      waitOneSec(); expectTimeSecs++;
+      actualTimeSecs = getTime();
+      if (verbose) {
+        prTsStat("INFO:");
+        printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
+      }
+      result = (expectTimeSecs == actualTimeSecs);
+      if (!result)
+        continue;
+    } while (!result && ++tries < 2);
+    recTsResult(result, "1-second interrupt line");
+  }
+}
+
+/* Verify the timer constants that the firmware derived from its F_CPU
+   at compile time: the half-second must come out to exactly F_CPU / 2
+   cycles on average, and the prescaler must be the one that was
+   configured.  If the firmware has slowed down its system clock, the
+   Timer0 prescaler must have been scaled down by the same factor.  */
+void tsTimerConsts(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const struct SimTimerConsts *tc = &g_simTimerConsts;
+  bool8_t result;
+  uint64_t halfSecCycles;
+  if (g_phyMode || !tc->valid) {
+    recTsSkip("Timer constants");
+    return;
+  }
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("F_CPU %u: Timer%d prescaler %u, "
+           "%u overflows + %u ticks + %u/%u tick\n",
+           tc->fCpu, (tc->timer1) ? 1 : 0, tc->prescaler, tc->limOflows,
+           tc->limRemain, tc->numerFrac, tc->denomFrac);
+  }
+  // Everything has to fit the firmware's 8-bit book-keeping, and the
+  // fraction denominator must be a power of two.  The Timer1 scheme
+  // has no overflows, and the longer compare period has to fit too.
+  result = (tc->limOflows >= ((tc->timer1) ? 0 : 1) &&
+            tc->limOflows + 1 <= 255 &&
+            !(tc->timer1 && (tc->limOflows != 0 || tc->limRemain > 255)) &&
+            tc->limRemain >= 1 && tc->limRemain <= 256 &&
+            tc->denomFrac != 0 &&
+            (tc->denomFrac & (tc->denomFrac - 1)) == 0 &&
+            tc->numerFrac < tc->denomFrac &&
+            !(tc->limRemain == 256 && tc->numerFrac != 0));
+  halfSecCycles = ((uint64_t)(tc->limOflows * 256 + tc->limRemain) *
+                   tc->denomFrac + tc->numerFrac) * tc->prescaler;
+  result &= (halfSecCycles == (uint64_t)tc->fCpu / 2 * tc->denomFrac);
+  simCall(simTimerReadPrescaler);
+  result &= ((g_simTimerPrescaler << g_simTimerClkps) ==
+             tc->prescaler << tc->clkps);
+  recTsResult(result, "Timer constants");
+}
+
+/* Measure the period of the 1-second interrupt line in simulated
+   time.  Measure long enough that getting the fractional tick
+   corrections wrong would add up to more than the jitter of the
+   edges, one prescaler tick each plus interrupt latency, plus one
+   more tick for a clock switch right before the first edge.  */
+void tsSec1Period(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const unsigned numSecs = 16;
+  const struct SimTimerConsts *tc = &g_simTimerConsts;
+  uint64_t actual, expect, tolerance;
+  int64_t diff;
+  if (g_phyMode || !g_simVirtTime || !tc->valid) {
+    recTsSkip("1-second interrupt period");
+    return;
+  }
+  expect = (uint64_t)numSecs * 1000000000;
+  tolerance = (uint64_t)(3 * tc->prescaler + 200) * 1000000000 / tc->fCpu;
+  actual = simMeasureSec1(numSecs);
+  diff = (int64_t)(actual - expect);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("%u seconds: %llu ns, expected %llu\n", numSecs,
+           (unsigned long long)actual, (unsigned long long)expect);
+  }
+  recTsResult(actual != 0 && diff <= (int64_t)tolerance &&
+              diff >= -(int64_t)tolerance,
+              "1-second interrupt period");
+
+  /* Every single period must be right too, not only their sum.  A
+     half-second counted twice, or a timer that runs on to 255 before
+     wrapping around, is off by far more than the tolerance.  */
+  {
+    uint64_t minNs, maxNs;
+    bool8_t result = simMeasureSec1Each(numSecs, &minNs, &maxNs);
+    if (verbose && result) {
+      prTsStat("INFO:");
+      printf("each second: %llu to %llu ns\n",
+             (unsigned long long)minNs, (unsigned long long)maxNs);
+    }
+    result &= (minNs + tolerance >= 1000000000 &&
+               maxNs <= 1000000000 + tolerance);
+    recTsResult(result, "Each 1-second interrupt period");
+  }
+}
+
+/* Measure how often the AVR wakes up while it is idle, and how long it
+   stays awake, and extrapolate to an hour.  Timekeeping should take
+   one wakeup per timer interrupt and no more, which is one per Timer0
+   overflow or one per half-second with Timer1.  */
+void tsWakeups(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const unsigned numSecs = 16;
+  const struct SimTimerConsts *tc = &g_simTimerConsts;
+  struct SimPowerStats start;
+  unsigned long wakeups, expect;
+  uint64_t activeCycles, activeNs, ns;
+  if (g_phyMode || !g_simVirtTime || !tc->valid) {
+    recTsSkip("Idle wakeups");
+    return;
+  }
+  // Don't count EEPROM write-back left over from PRAM writes.
+  if (g_simPersist.valid)
+    simWaitPersist(20000000);
+  // Start from a quiet point right after a half-second.
+  simCall(simSec1Read);
+  simWaitSec1Count(g_simSec1ReadCount + 1, 2000000);
+  simCall(simPowerRead);
+  start = g_simPowerRead;
+  simWaitUsec(numSecs * 1000000);
+  simCall(simPowerRead);
+  wakeups = g_simPowerRead.wakeups - start.wakeups;
+  activeCycles = g_simPowerRead.activeCycles - start.activeCycles;
+  activeNs = g_simPowerRead.activeNs - start.activeNs;
+  ns = g_simPowerRead.ns - start.ns;
+  expect = 2 * numSecs * (tc->limOflows + 1);
+  prTsStat("INFO:");
+  printf("Timer%d: %.0f wakeups/hour, %.0f active cycles/hour, "
+         "%.3f s awake/hour\n", (tc->timer1) ? 1 : 0,
+         wakeups * 3600e9 / ns, activeCycles * 3600e9 / ns,
+         activeNs * 3600.0 / ns);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("%lu wakeups in %u seconds, expected %lu\n",
+           wakeups, numSecs, expect);
+  }
+  // Allow for a wakeup or two of slack at either end.
+  recTsResult(wakeups >= expect - 2 && wakeups <= expect + 2,
+              "Idle wakeups");
+}
+
+/* Wiggle the serial clock while the RTC is deselected, then let it
+   sit idle.  The serial clock must not wake up the AVR in standby, so
+   only the timer interrupts do.  Also report the time spent in each
+   power state and the estimated standby supply current.  */
+void tsStandby(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const unsigned numSecs = 16;
+  const struct SimTimerConsts *tc = &g_simTimerConsts;
+  struct SimResidency startRes, res;
+  unsigned long startWakeups, wakeups, expect;
+  unsigned i;
+  if (g_phyMode || !g_simVirtTime || !tc->valid) {
+    recTsSkip("Standby");
+    return;
+  }
+  viaBitWrite(vBase + vDirB, rtcEnb, DIR_OUT);
+  viaBitWrite(vBase + vDirB, rtcClk, DIR_OUT);
+  viaBitWrite(vBase + vBufB, rtcEnb, 1);
+  if (g_simPersist.valid)
+    simWaitPersist(20000000);
+  simCall(simSec1Read);
+  simWaitSec1Count(g_simSec1ReadCount + 1, 2000000);
+  simCall(simPowerRead);
+  startWakeups = g_simPowerRead.wakeups;
+  simCall(simResRead);
+  startRes = g_simResRead;
+  for (i = 0; i < 64; i++) {
+    viaBitWrite(vBase + vBufB, rtcClk, 1);
+    waitHalfCycle();
+    viaBitWrite(vBase + vBufB, rtcClk, 0);
+    waitHalfCycle();
+  }
+  simWaitUsec(numSecs * 1000000);
+  simCall(simPowerRead);
+  wakeups = g_simPowerRead.wakeups - startWakeups;
+  simCall(simResRead);
+  simResDiff(&res, &g_simResRead, &startRes);
+  // The serial clock wiggling takes well under a second.
+  expect = 2 * (numSecs + 1) * (tc->limOflows + 1);
+  prTsStat("INFO:");
+  printf("standby power state residency:\n");
+  simResReport(&res);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("%lu wakeups, expected at most %lu\n", wakeups, expect);
+  }
+  recTsResult(wakeups <= expect + 2, "Standby");
+}
+
+/* Set the clock right before a carry into byte 1, then read it over
+   and over in fast time read mode as it ticks over.  With the seconds
+   counter latched, every read must be consistent: never going
+   backwards and never further ahead than the time elapsed.  A torn
+   read, byte 0 from before the carry and byte 1 from after it, would
+   be 256 seconds ahead.  */
+void tsFastTimeRead(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const uint32_t startSecs = 0x123456fe;
+  bool8_t oldFast = getFastTimeRead();
+  bool8_t result = true;
+  uint32_t lastSecs = startSecs;
+  unsigned i;
+  // Transaction-level reads take no simulated time at all.
+  if (!oldFast || g_simTlMode) {
+    recTsSkip("Fast time read");
+    return;
+  }
+  setTime(startSecs);
+  for (i = 0; i < 100 && result && lastSecs < startSecs + 3; i++) {
+    uint32_t curSecs;
+    dumpTime();
+    curSecs = getTime();
+    if (curSecs < lastSecs || curSecs > startSecs + 5) {
+      if (verbose) {
+        prTsStat("INFO:");
+        printf("read 0x%08x after 0x%08x\n", curSecs, lastSecs);
+      }
+      result = false;
+    }
+    lastSecs = curSecs;
+  }
+  // The reads must have spanned the carry.
+  result &= (lastSecs >= startSecs + 3);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("%u reads, 0x%08x to 0x%08x\n", i, startSecs, lastSecs);
+  }
+  recTsResult(result, "Fast time read");
+}
+
+/* Check that the firmware slows its system clock down while it is
+   idle, and that it is back at full speed by the time the host clocks
+   in the first bit of a command.  */
+void tsClockScaling(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const struct SimTimerConsts *tc = &g_simTimerConsts;
+  bool8_t result;
+  byte i;
+  if (g_phyMode || g_simTlMode || tc->idleClkps == tc->clkps) {
+    recTsSkip("Dynamic clock scaling");
+    return;
+  }
+  simCall(simClkResetCounts);
+  for (i = 0; i < 4; i++)
+    genSendReadCmd(0x10 + i);
+  // Give the RTC a moment to go back to sleep.
+  simWaitUsec(10000);
+  simCall(simClkRead);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("%lu clock switches, %lu slow CLK edges, idle CLKPS %u\n",
+           g_simClkRead.switches, g_simClkRead.slowEdges,
+           g_simClkRead.clkps);
+  }
+  result = (g_simClkRead.switches >= 8 && g_simClkRead.slowEdges == 0 &&
+            g_simClkRead.clkps == tc->idleClkps);
+  recTsResult(result, "Dynamic clock scaling");
+}
+
+/* Do a test write, just because we can.  Yes, even though it does
+   absolutely nothing.  */
+void tsTestWrite(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  bool8_t result = false;
+  testWrite();
+  result = true;
+  recTsResult(result, "Test write");
+}
+
+void tsReadClock(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  if (!simRealTime)
+    recTsSkip("Read clock registers");
+  else {
+    /* Read the clock registers into host memory to sync our time.  */
+    bool8_t result = dumpTime();
+    recTsResult(result, "Read clock registers");
+  }
+}
+
+void tsWriteClock(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  if (!simRealTime)
+    recTsSkip("Write and read clock time registers");
+  else {
+    /* Test writing and reading all bytes of the clock time in seconds
+       register.  Code that doesn't properly cast to long can result
+       in inability to write the high-order bytes.  The RTC commits
+       all four bytes at once and restarts the half-second when it
+       does, so there's no tick until well after we've read the time
+       back.  */
+    bool8_t result;
+    uint32_t testTimeSecs = 0x983b80d5;
+    uint32_t readTimeSecs;
+    setTime(testTimeSecs);
+    dumpTime();
+    readTimeSecs = getTime();
+    if (verbose) {
+      prTsStat("INFO:");
+      printf("0x%08x ?= 0x%08x\n", readTimeSecs, testTimeSecs);
+    }
+    result = (readTimeSecs == testTimeSecs);
+    recTsResult(result, "Write and read clock time registers");
+  }
+}
+
+/* Clock byte writes must not take effect until the most significant
+   byte is written.  */
+void tsShadowClockWrite(bool8_t verbose, bool8_t simRealTime,
+                        bool8_t testXPram)
+{
+  if (!simRealTime)
+    recTsSkip("Shadowed clock register writes");
+  else {
+    bool8_t result;
+    uint32_t readTimeSecs1, readTimeSecs2;
+    setTime(0x11223344);
+    sendWriteCmd(0x00, 0x99); // byte 0 only
+    dumpTime();
+    readTimeSecs1 = getTime();
+    sendWriteCmd(0x0c, 0x11); // byte 3 commits
+    dumpTime();
+    readTimeSecs2 = getTime();
+    if (verbose) {
+      prTsStat("INFO:");
+      printf("0x%08x ?= 0x%08x, 0x%08x ?= 0x%08x\n",
+             readTimeSecs1, 0x11223344, readTimeSecs2, 0x11223399);
+    }
+    result = (readTimeSecs1 == 0x11223344 && readTimeSecs2 == 0x11223399);
+    recTsResult(result, "Shadowed clock register writes");
+  }
+
+  /* The same through the host copy, which must agree with the RTC:
+     writing byte 0 alone changes neither, and byte 3 commits both.  */
+  if (!simRealTime)
+    recTsSkip("Host copy of shadowed clock writes");
+  else {
+    bool8_t result;
+    uint32_t hostSecs1, hostSecs2, readTimeSecs1, readTimeSecs2;
+    setTime(0x11223344);
+    hostTradCmd(0x00, 0x99); // byte 0 only, no commit
+    hostSecs1 = getTime();
+    dumpTime();
+    readTimeSecs1 = getTime();
+    hostTradCmd(0x0c, 0x11); // byte 3 commits
+    hostSecs2 = getTime();
+    dumpTime();
+    readTimeSecs2 = getTime();
+    if (verbose) {
+      prTsStat("INFO:");
+      printf("host 0x%08x, RTC 0x%08x ?= 0x%08x\n",
+             hostSecs1, readTimeSecs1, 0x11223344);
+      prTsStat("INFO:");
+      printf("host 0x%08x, RTC 0x%08x ?= 0x%08x\n",
+             hostSecs2, readTimeSecs2, 0x11223399);
+    }
+    result = (hostSecs1 == 0x11223344 && readTimeSecs1 == 0x11223344 &&
+              hostSecs2 == 0x11223399 && readTimeSecs2 == 0x11223399);
+    recTsResult(result, "Host copy of shadowed clock writes");
+  }
+}
+
+/* Set/clear write-protect, test seconds registers, traditional
+   PRAM, and XPRAM writes and reads with write-protect set and
+   clear.  */
+void tsWriteProtect(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  bool8_t result = false;
+  byte oldVal, newVal, actualVal;
+  setWriteProtect();
+  oldVal = genSendReadCmd(0x07);
+  newVal = ~oldVal;
+  genSendWriteCmd(0x07, newVal);
+  actualVal = genSendReadCmd(0x07);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("0x%02x ?!= 0x%02x\n", actualVal, newVal);
+  }
+  result = (actualVal != newVal);
+  recTsResult(result,
+              "Clock register write nulled with write-protect enabled");
+
+  clearWriteProtect();
+  oldVal = genSendReadCmd(0x07);
+  newVal = ~oldVal;
+  genSendWriteCmd(0x07, newVal);
+  actualVal = genSendReadCmd(0x07);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("0x%02x ?= 0x%02x\n", actualVal, newVal);
+  }
+  result = (actualVal == newVal);
+  recTsResult(result,
+              "Clock register write with write-protect disabled");
+
+  setWriteProtect();
+  oldVal = genSendReadCmd(0x08);
+  newVal = ~oldVal;
+  genSendWriteCmd(0x08, newVal);
+  actualVal = genSendReadCmd(0x08);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("0x%02x ?!= 0x%02x\n", actualVal, newVal);
+  }
+  result = (actualVal != newVal);
+  recTsResult(result,
+              "Traditional PRAM write nulled with write-protect enabled");
+
+  clearWriteProtect();
+  oldVal = genSendReadCmd(0x08);
+  newVal = ~oldVal;
+  genSendWriteCmd(0x08, newVal);
+  actualVal = genSendReadCmd(0x08);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("0x%02x ?= 0x%02x\n", actualVal, newVal);
+  }
+  result = (actualVal == newVal);
+  recTsResult(result,
+              "Traditional PRAM write with write-protect disabled");
+
+  if (!testXPram)
+    recTsSkip("XPRAM write nulled with write-protect enabled");
+  else {
+    setWriteProtect();
+    oldVal = genSendReadXCmd(0x30);
+    newVal = ~oldVal;
+    genSendWriteXCmd(0x30, newVal);
+    actualVal = genSendReadXCmd(0x30);
+    if (verbose) {
+      prTsStat("INFO:");
+      printf("0x%02x ?!= 0x%02x\n", actualVal, newVal);
+    }
+    result = (actualVal != newVal);
+    recTsResult(result,
+                "XPRAM write nulled with write-protect enabled");
+  }
+
+  if (!testXPram)
+    recTsSkip("XPRAM write with write-protect disabled");
+  else {
+    clearWriteProtect();
+    oldVal = genSendReadXCmd(0x30);
+    newVal = ~oldVal;
+    genSendWriteXCmd(0x30, newVal);
+    actualVal = genSendReadXCmd(0x30);
+    if (verbose) {
+      prTsStat("INFO:");
+      printf("0x%02x ?= 0x%02x\n", actualVal, newVal);
+    }
+    result = (actualVal == newVal);
+    recTsResult(result,
+                "XPRAM write with write-protect disabled");
+  }
+}
+
+/* Test for expected memory overlap behavior for memory regions
+   sharaed in common in both traditional PRAM and XPRAM.  Only
+   applicable to XPRAM.  */
+void tsMemOverlap(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  bool8_t result = true;
+  byte groupVal, xpramVal;
+
+  clearWriteProtect();
+  if (!testXPram)
+    recTsSkip("Group 1 and XPRAM memory overlap");
+  else {
+    groupVal = genSendReadCmd(0x10);
+    xpramVal = genSendReadXCmd(0x10);
+    if (verbose) {
+      prTsStat("INFO:");
+      printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
+    }
+    result &= (groupVal == xpramVal);
+    genSendWriteCmd(0x10, ~groupVal);
+    groupVal = genSendReadCmd(0x10);
+    xpramVal = genSendReadXCmd(0x10);
+    if (verbose) {
+      prTsStat("INFO:");
+      printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
+    }
+    result &= (groupVal == xpramVal);
+    recTsResult(result,
+                "Group 1 and XPRAM memory overlap");
+  }
+
+  if (!testXPram)
+    recTsSkip("Group 2 and XPRAM memory overlap");
+  else {
+    result = true;
+    groupVal = genSendReadCmd(0x08);
+    xpramVal = genSendReadXCmd(0x08);
+    if (verbose) {
+      prTsStat("INFO:");
+      printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
+    }
+    result &= (groupVal == xpramVal);
+    genSendWriteCmd(0x08, ~groupVal);
+    groupVal = genSendReadCmd(0x08);
+    xpramVal = genSendReadXCmd(0x08);
+    if (verbose) {
+      prTsStat("INFO:");
+      printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
+    }
+    result &= (groupVal == xpramVal);
+    recTsResult(result, "Group 2 and XPRAM memory overlap");
+  }
+}
+
+void tsSec1ClockIncr(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
 {
-  suiteStart();
-
-  // Use a non-deterministic seed for randomized tests... but print
-  // out the value just in case we want to go deterministic.
-  time_t seed = time(NULL);
-  prTsStat("INFO:");
-  printf("random seed = 0x%08x\n", seed);
-  srand(seed);
-
   if (!simRealTime)
-    recTsSkip("1-second interrupt line");
+    recTsSkip("Consistent 1-second interrupt and clock register"
+              "increment");
   else {
-    /* Listen for 1-second ping, compare with host clock to verify
-       second counting is working correctly.  */
+    /* Test that we can read the contents of the clock, wait a few
+       seconds, incrementing on the one-second interrupt, then read
+       the clock register again.  The values should match
+       equivalently.  */
     bool8_t result = false;
     uint8_t tries = 0;
     // Retry up to one time simply because we might cross a one-second
     // time boundary intermittently.
     do {
-      // Check that the 1-second line interrupt is working as expected
-      // for three seconds.
       uint32_t expectTimeSecs, actualTimeSecs;
+      // Two one-second waits in succession, followed by a
+      // three-second wait.
+      dumpTime();
+      waitOneSec();
       expectTimeSecs = getTime();
-      waitOneSec(); expectTimeSecs++;
-      actualTimeSecs = getTime();
+      dumpTime(); actualTimeSecs = getTime();
       if (verbose) {
         prTsStat("INFO:");
         printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
@@ -2474,8 +5882,9 @@ bool8_t autoTestSuite(bool8_t verbose, bool8_t simRealTime,
       result = (expectTimeSecs == actualTimeSecs);
       if (!result)
         continue;
-      waitOneSec(); expectTimeSecs++;
-      actualTimeSecs = getTime();
+      waitOneSec();
+      expectTimeSecs = getTime();
+      dumpTime(); actualTimeSecs = getTime();
       if (verbose) {
         prTsStat("INFO:");
         printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
@@ -2483,8 +5892,11 @@ bool8_t autoTestSuite(bool8_t verbose, bool8_t simRealTime,
       result = (expectTimeSecs == actualTimeSecs);
       if (!result)
         continue;
-      waitOneSec(); expectTimeSecs++;
-      actualTimeSecs = getTime();
+      waitOneSec();
+      waitOneSec();
+      waitOneSec();
+      expectTimeSecs = getTime();
+      dumpTime(); actualTimeSecs = getTime();
       if (verbose) {
         prTsStat("INFO:");
         printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
@@ -2493,436 +5905,942 @@ bool8_t autoTestSuite(bool8_t verbose, bool8_t simRealTime,
       if (!result)
         continue;
     } while (!result && ++tries < 2);
-    recTsResult(result, "1-second interrupt line");
+    recTsResult(result,
+                "Consistent interrupt and clock register increment");
   }
+}
 
-  { /* Do a test write, just because we can.  Yes, even though it does
-       absolutely nothing.  */
-    bool8_t result = false;
-    testWrite();
-    result = true;
-    recTsResult(result, "Test write");
+/* Write/read memory regions randomly and verify expected memory
+   behavior.  */
+void tsRandomMem(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  bool8_t result = true;
+  /* Suitable traditional PRAM address range for testing, keep out
+     of the clock, write-protect, test write, and extended command
+     registers:
+     0x08 - 0x0b
+     0x10 - 0x1f
+     Total 20 bytes
+
+     Select 8 bytes at random for testing.
+  */
+  byte src_addrs[256];
+  uint16_t src_addrs_len = 0;
+  byte rnd_addrs[64], rnd_data[64];
+  byte rnd_len = 0;
+  byte i;
+  clearWriteProtect();
+  // Draw and remove from a source address pool, this guarantees we
+  // don't pick the same address twice.
+  while (src_addrs_len < 20) {
+    byte pick = 8 + src_addrs_len;
+    if (pick >= 0x0c)
+      pick += 4;
+    src_addrs[src_addrs_len++] = pick;
   }
-
-  if (!simRealTime)
-    recTsSkip("Read clock registers");
-  else {
-    /* Read the clock registers into host memory to sync our time.  */
-    bool8_t result = dumpTime();
-    recTsResult(result, "Read clock registers");
+  while (rnd_len < 8) {
+    byte pick = rand() % src_addrs_len;
+    rnd_addrs[rnd_len] = src_addrs[pick];
+    src_addrs[pick] = src_addrs[--src_addrs_len];
+    rnd_data[rnd_len] = rand() & 0xff;
+    genSendWriteCmd(rnd_addrs[rnd_len], rnd_data[rnd_len]);
+    rnd_len++;
+  }
+  while (rnd_len > 0) {
+    // Pick an element randomly, read-verify it, then delete it from
+    // the list by overwriting it with the last element.
+    byte pick = rand() % rnd_len;
+    byte actualVal = genSendReadCmd(rnd_addrs[pick]);
+    if (verbose) {
+      prTsStat("INFO:");
+      printf("0x%02x: 0x%02x ?= 0x%02x\n", rnd_addrs[pick],
+             actualVal, rnd_data[pick]);
+    }
+    result &= (actualVal == rnd_data[pick]);
+    rnd_len--;
+    rnd_addrs[pick] = rnd_addrs[rnd_len];
+    rnd_data[pick] = rnd_data[rnd_len];
   }
+  recTsResult(result,
+              "Random traditional PRAM register write/read");
 
-  if (!simRealTime)
-    recTsSkip("Write and read clock time registers");
+  if (!testXPram)
+    recTsSkip("Random XPRAM register write/read");
   else {
-    /* Test writing and reading all bytes of the clock time in seconds
-       register.  Code that doesn't properly cast to long can result
-       in inability to write the high-order bytes.  */
-    bool8_t result = false;
-    uint8_t tries = 0;
-    // Retry up to one time simply because we might cross a one-second
-    // time boundary intermittently.
-    do {
-      uint32_t testTimeSecs = 0x983b80d5;
-      uint32_t readTimeSecs;
-      setTime(testTimeSecs);
-      dumpTime();
-      readTimeSecs = getTime();
+    result = true;
+    src_addrs_len = 0;
+    // Draw and remove from a source address pool, this guarantees we
+    // don't pick the same address twice.
+    while (src_addrs_len < 256) {
+      src_addrs[src_addrs_len] = src_addrs_len;
+      src_addrs_len++;
+    }
+    while (rnd_len < 64) {
+      byte pick = rand() % src_addrs_len;
+      rnd_addrs[rnd_len] = src_addrs[pick];
+      src_addrs[pick] = src_addrs[--src_addrs_len];
+      rnd_data[rnd_len] = rand() & 0xff;
+      genSendWriteXCmd(rnd_addrs[rnd_len], rnd_data[rnd_len]);
+      rnd_len++;
+    }
+    while (rnd_len > 0) {
+      // Pick an element randomly, read-verify it, then delete it from
+      // the list by overwriting it with the last element.
+      byte pick = rand() % rnd_len;
+      byte actualVal = genSendReadXCmd(rnd_addrs[pick]);
       if (verbose) {
         prTsStat("INFO:");
-        printf("0x%08x ?= 0x%08x\n", readTimeSecs, testTimeSecs);
+        printf("0x%02x: 0x%02x ?= 0x%02x\n", rnd_addrs[pick],
+               actualVal, rnd_data[pick]);
       }
-      result = (readTimeSecs == testTimeSecs);
-    } while (!result && ++tries < 2);
-    recTsResult(result, "Write and read clock time registers");
+      result &= (actualVal == rnd_data[pick]);
+      rnd_len--;
+      rnd_addrs[pick] = rnd_addrs[rnd_len];
+      rnd_data[pick] = rnd_data[rnd_len];
+    }
+    recTsResult(result, "Random XPRAM register write/read");
   }
+}
 
-  { /* Set/clear write-protect, test seconds registers, traditional
-       PRAM, and XPRAM writes and reads with write-protect set and
-       clear.  */
-    bool8_t result = false;
-    byte oldVal, newVal, actualVal;
-    setWriteProtect();
-    oldVal = genSendReadCmd(0x07);
-    newVal = ~oldVal;
-    genSendWriteCmd(0x07, newVal);
-    actualVal = genSendReadCmd(0x07);
+/* Load and dump and memory linearly, compare for expected memory
+   behavior.  */
+void tsLoadDumpMem(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  bool8_t result = false;
+  uint8_t oldMonMode = getMonMode();
+  byte expectedXPram[256];
+  uint16_t i;
+
+  result = true;
+  setMonMode(2);
+  // Randomly initialize group 1 registers.
+  for (i = 0; i < 16; i++)
+    expectedXPram[GROUP1_BASE+i] = rand() & 0xff;
+  // Randomly initialize group 2 registers.
+  for (i = 0; i < 4; i++)
+    expectedXPram[GROUP2_BASE+i] = rand() & 0xff;
+  // Copy both groups to RTC.
+  memcpy(hostPram + GROUP1_BASE, expectedXPram + GROUP1_BASE, 16);
+  memcpy(hostPram + GROUP2_BASE, expectedXPram + GROUP2_BASE, 4);
+  if (verbose) {
+    prTsStat("INFO:Expected data:\n");
+    execMonLine("0008.001f\n");
+  }
+  loadAllTradMem();
+  // Zero our host copy to be sure we don't compare stale data.
+  memset(hostPram + GROUP1_BASE, 0, 16);
+  memset(hostPram + GROUP2_BASE, 0, 4);
+  dumpAllTradMem();
+  if (verbose) {
+    prTsStat("INFO:Actual data:\n");
+    execMonLine("0008.001f\n");
+  }
+  result &= (memcmp(hostPram + GROUP1_BASE,
+                    expectedXPram + GROUP1_BASE, 16) == 0);
+  result &= (memcmp(hostPram + GROUP2_BASE,
+                    expectedXPram + GROUP2_BASE, 4) == 0);
+  recTsResult(result, "Load and dump traditional PRAM");
+
+  if (!testXPram)
+    recTsSkip("Load and dump XPRAM");
+  else {
+    setMonMode(2);
+    for (i = 0; i < 256; i++)
+      expectedXPram[i] = rand() & 0xff;
+    memcpy(hostPram, expectedXPram, 256);
     if (verbose) {
-      prTsStat("INFO:");
-      printf("0x%02x ?!= 0x%02x\n", actualVal, newVal);
+      prTsStat("INFO:Expected data:\n");
+      execMonLine("0000.00ff\n");
     }
-    result = (actualVal != newVal);
-    recTsResult(result,
-                "Clock register write nulled with write-protect enabled");
+    loadAllXMem();
+    // Zero our host copy to be sure we don't compare stale data.
+    memset(hostPram, 0, 256);
+    dumpAllXMem();
+    if (verbose) {
+      prTsStat("INFO:Actual data:\n");
+      execMonLine("0000.00ff\n");
+    }
+    result = (memcmp(hostPram, expectedXPram, 256) == 0);
+    recTsResult(result, "Load and dump XPRAM");
+  }
 
+  setMonMode(oldMonMode);
+}
+
+/* Write a burst that wraps around the end of XPRAM, check it with
+   single-byte reads, then check a burst read against single-byte
+   writes.  Also check that a write-protected burst doesn't change
+   anything.  */
+void tsBurstXPram(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const byte startAddr = 0xf0;
+  const uint16_t count = 32;
+  byte expected[32], actual[32];
+  bool8_t result = true;
+  uint16_t i;
+  if (!testXPram || !getBurstXPram()) {
+    recTsSkip("Burst XPRAM transfers");
+    return;
+  }
+
+  clearWriteProtect();
+  for (i = 0; i < count; i++)
+    expected[i] = rand() & 0xff;
+  memcpy(actual, expected, count);
+  pramBurst(startAddr, actual, count, true);
+  for (i = 0; i < count; i++)
+    actual[i] = genSendReadXCmd(startAddr + i);
+  result &= (memcmp(actual, expected, count) == 0);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("burst write then single reads: %s\n",
+           result ? "match" : "MISMATCH");
+  }
+
+  for (i = 0; i < count; i++) {
+    expected[i] = rand() & 0xff;
+    genSendWriteXCmd(startAddr + i, expected[i]);
+  }
+  memset(actual, 0, count);
+  pramBurst(startAddr, actual, count, false);
+  result &= (memcmp(actual, expected, count) == 0);
+
+  setWriteProtect();
+  for (i = 0; i < count; i++)
+    actual[i] = ~expected[i];
+  pramBurst(startAddr, actual, count, true);
+  clearWriteProtect();
+  pramBurst(startAddr, actual, count, false);
+  result &= (memcmp(actual, expected, count) == 0);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("burst read and write-protected burst: %s\n",
+           result ? "match" : "MISMATCH");
+  }
+  recTsResult(result, "Burst XPRAM transfers");
+}
+
+/* Send invalid communication bit sequence, de-select, re-select
+   chip, then send a valid communication sequence.  Verify that
+   chip can robustly recover from invalid communication
+   sequences.
+
+   It turns out that the protocol is actually quite robust, the
+   only way to potentially cause an invalid communication state
+   would be to disable the chip-enable line before a communication
+   sequence is complete.  */
+void tsBadComm(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  bool8_t result = false;
+  byte testVal;
+  clearWriteProtect();
+  genSendWriteCmd(0x10, 0xcd);
+  serialBegin();
+  { /* Fragmented sendByte() that would otherwise clobber the byte
+       we just wrote.  Send only 6 out of 8 bits.  */
+    uint8_t data = genCmd(0x10, true);
+    uint8_t bitNum = 0;
+    viaBitWrite(vBase + vDirB, rtcData, DIR_OUT);
+    while (bitNum <= 5) {
+      uint8_t bit = (data >> (7 - bitNum)) & 1;
+      bitNum++;
+      viaBitWrite(vBase + vBufB, rtcData, bit);
+      waitQuarterCycle();
+      viaBitWrite(vBase + vBufB, rtcClk, 1);
+      waitHalfCycle();
+      viaBitWrite(vBase + vBufB, rtcClk, 0);
+      waitQuarterCycle();
+    }
+  }
+  serialEnd();
+  testVal = genSendReadCmd(0x10);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("0x%02x ?= 0x%02x\n", testVal, 0xcd);
+  }
+  result = (testVal == 0xcd);
+  recTsResult(result, "Recovery from invalid communication");
+}
+
+/* Fuzzer input replay.  Play an input saved by `fuzz-core`, see
+   `fuzz-edges.h`, at the bit level, with the same timing as
+   `sendByte()`, then check the same recovery invariants as the
+   fuzzer: after CE goes high, the RTC is idle and has released the
+   data line, and it answers a valid command.  */
+
+uint8_t g_replayState;
+
+void replayGetStateCall(void)
+{
+  simSettle();
+  g_replayState = (g_simLatStateAddr) ? avr->data[g_simLatStateAddr] : 0;
+}
+
+void replayEdge(byte ev)
+{
+  bool8_t batch = simBatchBegin();
+  if (EDGE_IS_CLK(ev)) {
+    if (EDGE_CLK_RELEASE(ev))
+      viaBitWrite(vBase + vDirB, rtcData, DIR_IN);
+    else {
+      viaBitWrite(vBase + vDirB, rtcData, DIR_OUT);
+      viaBitWrite(vBase + vBufB, rtcData, EDGE_CLK_DATA(ev));
+    }
+    waitQuarterCycle();
+    viaBitWrite(vBase + vBufB, rtcClk, 1);
+    waitHalfCycle();
+    viaBitWrite(vBase + vBufB, rtcClk, 0);
+    waitQuarterCycle();
+  } else {
+    switch (EDGE_OP(ev)) {
+    case EDGE_CE_HIGH:
+    case EDGE_CE_LOW:
+      viaBitWrite(vBase + vBufB, rtcEnb, EDGE_OP(ev) == EDGE_CE_HIGH);
+      waitQuarterCycle();
+      break;
+    default:
+      // The RTC keeps its own time, just let half a second pass.
+      if (g_phyMode)
+        phyWaitUsec(500000);
+      else
+        simWaitUsec(500000);
+      break;
+    }
+  }
+  if (batch)
+    simBatchEnd();
+}
+
+/* Replay the fuzzer input in the given file.  Return true if the RTC
+   recovered afterwards.  */
+bool8_t fileReplayEdges(const char *filename)
+{
+  FILE *fp = fopen(filename, "rb");
+  unsigned long numEvents = 0;
+  bool8_t batch;
+  byte sent[2];
+  byte cmd, dataLine;
+  int ch;
+  if (fp == NULL)
+    return false;
+  // Start from an idle bus, as `serialBegin()` would set it up.
+  batch = simBatchBegin();
+  viaBitWrite(vBase + vDirB, rtcEnb, DIR_OUT);
+  viaBitWrite(vBase + vDirB, rtcClk, DIR_OUT);
+  viaBitWrite(vBase + vBufB, rtcClk, 0);
+  viaBitWrite(vBase + vBufB, rtcEnb, 1);
+  waitQuarterCycle();
+  if (batch)
+    simBatchEnd();
+  while ((ch = getc(fp)) != EOF) {
+    replayEdge(ch);
+    numEvents++;
+  }
+  fclose(fp);
+  serialEnd();
+  printf("replayed %lu events\n", numEvents);
+
+  if (!g_phyMode) {
+    simCall(replayGetStateCall);
+    if (g_replayState != 0) {
+      printf("RTC serial state %u after CE high\n", g_replayState);
+      return false;
+    }
+  }
+  batch = simBatchBegin();
+  viaBitWrite(vBase + vDirB, rtcData, DIR_IN);
+  waitQuarterCycle();
+  dataLine = viaBitSample(vBase + vBufB, rtcData);
+  if (batch)
+    dataLine = simBatchEnd() & 1;
+  if (!dataLine) {
+    fputs("RTC holds the data line low after CE high\n", stdout);
+    return false;
+  }
+  // Write-protect may have been left set, clear it first.
+  sent[0] = genCmd(13, true);
+  sent[1] = 0x00;
+  serialTransact(sent, 2, false);
+  sent[0] = genCmd(16, true);
+  sent[1] = 0xa5;
+  serialTransact(sent, 2, false);
+  cmd = genCmd(16, false);
+  if (serialTransact(&cmd, 1, true) != 0xa5) {
+    fputs("RTC doesn't answer a valid command\n", stdout);
+    return false;
+  }
+  return true;
+}
+
+void tsSnapshot(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  if (g_phyMode)
+    recTsSkip("Simulation snapshot and restore");
+  else {
+    /* Take a snapshot, change PRAM and let the clock run, then
+       restore the snapshot.  Both the RTC and the host state should
+       be back as they were, and the RTC should still respond
+       normally.  */
+    bool8_t result;
+    byte oldVal, testVal;
+    uint32_t oldTimeSecs;
     clearWriteProtect();
-    oldVal = genSendReadCmd(0x07);
-    newVal = ~oldVal;
-    genSendWriteCmd(0x07, newVal);
-    actualVal = genSendReadCmd(0x07);
+    oldVal = genSendReadCmd(0x10);
+    dumpTime();
+    oldTimeSecs = getTime();
+    result = simSnapshot();
+    genSendWriteCmd(0x10, ~oldVal);
+    waitOneSec();
+    result &= simRestore();
+    result &= (getTime() == oldTimeSecs);
+    testVal = genSendReadCmd(0x10);
+    dumpTime();
     if (verbose) {
       prTsStat("INFO:");
-      printf("0x%02x ?= 0x%02x\n", actualVal, newVal);
+      printf("0x%02x ?= 0x%02x, 0x%08x ~= 0x%08x\n", testVal, oldVal,
+             getTime(), oldTimeSecs);
     }
-    result = (actualVal == newVal);
-    recTsResult(result,
-                "Clock register write with write-protect disabled");
+    result &= (testVal == oldVal);
+    // The clock may have ticked once since the snapshot was taken.
+    result &= (getTime() - oldTimeSecs <= 1);
+    recTsResult(result, "Simulation snapshot and restore");
+  }
+}
 
-    setWriteProtect();
-    oldVal = genSendReadCmd(0x08);
-    newVal = ~oldVal;
-    genSendWriteCmd(0x08, newVal);
-    actualVal = genSendReadCmd(0x08);
+/* Check the EEPROM persistence of PRAM.  Repeated writes to a byte
+   before the write-back must coalesce into one journal record, and
+   writes to the byte after each write-back must each get a journal
+   record of their own rather than rewriting one EEPROM cell.  Then
+   fill PRAM with random data, check the saved copy, reset the AVR,
+   and check that it restored PRAM.  Finally, fill the journal with
+   several records per byte, write a byte so that the journal is
+   folded into the image, and reset the AVR halfway through the fold.
+   The image must not get ahead of the journal, so PRAM must come
+   back exactly as it was last saved.  The resets also reset the
+   clock, so this test case comes last.  */
+void tsEepromPersist(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const uint32_t maxUsec = 20000000;
+  bool8_t xpram = testXPram && getPramType();
+  uint16_t fwPramSize = g_simPersist.journal - 1;
+  unsigned numSlots;
+  byte expectedXPram[256], saved[256], oldImage[256];
+  byte testVal;
+  int numRecords, lastRecords;
+  bool8_t result = true;
+  unsigned i, j;
+  if (g_phyMode || !g_simPersist.valid) {
+    recTsSkip("EEPROM write coalescing and wear leveling");
+    recTsSkip("EEPROM persistence across reset");
+    recTsSkip("EEPROM persistence across reset mid-fold");
+    return;
+  }
+
+  // The first write-back formats the EEPROM if it isn't yet.
+  clearWriteProtect();
+  genSendWriteCmd(16 + 3, ~genSendReadCmd(16 + 3));
+  result &= simWaitPersist(maxUsec);
+  simCall(simPersistRead);
+  numSlots = (g_simEepromSize - g_simPersist.journal) / 2;
+  lastRecords = simPersistDecode(saved, fwPramSize);
+  result &= (lastRecords >= 0);
+  for (i = 0; i < 8 && result; i++) {
+    byte val = 0x20 + i;
+    // The first time around, write the byte over and over.
+    for (j = (i == 0) ? 0 : 7; j < 8; j++)
+      genSendWriteCmd(16 + 3, val + j * 0x10);
+    result &= simWaitPersist(maxUsec);
+    simCall(simPersistRead);
+    numRecords = simPersistDecode(saved, fwPramSize);
+    // Unless the journal was full and has been compacted, there must
+    // be exactly one new record.
+    result &= (numRecords == lastRecords + 1 ||
+               (lastRecords == numSlots && numRecords == 0));
+    result &= (saved[group1Base + 3] == (byte)(val + 0x70));
     if (verbose) {
       prTsStat("INFO:");
-      printf("0x%02x ?!= 0x%02x\n", actualVal, newVal);
+      printf("%d journal records of %u, saved 0x%02x\n",
+             numRecords, numSlots, saved[group1Base + 3]);
     }
-    result = (actualVal != newVal);
-    recTsResult(result,
-                "Traditional PRAM write nulled with write-protect enabled");
+    lastRecords = numRecords;
+  }
+  recTsResult(result, "EEPROM write coalescing and wear leveling");
+
+  result = true;
+  if (xpram) {
+    for (i = 0; i < 256; i++)
+      expectedXPram[i] = rand() & 0xff;
+    memcpy(hostPram, expectedXPram, 256);
+    loadAllXMem();
+  } else {
+    for (i = 0; i < 16; i++)
+      expectedXPram[GROUP1_BASE+i] = rand() & 0xff;
+    for (i = 0; i < 4; i++)
+      expectedXPram[GROUP2_BASE+i] = rand() & 0xff;
+    memcpy(hostPram + GROUP1_BASE, expectedXPram + GROUP1_BASE, 16);
+    memcpy(hostPram + GROUP2_BASE, expectedXPram + GROUP2_BASE, 4);
+    loadAllTradMem();
+  }
+  result &= simWaitPersist(maxUsec);
+  simCall(simPersistRead);
+  result &= (simPersistDecode(saved, fwPramSize) >= 0);
+  simCall(simReboot);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("booted and restored PRAM in %llu cycles\n",
+           (unsigned long long)g_simBootCycles);
+  }
+  // Zero our host copy to be sure we don't compare stale data.
+  if (xpram) {
+    result &= (memcmp(saved, expectedXPram, 256) == 0);
+    memset(hostPram, 0, 256);
+    dumpAllXMem();
+    result &= (memcmp(hostPram, expectedXPram, 256) == 0);
+  } else {
+    result &= (memcmp(saved + group1Base, expectedXPram + GROUP1_BASE,
+                      16) == 0);
+    result &= (memcmp(saved + group2Base, expectedXPram + GROUP2_BASE,
+                      4) == 0);
+    memset(hostPram + GROUP1_BASE, 0, 16);
+    memset(hostPram + GROUP2_BASE, 0, 4);
+    dumpAllTradMem();
+    result &= (memcmp(hostPram + GROUP1_BASE, expectedXPram + GROUP1_BASE,
+                      16) == 0);
+    result &= (memcmp(hostPram + GROUP2_BASE, expectedXPram + GROUP2_BASE,
+                      4) == 0);
+  }
+  recTsResult(result, "EEPROM persistence across reset");
+
+  /* Cycle the records through a few bytes, at most 64, so that each
+     byte has older records that the fold must skip.  */
+  result = true;
+  simCall(simPersistRead);
+  for (i = 0; i < fwPramSize; i++)
+    oldImage[i] = g_simEeprom[i] = rand() & 0xff;
+  g_simEeprom[fwPramSize] = 0x5a ^ (fwPramSize & 0xff);
+  for (i = 0; i < numSlots; i++) {
+    g_simEeprom[g_simPersist.journal + 2 * i] =
+      i % ((fwPramSize < 64) ? fwPramSize : 64);
+    g_simEeprom[g_simPersist.journal + 2 * i + 1] = rand() & 0xff;
+  }
+  result &= (simPersistDecode(saved, fwPramSize) == (int)numSlots);
+  simCall(simPersistWrite);
+  simCall(simReboot);
+  clearWriteProtect();
+  // The journal is full, so this write-back starts with the fold.
+  genSendWriteCmd(16 + 3, ~saved[group1Base + 3]);
+  g_simFoldCutPos = g_simPersist.journal + numSlots;
+  simCall(simPersistCutFold);
+  result &= g_simFoldCut;
+  simCall(simPersistRead);
+  result &= (simPersistDecode(expectedXPram, fwPramSize) == (int)numSlots);
+  result &= (memcmp(expectedXPram, saved, fwPramSize) == 0);
+  // Each image byte is either untouched or folded from its newest
+  // record.
+  j = 0;
+  for (i = 0; i < fwPramSize; i++) {
+    if (g_simEeprom[i] != oldImage[i]) {
+      result &= (g_simEeprom[i] == saved[i]);
+      j++;
+    }
+  }
+  clearWriteProtect();
+  testVal = genSendReadCmd(16 + 3);
+  result &= (testVal == saved[group1Base + 3]);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("reset with %u image bytes folded, 0x%02x ?= 0x%02x\n",
+           j, testVal, saved[group1Base + 3]);
+  }
+  // The next write-back finishes the fold and starts a new journal.
+  genSendWriteCmd(16 + 3, ~saved[group1Base + 3]);
+  result &= simWaitPersist(maxUsec);
+  simCall(simPersistRead);
+  numRecords = simPersistDecode(expectedXPram, fwPramSize);
+  result &= (numRecords >= 1 && numRecords < (int)numSlots);
+  result &= (expectedXPram[group1Base + 3] == (byte)~saved[group1Base + 3]);
+  recTsResult(result, "EEPROM persistence across reset mid-fold");
+}
+
+/* Run a known mix of sessions at the bit level, then check that the
+   telemetry counters add up.  */
+void tsTelemetry(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  struct TelemetryCounts tm;
+  bool8_t result = true;
+  byte sent[2];
+  unsigned i;
+  if (!testXPram || !readTelemetry(&tm)) {
+    recTsSkip("Telemetry counters");
+    return;
+  }
+
+  clearWriteProtect();
+  resetTelemetry();
+  for (i = 0; i < 5; i++) {
+    sent[0] = genCmd(16 + i, false);
+    serialTransact(sent, 1, true);
+  }
+  for (i = 0; i < 3; i++) {
+    sent[0] = genCmd(16 + i, true);
+    sent[1] = rand() & 0xff;
+    serialTransact(sent, 2, false);
+  }
+  // Reading the test register is invalid.
+  sent[0] = genCmd(12, false);
+  serialTransact(sent, 1, true);
+  // End a write command before its data byte.
+  serialBegin();
+  sendByte(genCmd(16, true));
+  serialEnd();
+
+  result &= readTelemetry(&tm);
+  result &= (tm.reads == 5 && tm.writes == 3 && tm.aborts == 1 &&
+             tm.invalid == 1 && tm.slips == 0 && tm.maxLatency < 255);
+  if (verbose) {
+    prTsStat("INFO:");
+    printf("%lu reads, %lu writes, %u aborted, %u invalid, %u slips\n",
+           (unsigned long)tm.reads, (unsigned long)tm.writes,
+           tm.aborts, tm.invalid, tm.slips);
+    prTsStat("INFO:");
+    printf("worst latency %u cycles\n",
+           tm.maxLatency * tm.latencyUnit);
+  }
+  recTsResult(result, "Telemetry counters");
+}
 
-    clearWriteProtect();
-    oldVal = genSendReadCmd(0x08);
-    newVal = ~oldVal;
-    genSendWriteCmd(0x08, newVal);
-    actualVal = genSendReadCmd(0x08);
-    if (verbose) {
-      prTsStat("INFO:");
-      printf("0x%02x ?= 0x%02x\n", actualVal, newVal);
-    }
-    result = (actualVal == newVal);
-    recTsResult(result,
-                "Traditional PRAM write with write-protect disabled");
+/* Command decode cost.  For each class of traditional command, time
+   from the CLK falling edge that completes the command, the last
+   command bit for reads and the last data bit for writes, until the
+   AVR goes back to sleep.  The minimum over several tries leaves out
+   timer interrupts that happen to come in.  Compare the output for
+   builds before and after a change to the decode, it's not checked
+   against any limit.  */
+struct DecodeClass {
+  const char *name;
+  byte addr;
+  bool8_t writeRequest;
+};
 
-    if (!testXPram)
-      recTsSkip("XPRAM write nulled with write-protect enabled");
-    else {
-      setWriteProtect();
-      oldVal = genSendReadXCmd(0x30);
-      newVal = ~oldVal;
-      genSendWriteXCmd(0x30, newVal);
-      actualVal = genSendReadXCmd(0x30);
-      if (verbose) {
-        prTsStat("INFO:");
-        printf("0x%02x ?!= 0x%02x\n", actualVal, newVal);
-      }
-      result = (actualVal != newVal);
-      recTsResult(result,
-                  "XPRAM write nulled with write-protect enabled");
-    }
+const struct DecodeClass g_decodeClasses[] = {
+  { "clock read", 0, false },
+  { "clock write", 1, true }, // shadowed, doesn't commit
+  { "group 2 read", 8, false },
+  { "group 2 write", 8, true },
+  { "group 1 read", 16, false },
+  { "group 1 write", 16, true },
+  { "test write", 12, true },
+  { "write-protect write", 13, true },
+  { "invalid read", 12, false },
+};
 
-    if (!testXPram)
-      recTsSkip("XPRAM write with write-protect disabled");
-    else {
-      clearWriteProtect();
-      oldVal = genSendReadXCmd(0x30);
-      newVal = ~oldVal;
-      genSendWriteXCmd(0x30, newVal);
-      actualVal = genSendReadXCmd(0x30);
-      if (verbose) {
-        prTsStat("INFO:");
-        printf("0x%02x ?= 0x%02x\n", actualVal, newVal);
-      }
-      result = (actualVal == newVal);
-      recTsResult(result,
-                  "XPRAM write with write-protect disabled");
+void tsDecodeCycles(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram)
+{
+  const unsigned numTries = 8;
+  bool8_t result = true;
+  byte sent[2];
+  unsigned i, j;
+  if (g_phyMode) {
+    recTsSkip("Command decode cycles");
+    return;
+  }
+  clearWriteProtect();
+  prTsStat("INFO:");
+  printf("command decode, edge to sleep in cycles at %d Hz:\n",
+         (int)g_simClkNormFreq);
+  for (i = 0; i < ARRAY_SIZE(g_decodeClasses); i++) {
+    const struct DecodeClass *dc = &g_decodeClasses[i];
+    g_simDecodeArmEdge = (dc->writeRequest) ? 16 : 8;
+    simCall(simDecodeArm);
+    for (j = 0; j < numTries; j++) {
+      sent[0] = genCmd(dc->addr, dc->writeRequest);
+      sent[1] = (dc->addr == 13) ? 0x00 : rand() & 0xff;
+      serialTransact(sent, (dc->writeRequest) ? 2 : 1, !dc->writeRequest);
     }
+    simCall(simDecodeRead);
+    g_simDecodeArmEdge = 0;
+    simCall(simDecodeArm);
+    latHistPrint(dc->name, "decode", &g_simDecodeRead);
+    result &= (g_simDecodeRead.count == numTries);
   }
+  recTsResult(result, "Command decode cycles");
+}
 
-  { /* Test for expected memory overlap behavior for memory regions
-       sharaed in common in both traditional PRAM and XPRAM.  Only
-       applicable to XPRAM.  */
-    bool8_t result = true;
-    byte groupVal, xpramVal;
+/* Automated test cases.  Each test case only depends on the state it
+   sets up itself, so that the test cases can be run selectively or in
+   parallel.  */
+struct TestCase {
+  const char *name;
+  void (*run)(bool8_t verbose, bool8_t simRealTime, bool8_t testXPram);
+};
 
-    if (!testXPram)
-      recTsSkip("Group 1 and XPRAM memory overlap");
-    else {
-      groupVal = genSendReadCmd(0x10);
-      xpramVal = genSendReadXCmd(0x10);
-      if (verbose) {
-        prTsStat("INFO:");
-        printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
-      }
-      result &= (groupVal == xpramVal);
-      genSendWriteCmd(0x10, ~groupVal);
-      groupVal = genSendReadCmd(0x10);
-      xpramVal = genSendReadXCmd(0x10);
-      if (verbose) {
-        prTsStat("INFO:");
-        printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
-      }
-      result &= (groupVal == xpramVal);
-      recTsResult(result,
-                  "Group 1 and XPRAM memory overlap");
-    }
+const struct TestCase g_testCases[] = {
+  { "sec1", tsSec1Line },
+  { "test-write", tsTestWrite },
+  { "read-clock", tsReadClock },
+  { "write-clock", tsWriteClock },
+  { "shadow-clock-write", tsShadowClockWrite },
+  { "write-protect", tsWriteProtect },
+  { "mem-overlap", tsMemOverlap },
+  { "sec1-clock", tsSec1ClockIncr },
+  { "random-mem", tsRandomMem },
+  { "load-dump-mem", tsLoadDumpMem },
+  { "burst-xpram", tsBurstXPram },
+  { "bad-comm", tsBadComm },
+  { "snapshot", tsSnapshot },
+  { "timer-consts", tsTimerConsts },
+  { "sec1-period", tsSec1Period },
+  { "clock-scaling", tsClockScaling },
+  { "wakeups", tsWakeups },
+  { "standby", tsStandby },
+  { "fast-time-read", tsFastTimeRead },
+  { "telemetry", tsTelemetry },
+  { "decode-cycles", tsDecodeCycles },
+  { "eeprom-persist", tsEepromPersist },
+};
 
-    if (!testXPram)
-      recTsSkip("Group 2 and XPRAM memory overlap");
-    else {
-      result = true;
-      groupVal = genSendReadCmd(0x08);
-      xpramVal = genSendReadXCmd(0x08);
-      if (verbose) {
-        prTsStat("INFO:");
-        printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
-      }
-      result &= (groupVal == xpramVal);
-      genSendWriteCmd(0x08, ~groupVal);
-      groupVal = genSendReadCmd(0x08);
-      xpramVal = genSendReadXCmd(0x08);
-      if (verbose) {
-        prTsStat("INFO:");
-        printf(" 0x%02x ?= 0x%02x\n", groupVal, xpramVal);
-      }
-      result &= (groupVal == xpramVal);
-      recTsResult(result, "Group 2 and XPRAM memory overlap");
-    }
+#define NUM_TEST_CASES (sizeof(g_testCases) / sizeof(g_testCases[0]))
+
+/* Number of test cases to run in parallel, zero to use one per host
+   CPU.  Only applicable when running under simulation.  */
+unsigned g_suiteJobs = 0;
+// Comma-separated list of test case names to run, NULL to run all.
+const char *g_suiteCases = NULL;
+
+// Return true if the given test case was selected to run.
+bool8_t tsCaseSelected(const char *name)
+{
+  const char *p = g_suiteCases;
+  size_t len = strlen(name);
+  if (p == NULL)
+    return true;
+  while (*p != '\0') {
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return true;
+    p = strchr(p, ',');
+    if (p == NULL)
+      break;
+    p++;
   }
+  return false;
+}
 
-  if (!simRealTime)
-    recTsSkip("Consistent 1-second interrupt and clock register"
-              "increment");
-  else {
-    /* Test that we can read the contents of the clock, wait a few
-       seconds, incrementing on the one-second interrupt, then read
-       the clock register again.  The values should match
-       equivalently.  */
-    bool8_t result = false;
-    uint8_t tries = 0;
-    // Retry up to one time simply because we might cross a one-second
-    // time boundary intermittently.
-    do {
-      uint32_t expectTimeSecs, actualTimeSecs;
-      // Two one-second waits in succession, followed by a
-      // three-second wait.
-      dumpTime();
-      waitOneSec();
-      expectTimeSecs = getTime();
-      dumpTime(); actualTimeSecs = getTime();
-      if (verbose) {
-        prTsStat("INFO:");
-        printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
-      }
-      result = (expectTimeSecs == actualTimeSecs);
-      if (!result)
+/* Run a single test case.  In transaction-level mode, a failed
+   cross-check against the bit level fails the test case too.  */
+void runTestCase(unsigned i, time_t seed, bool8_t verbose,
+                 bool8_t simRealTime, bool8_t testXPram)
+{
+  unsigned long oldMismatches = g_simTlMismatches;
+  srand(seed + i);
+  g_testCases[i].run(verbose, simRealTime, testXPram);
+  if (g_simTlMismatches != oldMismatches)
+    recTsResult(false, "Transaction-level cross-check");
+}
+
+// Print the names of all test cases.
+void listTestCases(void)
+{
+  unsigned i;
+  for (i = 0; i < NUM_TEST_CASES; i++)
+    puts(g_testCases[i].name);
+}
+
+/* Output of a test case that ran in a child process.  The child ends
+   its output with a record separator followed by its pass, fail, and
+   skip counts.  */
+struct TsJob {
+  pid_t pid;
+  int fd;
+  char *out;
+  size_t outLen;
+  bool8_t done;
+};
+
+/* Run the selected test cases in parallel.  Each test case runs in
+   its own child process forked from the current simulation state, so
+   every test case gets its own `avr_t` instance and test bench state.
+   Output is passed through in test case order and the counts are
+   merged into ours.  */
+void runTestCasesParallel(unsigned numJobs, time_t seed, bool8_t verbose,
+                          bool8_t simRealTime, bool8_t testXPram)
+{
+  struct TsJob jobs[NUM_TEST_CASES];
+  unsigned nextStart = 0, nextPrint = 0, running = 0;
+  unsigned i;
+  // The children pass their latency histograms back to us through
+  // shared memory.
+  struct SimLatStats *latStats =
+    (struct SimLatStats *)mmap(NULL, NUM_TEST_CASES * sizeof(*latStats),
+                               PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  memset(jobs, 0, sizeof(jobs));
+  for (i = 0; i < NUM_TEST_CASES; i++)
+    jobs[i].fd = -1;
+
+  while (nextPrint < NUM_TEST_CASES) {
+    struct pollfd fds[NUM_TEST_CASES];
+    unsigned fdJob[NUM_TEST_CASES];
+    unsigned numFds = 0;
+
+    // Start as many test cases as we're allowed to.
+    while (running < numJobs && nextStart < NUM_TEST_CASES) {
+      struct TsJob *job = &jobs[nextStart];
+      int pipefd[2];
+      if (!tsCaseSelected(g_testCases[nextStart].name)) {
+        job->done = true;
+        nextStart++;
         continue;
-      waitOneSec();
-      expectTimeSecs = getTime();
-      dumpTime(); actualTimeSecs = getTime();
-      if (verbose) {
-        prTsStat("INFO:");
-        printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
       }
-      result = (expectTimeSecs == actualTimeSecs);
-      if (!result)
+      if (pipe(pipefd) == -1) {
+        perror("pipe");
+        job->done = true;
+        nextStart++;
         continue;
-      waitOneSec();
-      waitOneSec();
-      waitOneSec();
-      expectTimeSecs = getTime();
-      dumpTime(); actualTimeSecs = getTime();
-      if (verbose) {
-        prTsStat("INFO:");
-        printf("0x%08x ?= 0x%08x\n", expectTimeSecs, actualTimeSecs);
       }
-      result = (expectTimeSecs == actualTimeSecs);
-      if (!result)
-        continue;
-    } while (!result && ++tries < 2);
-    recTsResult(result,
-                "Consistent interrupt and clock register increment");
-  }
-
-  { /* Write/read memory regions randomly and verify expected memory
-       behavior.  */
-    bool8_t result = true;
-    /* Suitable traditional PRAM address range for testing, keep out
-       of the clock, write-protect, test write, and extended command
-       registers:
-       0x08 - 0x0b
-       0x10 - 0x1f
-       Total 20 bytes
-
-       Select 8 bytes at random for testing.
-    */
-    byte src_addrs[256];
-    uint16_t src_addrs_len = 0;
-    byte rnd_addrs[64], rnd_data[64];
-    byte rnd_len = 0;
-    byte i;
-    // Draw and remove from a source address pool, this guarantees we
-    // don't pick the same address twice.
-    while (src_addrs_len < 20) {
-      byte pick = 8 + src_addrs_len;
-      if (pick >= 0x0c)
-        pick += 4;
-      src_addrs[src_addrs_len++] = pick;
-    }
-    while (rnd_len < 8) {
-      byte pick = rand() % src_addrs_len;
-      rnd_addrs[rnd_len] = src_addrs[pick];
-      src_addrs[pick] = src_addrs[--src_addrs_len];
-      rnd_data[rnd_len] = rand() & 0xff;
-      genSendWriteCmd(rnd_addrs[rnd_len], rnd_data[rnd_len]);
-      rnd_len++;
-    }
-    while (rnd_len > 0) {
-      // Pick an element randomly, read-verify it, then delete it from
-      // the list by overwriting it with the last element.
-      byte pick = rand() % rnd_len;
-      byte actualVal = genSendReadCmd(rnd_addrs[pick]);
-      if (verbose) {
-        prTsStat("INFO:");
-        printf("0x%02x: 0x%02x ?= 0x%02x\n", rnd_addrs[pick],
-               actualVal, rnd_data[pick]);
+      fflush(stdout);
+      job->pid = fork();
+      if (job->pid == 0) {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[1]);
+        g_passCount = 0;
+        g_failCount = 0;
+        g_skipCount = 0;
+        simLatReset();
+        runTestCase(nextStart, seed, verbose, simRealTime, testXPram);
+        if (latStats != MAP_FAILED)
+          latStats[nextStart] = g_simLat;
+        printf("\036%d %d %d\n", g_passCount, g_failCount, g_skipCount);
+        fflush(stdout);
+        _exit(0);
       }
-      result &= (actualVal == rnd_data[pick]);
-      rnd_len--;
-      rnd_addrs[pick] = rnd_addrs[rnd_len];
-      rnd_data[pick] = rnd_data[rnd_len];
+      close(pipefd[1]);
+      if (job->pid == -1) {
+        perror("fork");
+        close(pipefd[0]);
+        job->done = true;
+      } else {
+        job->fd = pipefd[0];
+        running++;
+      }
+      nextStart++;
     }
-    recTsResult(result,
-                "Random traditional PRAM register write/read");
 
-    if (!testXPram)
-      recTsSkip("Random XPRAM register write/read");
-    else {
-      result = true;
-      src_addrs_len = 0;
-      // Draw and remove from a source address pool, this guarantees we
-      // don't pick the same address twice.
-      while (src_addrs_len < 256) {
-        src_addrs[src_addrs_len] = src_addrs_len;
-        src_addrs_len++;
-      }
-      while (rnd_len < 64) {
-        byte pick = rand() % src_addrs_len;
-        rnd_addrs[rnd_len] = src_addrs[pick];
-        src_addrs[pick] = src_addrs[--src_addrs_len];
-        rnd_data[rnd_len] = rand() & 0xff;
-        genSendWriteXCmd(rnd_addrs[rnd_len], rnd_data[rnd_len]);
-        rnd_len++;
-      }
-      while (rnd_len > 0) {
-        // Pick an element randomly, read-verify it, then delete it from
-        // the list by overwriting it with the last element.
-        byte pick = rand() % rnd_len;
-        byte actualVal = genSendReadXCmd(rnd_addrs[pick]);
-        if (verbose) {
-          prTsStat("INFO:");
-          printf("0x%02x: 0x%02x ?= 0x%02x\n", rnd_addrs[pick],
-                 actualVal, rnd_data[pick]);
+    // Print out the results of finished test cases, in order.
+    while (nextPrint < NUM_TEST_CASES && jobs[nextPrint].done) {
+      struct TsJob *job = &jobs[nextPrint];
+      if (job->pid > 0) {
+        char *sep = NULL;
+        size_t pos = job->outLen;
+        int pass, fail, skip;
+        while (pos > 0 && sep == NULL) {
+          if (job->out[--pos] == '\036')
+            sep = job->out + pos;
+        }
+        if (sep != NULL &&
+            sscanf(sep + 1, "%d %d %d", &pass, &fail, &skip) == 3) {
+          fwrite(job->out, 1, sep - job->out, stdout);
+          g_passCount += pass;
+          g_failCount += fail;
+          g_skipCount += skip;
+          if (latStats != MAP_FAILED)
+            simLatMerge(&latStats[nextPrint]);
+        } else {
+          // The test case didn't finish.
+          if (job->out != NULL)
+            fwrite(job->out, 1, job->outLen, stdout);
+          recTsResult(false, g_testCases[nextPrint].name);
         }
-        result &= (actualVal == rnd_data[pick]);
-        rnd_len--;
-        rnd_addrs[pick] = rnd_addrs[rnd_len];
-        rnd_data[pick] = rnd_data[rnd_len];
+        free(job->out);
       }
-      recTsResult(result, "Random XPRAM register write/read");
+      nextPrint++;
     }
-  }
-
-  { /* Load and dump and memory linearly, compare for expected memory
-       behavior.  */
-    bool8_t result = false;
-    uint8_t oldMonMode = getMonMode();
-    byte expectedXPram[256];
-    uint16_t i;
 
-    result = true;
-    setMonMode(2);
-    // Randomly initialize group 1 registers.
-    for (i = 0; i < 16; i++)
-      expectedXPram[group1Base+i] = rand() & 0xff;
-    // Randomly initialize group 2 registers.
-    for (i = 0; i < 4; i++)
-      expectedXPram[group2Base+i] = rand() & 0xff;
-    // Copy both groups to RTC.
-    memcpy(pram + group1Base, expectedXPram + group1Base, 16);
-    memcpy(pram + group2Base, expectedXPram + group2Base, 4);
-    if (verbose) {
-      prTsStat("INFO:Expected data:\n");
-      execMonLine("0008.001f\n");
+    // Collect output from the running test cases.
+    for (i = 0; i < NUM_TEST_CASES; i++) {
+      if (jobs[i].fd != -1) {
+        fds[numFds].fd = jobs[i].fd;
+        fds[numFds].events = POLLIN;
+        fdJob[numFds++] = i;
+      }
     }
-    loadAllTradMem();
-    // Zero our host copy to be sure we don't compare stale data.
-    memset(pram + group1Base, 0, 16);
-    memset(pram + group2Base, 0, 4);
-    dumpAllTradMem();
-    if (verbose) {
-      prTsStat("INFO:Actual data:\n");
-      execMonLine("0008.001f\n");
+    if (numFds == 0)
+      continue;
+    if (poll(fds, numFds, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
     }
-    result &= (memcmp(pram + group1Base,
-                      expectedXPram + group1Base, 16) == 0);
-    result &= (memcmp(pram + group2Base,
-                      expectedXPram + group2Base, 4) == 0);
-    recTsResult(result, "Load and dump traditional PRAM");
-
-    if (!testXPram)
-      recTsSkip("Load and dump XPRAM");
-    else {
-      setMonMode(2);
-      for (i = 0; i < 256; i++)
-        expectedXPram[i] = rand() & 0xff;
-      memcpy(pram, expectedXPram, 256);
-      if (verbose) {
-        prTsStat("INFO:Expected data:\n");
-        execMonLine("0000.00ff\n");
-      }
-      loadAllXMem();
-      // Zero our host copy to be sure we don't compare stale data.
-      memset(pram, 0, 256);
-      dumpAllXMem();
-      if (verbose) {
-        prTsStat("INFO:Actual data:\n");
-        execMonLine("0000.00ff\n");
+    for (i = 0; i < numFds; i++) {
+      struct TsJob *job = &jobs[fdJob[i]];
+      char buf[4096];
+      ssize_t len;
+      if (fds[i].revents == 0)
+        continue;
+      len = read(job->fd, buf, sizeof(buf));
+      if (len > 0) {
+        char *newOut = (char *)realloc(job->out, job->outLen + len);
+        if (newOut == NULL)
+          continue;
+        job->out = newOut;
+        memcpy(job->out + job->outLen, buf, len);
+        job->outLen += len;
+      } else if (len == 0 || errno != EINTR) {
+        close(job->fd);
+        job->fd = -1;
+        waitpid(job->pid, NULL, 0);
+        job->done = true;
+        running--;
       }
-      result = (memcmp(pram, expectedXPram, 256) == 0);
-      recTsResult(result, "Load and dump XPRAM");
     }
-
-    setMonMode(oldMonMode);
   }
+  if (latStats != MAP_FAILED)
+    munmap(latStats, NUM_TEST_CASES * sizeof(*latStats));
+}
 
-  { /* Send invalid communication bit sequence, de-select, re-select
-       chip, then send a valid communication sequence.  Verify that
-       chip can robustly recover from invalid communication
-       sequences.
+bool8_t autoTestSuite(bool8_t verbose, bool8_t simRealTime,
+                      bool8_t testXPram)
+{
+  unsigned numJobs = g_suiteJobs;
+  unsigned i;
+  suiteStart();
 
-       It turns out that the protocol is actually quite robust, the
-       only way to potentially cause an invalid communication state
-       would be to disable the chip-enable line before a communication
-       sequence is complete.  */
-    bool8_t result = false;
-    byte testVal;
-    genSendWriteCmd(0x10, 0xcd);
-    serialBegin();
-    { /* Fragmented sendByte() that would otherwise clobber the byte
-         we just wrote.  Send only 6 out of 8 bits.  */
-      uint8_t data = genCmd(0x10, true);
-      uint8_t bitNum = 0;
-      viaBitWrite(vBase + vDirB, rtcData, DIR_OUT);
-      while (bitNum <= 5) {
-        uint8_t bit = (data >> (7 - bitNum)) & 1;
-        bitNum++;
-        viaBitWrite(vBase + vBufB, rtcData, bit);
-        waitQuarterCycle();
-        viaBitWrite(vBase + vBufB, rtcClk, 1);
-        waitHalfCycle();
-        viaBitWrite(vBase + vBufB, rtcClk, 0);
-        waitQuarterCycle();
-      }
-    }
-    serialEnd();
-    testVal = genSendReadCmd(0x10);
-    if (verbose) {
-      prTsStat("INFO:");
-      printf("0x%02x ?= 0x%02x\n", testVal, 0xcd);
+  // Time-based tests are always enabled under virtual time since
+  // they can no longer be disturbed by host scheduling delays.
+  if (!g_phyMode && g_simVirtTime)
+    simRealTime = true;
+
+  // Use a non-deterministic seed for randomized tests... but print
+  // out the value just in case we want to go deterministic.  Each
+  // test case gets its own seed derived from it, so that results
+  // don't depend on which other test cases were run.
+  time_t seed = time(NULL);
+  prTsStat("INFO:");
+  printf("random seed = 0x%08x\n", seed);
+
+  /* Test cases can only be run in parallel under simulation, and
+     forking only carries over the calling thread, so not with the
+     simulator on its own thread.  */
+  if (numJobs == 0)
+    numJobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (g_phyMode || g_simThreaded)
+    numJobs = 1;
+
+  if (!g_phyMode)
+    simCall(simLatReset);
+  if (numJobs > 1)
+    runTestCasesParallel(numJobs, seed, verbose, simRealTime, testXPram);
+  else {
+    for (i = 0; i < NUM_TEST_CASES; i++) {
+      if (!tsCaseSelected(g_testCases[i].name))
+        continue;
+      runTestCase(i, seed, verbose, simRealTime, testXPram);
     }
-    result = (testVal == 0xcd);
-    recTsResult(result, "Recovery from invalid communication");
+  }
+  if (!g_phyMode) {
+    putchar('\n');
+    simCall(simLatReport);
   }
 
   return suiteEnd();
@@ -2945,10 +6863,20 @@ bool8_t autoTestSuite(bool8_t verbose, bool8_t simRealTime,
 #include "auto-test-suite.h"
 */
 
+// PRAM image file to save on exit, NULL for none.
+char *g_dumpMemName = NULL;
+
 void mainCleanup(void)
 {
+  if (g_dumpMemName != NULL) {
+    char *dumpMemName = g_dumpMemName;
+    g_dumpMemName = NULL; // Only try once.
+    if (!fileDumpAllMem(dumpMemName))
+      fprintf(stderr, "cannot save PRAM to '%s'\n", dumpMemName);
+  }
   viaDestroy();
   if (!g_phyMode) {
+    simThreadStop();
     if (avr)
       { avr_terminate(avr); avr = NULL; }
   }
@@ -2967,6 +6895,11 @@ int main(int argc, char *argv[])
 {
   char *firmwareName = "";
   bool8_t interactMode = false;
+  int8_t timeMode = -1; // -1 = default, 0 = real time, 1 = virtual time
+  int8_t threadMode = -1; // -1 = default, 0 = single, 1 = sim thread
+  char *snapName = NULL;
+  char *loadMemName = NULL;
+  char *replayName = NULL;
   int retVal;
 
   { // Parse command-line arguments.
@@ -2975,15 +6908,115 @@ int main(int argc, char *argv[])
       if (strcmp(argv[i], "-h") == 0 ||
           strcmp(argv[i], "--help") == 0) {
         printf(
-"Usage: %s [-i] [-r a,b,c,d] [FIRMWARE_FILE]\n"
+"Usage: %s [-i] [-R|-V] [-T|-S] [-f HZ] [-s SNAPSHOT] [-L N]\n"
+"       [-m FILE] [-M FILE] [-j JOBS] [-t CASE,...] [-l] [-F FILE]\n"
+"       [-r a,b,c,d]\n"
+"       [FIRMWARE_FILE]\n"
 "\n"
 "    -i  Run interactive mode\n"
+"    -R  Real-time simulation, default in interactive mode\n"
+"    -V  Virtual time simulation, default for the automated test suite\n"
+"    -T  Run the simulator on its own thread, default in interactive mode\n"
+"    -S  Run the simulator on the test bench thread, default for the\n"
+"        automated test suite\n"
+"    -f  Override the simulated AVR core clock frequency.  By default,\n"
+"        the F_CPU that the firmware was built for is used.\n"
+"    -s  Start from a snapshot saved by `file-sim-snapshot' rather\n"
+"        than from power-on.\n"
+"    -L  Transaction-level PRAM access: read and write the firmware's\n"
+"        memory directly, cross-checking one in N transactions at the\n"
+"        bit level.  N = 0 never cross-checks.\n"
+"    -m  Load the RTC's PRAM from FILE at startup.\n"
+"    -M  Save the RTC's PRAM to FILE on exit.\n"
+"    -j  Run up to JOBS automated test cases in parallel, each in its\n"
+"        own simulation.  Zero, the default, uses one job per CPU.\n"
+"    -t  Only run the given automated test cases.\n"
+"    -l  List the automated test cases.\n"
+"    -F  Replay an input file saved by `fuzz-core' and check that the\n"
+"        RTC recovers, rather than running the automated test suite.\n"
 "    -r  Physical hardware test mode (via Raspberry Pi).\n"
 "        Configure SEC1,CE*,CLK,DATA to the given BCM GPIO pin numbers.\n"
 "\n", argv[0]);
         return 0;
       } else if (strcmp(argv[i], "-i") == 0)
         interactMode = true;
+      else if (strcmp(argv[i], "-R") == 0)
+        timeMode = 0;
+      else if (strcmp(argv[i], "-V") == 0)
+        timeMode = 1;
+      else if (strcmp(argv[i], "-T") == 0)
+        threadMode = 1;
+      else if (strcmp(argv[i], "-S") == 0)
+        threadMode = 0;
+      else if (strcmp(argv[i], "-f") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        g_simFrequency = strtoul(argv[i], NULL, 10);
+      }
+      else if (strcmp(argv[i], "-L") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        g_simTlMode = true;
+        g_simTlCheck = strtoul(argv[i], NULL, 10);
+      }
+      else if (strcmp(argv[i], "-m") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        loadMemName = argv[i];
+      }
+      else if (strcmp(argv[i], "-M") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        g_dumpMemName = argv[i];
+      }
+      else if (strcmp(argv[i], "-j") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        g_suiteJobs = strtoul(argv[i], NULL, 10);
+      }
+      else if (strcmp(argv[i], "-t") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        g_suiteCases = argv[i];
+      }
+      else if (strcmp(argv[i], "-l") == 0) {
+        listTestCases();
+        return 0;
+      }
+      else if (strcmp(argv[i], "-F") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        replayName = argv[i];
+      }
+      else if (strcmp(argv[i], "-s") == 0) {
+        i++;
+        if (i >= argc) {
+          fprintf(stderr, "%s: Missing command line argument.\n", argv[0]);
+          return 1;
+        }
+        snapName = argv[i];
+      }
       else if (strcmp(argv[i], "-r") == 0) {
         i++;
         if (i >= argc) {
@@ -3006,6 +7039,19 @@ int main(int argc, char *argv[])
     }
   }
 
+  // Interactive sessions are paced to real time by default, since a
+  // human at the console expects the RTC to count wall-clock seconds.
+  if (timeMode == -1)
+    g_simVirtTime = !interactMode;
+  else
+    g_simVirtTime = timeMode;
+  // Likewise, keep the simulated MCU running smoothly while a human
+  // is typing, but default to the simplest setup for the test suite.
+  if (threadMode == -1)
+    g_simThreaded = interactMode;
+  else
+    g_simThreaded = threadMode;
+
   signal(SIGINT, sig_int);
   signal(SIGTERM, sig_int);
 
@@ -3019,6 +7065,18 @@ int main(int argc, char *argv[])
     retVal = setupSimAvr(argv[0], firmwareName, interactMode);
   if (retVal != 0)
     return retVal;
+  if (!g_phyMode && snapName != NULL && !fileSimRestore(snapName)) {
+    fprintf(stderr, "%s: cannot restore snapshot '%s'\n",
+            argv[0], snapName);
+    mainCleanup();
+    return 1;
+  }
+  if (loadMemName != NULL && !fileLoadAllMem(loadMemName)) {
+    fprintf(stderr, "%s: cannot load PRAM from '%s'\n",
+            argv[0], loadMemName);
+    mainCleanup();
+    return 1;
+  }
 
   if (interactMode) {
     bool8_t notScripted = isatty(STDIN_FILENO);
@@ -3033,9 +7091,16 @@ int main(int argc, char *argv[])
     return 0;
   }
 
+  if (replayName != NULL) {
+    retVal = !fileReplayEdges(replayName);
+    fputs((retVal) ? "FAIL\n" : "PASS\n", stdout);
+    mainCleanup();
+    return retVal;
+  }
+
   // Run automated test suite.
   fputs("Running automated test suite.\n", stdout);
-  retVal = !autoTestSuite(false, true, true);
+  retVal = !autoTestSuite(false, true, getPramType());
   mainCleanup();
   return retVal;
 }